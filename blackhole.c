@@ -36,9 +36,10 @@
 #define TLB_STRIDED_REG_SIZE 4
 #define TLB_STRIDED_REGS_OFFSET (TLB_TOTAL_WINDOW_COUNT * TLB_REG_SIZE)
 
-#define KERNEL_TLB_INDEX (TLB_2M_WINDOW_COUNT - 1)	// Last 2M window is ours
-#define KERNEL_TLB_START (KERNEL_TLB_INDEX * TLB_2M_WINDOW_SIZE)
-#define KERNEL_TLB_LEN TLB_2M_WINDOW_SIZE
+// The last KERNEL_TLB_COUNT 2M windows are ours, one per enum bh_kernel_tlb.
+#define KERNEL_TLB_INDEX(which) (TLB_2M_WINDOW_COUNT - KERNEL_TLB_COUNT + (which))
+#define KERNEL_TLB_START (KERNEL_TLB_INDEX(0) * TLB_2M_WINDOW_SIZE)
+#define KERNEL_TLB_LEN (KERNEL_TLB_COUNT * TLB_2M_WINDOW_SIZE)
 
 #define NOC2AXI_CFG_START 0x1FD00000
 #define NOC2AXI_CFG_LEN 0x00100000
@@ -226,7 +227,8 @@ static int blackhole_configure_tlb_4G(struct blackhole_device *bh, int tlb,
 	return 0;
 }
 
-static u8 __iomem *bh_configure_kernel_tlb(struct blackhole_device *bh, u32 x, u32 y, u64 addr, int noc)
+static u8 __iomem *bh_configure_kernel_tlb(struct blackhole_device *bh, enum bh_kernel_tlb which,
+					   u32 x, u32 y, u64 addr, int noc)
 {
 	struct tenstorrent_noc_tlb_config config = { 0 };
 	u64 offset = addr & TLB_2M_WINDOW_MASK;
@@ -237,52 +239,70 @@ static u8 __iomem *bh_configure_kernel_tlb(struct blackhole_device *bh, u32 x, u
 	config.ordering	= 1; // strict
 	config.noc = noc;
 
-	blackhole_configure_tlb_2M(bh, KERNEL_TLB_INDEX, &config);
-	return bh->kernel_tlb + offset;
+	if (!bh->kernel_tlb_valid[which] || memcmp(&bh->kernel_tlb_config[which], &config, sizeof(config)) != 0) {
+		blackhole_configure_tlb_2M(bh, KERNEL_TLB_INDEX(which), &config);
+		bh->kernel_tlb_config[which] = config;
+		bh->kernel_tlb_valid[which] = true;
+	}
+
+	return bh->kernel_tlb + which * TLB_2M_WINDOW_SIZE + offset;
 }
 
-static u32 noc_read32(struct blackhole_device *bh, u32 x, u32 y, u64 addr, int noc)
+// A reset clears the TLB registers behind our back.
+static void bh_invalidate_kernel_tlbs(struct blackhole_device *bh)
+{
+	int i;
+
+	for (i = 0; i < KERNEL_TLB_COUNT; ++i) {
+		mutex_lock(&bh->kernel_tlb_mutex[i]);
+		bh->kernel_tlb_valid[i] = false;
+		mutex_unlock(&bh->kernel_tlb_mutex[i]);
+	}
+}
+
+static u32 noc_read32(struct blackhole_device *bh, enum bh_kernel_tlb which, u32 x, u32 y, u64 addr, int noc)
 {
 	u32 val;
 	u8 __iomem *tlb_window;
 
-	mutex_lock(&bh->kernel_tlb_mutex);
+	mutex_lock(&bh->kernel_tlb_mutex[which]);
 
-	tlb_window = bh_configure_kernel_tlb(bh, x, y, addr, noc);
+	tlb_window = bh_configure_kernel_tlb(bh, which, x, y, addr, noc);
 	val = ioread32(tlb_window);
 
-	mutex_unlock(&bh->kernel_tlb_mutex);
+	mutex_unlock(&bh->kernel_tlb_mutex[which]);
 
 	return val;
 }
 
-static void noc_write32(struct blackhole_device *bh, u32 x, u32 y, u64 addr, u32 data, int noc)
+static void noc_write32(struct blackhole_device *bh, enum bh_kernel_tlb which, u32 x, u32 y, u64 addr, u32 data,
+			int noc)
 {
 	u8 __iomem *tlb_window;
 
-	mutex_lock(&bh->kernel_tlb_mutex);
+	mutex_lock(&bh->kernel_tlb_mutex[which]);
 
-	tlb_window = bh_configure_kernel_tlb(bh, x, y, addr, noc);
+	tlb_window = bh_configure_kernel_tlb(bh, which, x, y, addr, noc);
 	iowrite32(data, tlb_window);
 
-	mutex_unlock(&bh->kernel_tlb_mutex);
+	mutex_unlock(&bh->kernel_tlb_mutex[which]);
 }
 
-static int csm_read32(struct blackhole_device *bh, u64 addr, u32 *value)
+static int csm_read32(struct blackhole_device *bh, enum bh_kernel_tlb which, u64 addr, u32 *value)
 {
 	if (!is_range_within_csm(addr, sizeof(u32)))
 		return -EINVAL;
 
-	*value = noc_read32(bh, ARC_X, ARC_Y, addr, 0);
+	*value = noc_read32(bh, which, ARC_X, ARC_Y, addr, 0);
 	return 0;
 }
 
-static int csm_write32(struct blackhole_device *bh, u64 addr, u32 value)
+static int csm_write32(struct blackhole_device *bh, enum bh_kernel_tlb which, u64 addr, u32 value)
 {
 	if (!is_range_within_csm(addr, sizeof(u32)))
 		return -EINVAL;
 
-	noc_write32(bh, ARC_X, ARC_Y, addr, value, 0);
+	noc_write32(bh, which, ARC_X, ARC_Y, addr, value, 0);
 	return 0;
 }
 
@@ -302,7 +322,7 @@ static void blackhole_save_reset_state(struct tenstorrent_device *tt_dev) {
 	if (!blackhole_detect_pcie_noc_x(bh, &x))
 		return;
 
-	device_control = noc_read32(bh, x, y, PCIE_DBI_ADDR + DBI_DEVICE_CONTROL_DEVICE_STATUS, 0);
+	device_control = noc_read32(bh, KERNEL_TLB_MISC, x, y, PCIE_DBI_ADDR + DBI_DEVICE_CONTROL_DEVICE_STATUS, 0);
 	bh->saved_mps = FIELD_GET(PCI_EXP_DEVCTL_PAYLOAD, device_control);
 }
 
@@ -312,13 +332,15 @@ static void blackhole_restore_reset_state(struct tenstorrent_device *tt_dev) {
 	u32 y = 0;
 	u32 device_control;
 
+	bh_invalidate_kernel_tlbs(bh);
+
 	if (!blackhole_detect_pcie_noc_x(bh, &x))
 		return;
 
-	device_control = noc_read32(bh, x, y, PCIE_DBI_ADDR + DBI_DEVICE_CONTROL_DEVICE_STATUS, 0);
+	device_control = noc_read32(bh, KERNEL_TLB_MISC, x, y, PCIE_DBI_ADDR + DBI_DEVICE_CONTROL_DEVICE_STATUS, 0);
 	device_control &= ~PCI_EXP_DEVCTL_PAYLOAD;
 	device_control |= FIELD_PREP(PCI_EXP_DEVCTL_PAYLOAD, bh->saved_mps);
-	noc_write32(bh, x, y, PCIE_DBI_ADDR + DBI_DEVICE_CONTROL_DEVICE_STATUS, device_control, 0);
+	noc_write32(bh, KERNEL_TLB_MISC, x, y, PCIE_DBI_ADDR + DBI_DEVICE_CONTROL_DEVICE_STATUS, device_control, 0);
 }
 
 static ssize_t bh_show_pcie_single_counter(struct device *dev, char *buf, u32 counter_offset, int noc)
@@ -434,7 +456,7 @@ static ssize_t sysfs_show_u32_dec(struct device *dev, struct device_attribute *a
 	u64 addr = bh->sysfs_attr_addrs[i];
 	u32 value = 0;
 
-	if (csm_read32(bh, addr, &value) != 0)
+	if (csm_read32(bh, KERNEL_TLB_TELEMETRY, addr, &value) != 0)
 		return -EINVAL;
 
 	return snprintf(buf, PAGE_SIZE, "%u\n", value);
@@ -449,10 +471,10 @@ static ssize_t sysfs_show_u64_hex(struct device *dev, struct device_attribute *a
 	u64 addr = bh->sysfs_attr_addrs[i];
 	u32 hi, lo;
 
-	if (csm_read32(bh, addr, &hi) != 0)
+	if (csm_read32(bh, KERNEL_TLB_TELEMETRY, addr, &hi) != 0)
 		return -EINVAL;
 
-	if (csm_read32(bh, addr + 4, &lo) != 0)
+	if (csm_read32(bh, KERNEL_TLB_TELEMETRY, addr + 4, &lo) != 0)
 		return -EINVAL;
 
 	return scnprintf(buf, PAGE_SIZE, "%08X%08X\n", hi, lo);
@@ -468,7 +490,7 @@ static ssize_t sysfs_show_u32_ver(struct device *dev, struct device_attribute *a
 	u32 fw_ver = 0;
 	u32 major, minor, patch, ver;
 
-	if (csm_read32(bh, addr, &fw_ver) != 0)
+	if (csm_read32(bh, KERNEL_TLB_TELEMETRY, addr, &fw_ver) != 0)
 		return -EINVAL;
 
 	major = (fw_ver >> 24) & 0xFF;
@@ -490,7 +512,7 @@ static ssize_t sysfs_show_card_type(struct device *dev, struct device_attribute
 	u16 card_type;
 	char *card_name;
 
-	if (csm_read32(bh, addr, &board_id_hi) != 0)
+	if (csm_read32(bh, KERNEL_TLB_TELEMETRY, addr, &board_id_hi) != 0)
 		return -EINVAL;
 
 	card_type = (board_id_hi >> 4) & 0xFFFF;
@@ -554,7 +576,7 @@ static int bh_hwmon_read(struct device *dev, enum hwmon_sensor_types type, u32 a
 			if (bh->hwmon_attr_addrs[i] == 0)
 				return -ENOTSUPP;
 
-			raw = noc_read32(bh, ARC_X, ARC_Y, bh->hwmon_attr_addrs[i], 0);
+			raw = noc_read32(bh, KERNEL_TLB_TELEMETRY, ARC_X, ARC_Y, bh->hwmon_attr_addrs[i], 0);
 
 			if (type == hwmon_temp) {
 				u32 int_part = raw >> 16;
@@ -613,8 +635,8 @@ static const struct hwmon_chip_info bh_hwmon_chip_info = {
 static int telemetry_probe(struct tenstorrent_device *tt_dev)
 {
 	struct blackhole_device *bh = tt_dev_to_bh_dev(tt_dev);
-	u32 base_addr = noc_read32(bh, ARC_X, ARC_Y, ARC_TELEMETRY_PTR, 0);
-	u32 data_addr = noc_read32(bh, ARC_X, ARC_Y, ARC_TELEMETRY_DATA, 0);
+	u32 base_addr = noc_read32(bh, KERNEL_TLB_TELEMETRY, ARC_X, ARC_Y, ARC_TELEMETRY_PTR, 0);
+	u32 data_addr = noc_read32(bh, KERNEL_TLB_TELEMETRY, ARC_X, ARC_Y, ARC_TELEMETRY_DATA, 0);
 	u32 version, major_ver, minor_ver, patch_ver;
 	u32 tags_addr = base_addr + 8;
 	u32 num_entries;
@@ -625,7 +647,7 @@ static int telemetry_probe(struct tenstorrent_device *tt_dev)
 		return -ENODEV;
 	}
 
-	version = noc_read32(bh, ARC_X, ARC_Y, base_addr, 0);
+	version = noc_read32(bh, KERNEL_TLB_TELEMETRY, ARC_X, ARC_Y, base_addr, 0);
 	major_ver = (version >> 16) & 0xFF;
 	minor_ver = (version >> 8) & 0xFF;
 	patch_ver = version & 0xFF;
@@ -635,10 +657,10 @@ static int telemetry_probe(struct tenstorrent_device *tt_dev)
 		return -ENOTSUPP;
 	}
 
-	num_entries = noc_read32(bh, ARC_X, ARC_Y, base_addr + 4, 0);
+	num_entries = noc_read32(bh, KERNEL_TLB_TELEMETRY, ARC_X, ARC_Y, base_addr + 4, 0);
 
 	for (i = 0; i < num_entries; ++i) {
-		u32 tag_entry = noc_read32(bh, ARC_X, ARC_Y, tags_addr + (i * 4), 0);
+		u32 tag_entry = noc_read32(bh, KERNEL_TLB_TELEMETRY, ARC_X, ARC_Y, tags_addr + (i * 4), 0);
 		u16 tag_id = tag_entry & 0xFFFF;
 		u16 offset = (tag_entry >> 16) & 0xFFFF;
 		u32 addr = data_addr + (offset * 4);
@@ -675,7 +697,7 @@ static bool push_arc_msg(struct blackhole_device *bh, const struct arc_msg *msg,
 	u32 req_offset;
 	int i;
 
-	if (csm_read32(bh, ARC_MSG_QUEUE_REQ_WPTR(queue_base), &wptr) != 0)
+	if (csm_read32(bh, KERNEL_TLB_ARC, ARC_MSG_QUEUE_REQ_WPTR(queue_base), &wptr) != 0)
 		return false;
 
 	// Wait until there is space in the request queue or we timeout.
@@ -684,7 +706,7 @@ static bool push_arc_msg(struct blackhole_device *bh, const struct arc_msg *msg,
 		u32 rptr;
 		u32 num_occupied;
 
-		if (csm_read32(bh, ARC_MSG_QUEUE_REQ_RPTR(queue_base), &rptr) != 0)
+		if (csm_read32(bh, KERNEL_TLB_ARC, ARC_MSG_QUEUE_REQ_RPTR(queue_base), &rptr) != 0)
 			return false;
 
 		num_occupied = (wptr - rptr) % (2 * num_entries);
@@ -706,13 +728,13 @@ static bool push_arc_msg(struct blackhole_device *bh, const struct arc_msg *msg,
 		u32 addr = request_base + req_offset + (i * sizeof(u32));
 		u32 value = (i == 0) ? msg->header : msg->payload[i - 1];
 
-		if (csm_write32(bh, addr, value) != 0)
+		if (csm_write32(bh, KERNEL_TLB_ARC, addr, value) != 0)
 			return false;
 	}
 
 	// Increment the request write pointer.
 	wptr = (wptr + 1) % (2 * num_entries);
-	if (csm_write32(bh, ARC_MSG_QUEUE_REQ_WPTR(queue_base), wptr) != 0)
+	if (csm_write32(bh, KERNEL_TLB_ARC, ARC_MSG_QUEUE_REQ_WPTR(queue_base), wptr) != 0)
 		return false;
 
 	return true;
@@ -727,7 +749,7 @@ static bool pop_arc_msg(struct blackhole_device *bh, struct arc_msg *msg, u32 qu
 	u32 response_offset ;
 	int i;
 
-	if (csm_read32(bh, ARC_MSG_QUEUE_RES_RPTR(queue_base), &rptr) != 0)
+	if (csm_read32(bh, KERNEL_TLB_ARC, ARC_MSG_QUEUE_RES_RPTR(queue_base), &rptr) != 0)
 		return false;
 
 	// Wait until there is a message in the response queue or we timeout.
@@ -736,7 +758,7 @@ static bool pop_arc_msg(struct blackhole_device *bh, struct arc_msg *msg, u32 qu
 		u32 wptr;
 		u32 num_occupied;
 
-		if (csm_read32(bh, ARC_MSG_QUEUE_RES_WPTR(queue_base), &wptr) != 0)
+		if (csm_read32(bh, KERNEL_TLB_ARC, ARC_MSG_QUEUE_RES_WPTR(queue_base), &wptr) != 0)
 			return false;
 
 		num_occupied = (wptr - rptr) % (2 * num_entries);
@@ -754,19 +776,19 @@ static bool pop_arc_msg(struct blackhole_device *bh, struct arc_msg *msg, u32 qu
 	// Read the message header and payload from the response queue.
 	slot = rptr % num_entries;
 	response_offset = slot * sizeof(struct arc_msg);
-	if (csm_read32(bh, response_base + response_offset, &msg->header) != 0)
+	if (csm_read32(bh, KERNEL_TLB_ARC, response_base + response_offset, &msg->header) != 0)
 		return false;
 
 	for (i = 0; i < 7; ++i) {
 		u32 addr = response_base + response_offset + ((i + 1) * sizeof(u32));
 
-		if (csm_read32(bh, addr, &msg->payload[i]) != 0)
+		if (csm_read32(bh, KERNEL_TLB_ARC, addr, &msg->payload[i]) != 0)
 			return false;
 	}
 
 	// Increment the response read pointer.
 	rptr = (rptr + 1) % (2 * num_entries);
-	if (csm_write32(bh, ARC_MSG_QUEUE_RES_RPTR(queue_base), rptr) != 0)
+	if (csm_write32(bh, KERNEL_TLB_ARC, ARC_MSG_QUEUE_RES_RPTR(queue_base), rptr) != 0)
 		return false;
 
 	return true;
@@ -782,7 +804,7 @@ static bool send_arc_message(struct blackhole_device *bh, struct arc_msg *msg)
 	unsigned long timeout = jiffies + msecs_to_jiffies(ARC_MSG_READY_MS);
 
 	do {
-		boot_status = noc_read32(bh, ARC_X, ARC_Y, ARC_BOOT_STATUS, 0);
+		boot_status = noc_read32(bh, KERNEL_TLB_ARC, ARC_X, ARC_Y, ARC_BOOT_STATUS, 0);
 		if (boot_status & ARC_BOOT_STATUS_READY_FOR_MSG)
 			break;
 	} while (time_before(jiffies, timeout));
@@ -790,12 +812,12 @@ static bool send_arc_message(struct blackhole_device *bh, struct arc_msg *msg)
 	if (!(boot_status & ARC_BOOT_STATUS_READY_FOR_MSG))
 		return false;
 
-	queue_ctrl_addr = noc_read32(bh, ARC_X, ARC_Y, ARC_MSG_QCB_PTR, 0);
+	queue_ctrl_addr = noc_read32(bh, KERNEL_TLB_ARC, ARC_X, ARC_Y, ARC_MSG_QCB_PTR, 0);
 
-	if (csm_read32(bh, queue_ctrl_addr + 0, &queue_base) != 0)
+	if (csm_read32(bh, KERNEL_TLB_ARC, queue_ctrl_addr + 0, &queue_base) != 0)
 		return false;
 
-	if (csm_read32(bh, queue_ctrl_addr + 4, &queue_info) != 0)
+	if (csm_read32(bh, KERNEL_TLB_ARC, queue_ctrl_addr + 4, &queue_info) != 0)
 		return false;
 
 	num_entries = queue_info & 0xFF;
@@ -804,7 +826,7 @@ static bool send_arc_message(struct blackhole_device *bh, struct arc_msg *msg)
 		return false;
 
 	// Trigger ARC interrupt
-	noc_write32(bh, ARC_X, ARC_Y, ARC_MSI_FIFO, 0, 0);
+	noc_write32(bh, KERNEL_TLB_ARC, ARC_X, ARC_Y, ARC_MSI_FIFO, 0, 0);
 
 	if (!pop_arc_msg(bh, msg, queue_base, num_entries))
 		return false;
@@ -833,9 +855,11 @@ static bool blackhole_reset(struct tenstorrent_device *tt_dev, u32 reset_flag)
 		msg.header = ARC_MSG_TYPE_TRIGGER_RESET;
 		msg.payload[0] = reset_arg;
 		send_arc_message(bh, &msg);
+		bh_invalidate_kernel_tlbs(bh);
 		return true; // Possibly a lie...
 	} else if (reset_flag == TENSTORRENT_RESET_DEVICE_ASIC_RESET) {
 		set_reset_marker(pdev);
+		bh_invalidate_kernel_tlbs(bh);
 		return pcie_timer_interrupt(pdev);
 	}
 
@@ -876,9 +900,11 @@ static bool blackhole_init(struct tenstorrent_device *tt_dev)
 		return false;
 	}
 
-	// Claim the topmost 2M window for kernel use.
-	set_bit(KERNEL_TLB_INDEX, tt_dev->tlbs);
-	mutex_init(&bh->kernel_tlb_mutex);
+	// Claim the topmost 2M windows for kernel use.
+	for (i = 0; i < KERNEL_TLB_COUNT; ++i) {
+		set_bit(KERNEL_TLB_INDEX(i), tt_dev->tlbs);
+		mutex_init(&bh->kernel_tlb_mutex[i]);
+	}
 
 	for (i = 0; i < ARRAY_SIZE(bh_sysfs_attributes); ++i)
 		tt_dev->telemetry_attrs[i] = &bh_sysfs_attributes[i].attr.attr;
@@ -1028,7 +1054,26 @@ static int blackhole_configure_outbound_atu(struct tenstorrent_device *tt_dev, u
 static void blackhole_noc_write32(struct tenstorrent_device *tt_dev, u32 x, u32 y, u64 addr, u32 data, int noc)
 {
 	struct blackhole_device *bh = tt_dev_to_bh_dev(tt_dev);
-	noc_write32(bh, x, y, addr, data, noc);
+	noc_write32(bh, KERNEL_TLB_MISC, x, y, addr, data, noc);
+}
+
+// Bulk copies share KERNEL_TLB_MISC with noc_write32.
+static u8 __iomem *blackhole_configure_kernel_window(struct tenstorrent_device *tt_dev, u32 x, u32 y, u64 addr,
+						     int noc, size_t *len)
+{
+	struct blackhole_device *bh = tt_dev_to_bh_dev(tt_dev);
+
+	*len = min_t(u64, *len, TLB_2M_WINDOW_SIZE - (addr & TLB_2M_WINDOW_MASK));
+
+	mutex_lock(&bh->kernel_tlb_mutex[KERNEL_TLB_MISC]);
+	return bh_configure_kernel_tlb(bh, KERNEL_TLB_MISC, x, y, addr, noc);
+}
+
+static void blackhole_release_kernel_window(struct tenstorrent_device *tt_dev)
+{
+	struct blackhole_device *bh = tt_dev_to_bh_dev(tt_dev);
+
+	mutex_unlock(&bh->kernel_tlb_mutex[KERNEL_TLB_MISC]);
 }
 
 struct tenstorrent_device_class blackhole_class = {
@@ -1052,4 +1097,6 @@ struct tenstorrent_device_class blackhole_class = {
 	.restore_reset_state = blackhole_restore_reset_state,
 	.configure_outbound_atu = blackhole_configure_outbound_atu,
 	.noc_write32 = blackhole_noc_write32,
+	.configure_kernel_window = blackhole_configure_kernel_window,
+	.release_kernel_window = blackhole_release_kernel_window,
 };
@@ -7,12 +7,25 @@
 #include <linux/types.h>
 #include "device.h"
 
+// Kernel NOC accesses are split by purpose over separate TLB windows, so that
+// e.g. polling telemetry doesn't wait behind an ARC message.
+enum bh_kernel_tlb {
+	KERNEL_TLB_TELEMETRY,	// hwmon, sysfs and telemetry discovery
+	KERNEL_TLB_ARC,		// ARC message queue
+	KERNEL_TLB_MISC,	// everything else: DBI, NOC cleanup writes
+	KERNEL_TLB_COUNT
+};
+
 struct blackhole_device {
 	struct tenstorrent_device tt;
 
-	struct mutex kernel_tlb_mutex;	// Guards access to kernel_tlb
+	struct mutex kernel_tlb_mutex[KERNEL_TLB_COUNT];	// Guards each window of kernel_tlb
+	// What each kernel window is programmed with, so repeated accesses to
+	// the same 2M page skip the register writes. Cleared by a reset.
+	struct tenstorrent_noc_tlb_config kernel_tlb_config[KERNEL_TLB_COUNT];
+	bool kernel_tlb_valid[KERNEL_TLB_COUNT];
 	u8 __iomem *tlb_regs;   // All TLB registers
-	u8 __iomem *kernel_tlb; // Topmost 2M window, reserved for kernel
+	u8 __iomem *kernel_tlb; // Topmost KERNEL_TLB_COUNT 2M windows, reserved for kernel
 	u8 __iomem *noc2axi_cfg;
 	u8 __iomem *bar2_mapping;
 
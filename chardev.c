@@ -13,9 +13,13 @@
 #include <linux/slab.h>
 #include <linux/pci.h>
 #include <linux/uaccess.h>
+#include <linux/mm.h>
+#include <linux/sched/signal.h>
+#include <linux/sizes.h>
 #include <linux/version.h>
 #include <linux/debugfs.h>
 #include <linux/proc_fs.h>
+#include <linux/topology.h>
 
 #include "chardev_private.h"
 #include "device.h"
@@ -39,6 +43,9 @@ static struct file_operations chardev_fops = {
 	.owner = THIS_MODULE,
 	.unlocked_ioctl = tt_cdev_ioctl,
 	.mmap = tt_cdev_mmap,
+#ifdef TENSTORRENT_HUGE_DMABUF_MAP
+	.get_unmapped_area = thp_get_unmapped_area,	// PMD-align DMA buffer mappings
+#endif
 	.open = tt_cdev_open,
 	.release = tt_cdev_release,
 };
@@ -123,8 +130,10 @@ void tenstorrent_unregister_device(struct tenstorrent_device *tt_dev)
 static long ioctl_get_device_info(struct chardev_private *priv,
 				  struct tenstorrent_get_device_info __user *arg)
 {
-	const struct pci_dev *pdev = priv->device->pdev;
+	struct pci_dev *pdev = priv->device->pdev;
+	const struct cpumask *local_cpus;
 	u32 bytes_to_copy;
+	unsigned int cpu;
 
 	struct tenstorrent_get_device_info_in in;
 	struct tenstorrent_get_device_info_out out;
@@ -142,6 +151,15 @@ static long ioctl_get_device_info(struct chardev_private *priv,
 	out.bus_dev_fn = PCI_DEVID(pdev->bus->number, pdev->devfn);
 	out.max_dma_buf_size_log2 = MAX_DMA_BUF_SIZE_LOG2;
 	out.pci_domain = pci_domain_nr(pdev->bus);
+	out.numa_node = dev_to_node(&pdev->dev);
+
+	// Same as sysfs local_cpus: all CPUs if the node is unknown.
+	local_cpus = cpumask_of_pcibus(pdev->bus);
+	for_each_cpu(cpu, local_cpus) {
+		if (cpu >= ARRAY_SIZE(out.local_cpus) * 32)
+			break;
+		out.local_cpus[cpu / 32] |= 1u << (cpu % 32);
+	}
 
 	if (clear_user(&arg->out, in.output_size_bytes) != 0)
 		return -EFAULT;
@@ -199,10 +217,18 @@ static long ioctl_reset_device(struct chardev_private *priv,
 	if (copy_from_user(&in, &arg->in, sizeof(in)) != 0)
 		return -EFAULT;
 
+	// Every flag up to ASIC_DMC_RESET resets the chip, or follows a reset
+	// done behind our back, so the TLB window registers can't be trusted
+	// until they're reprogrammed. POST_RESET only follows one of them.
+	if (in.flags <= TENSTORRENT_RESET_DEVICE_ASIC_DMC_RESET)
+		tenstorrent_device_invalidate_tlbs(priv->device);
+
 	if (in.flags == TENSTORRENT_RESET_DEVICE_RESTORE_STATE) {
 		if (safe_pci_restore_state(pdev)) {
 			priv->device->dev_class->restore_reset_state(priv->device);
 			ok = priv->device->dev_class->init_hardware(priv->device);
+			if (ok)
+				tenstorrent_device_restore_tlbs(priv->device);
 		} else {
 			ok = false;
 		}
@@ -229,6 +255,8 @@ static long ioctl_reset_device(struct chardev_private *priv,
 			if (safe_pci_restore_state(pdev)) {
 				priv->device->dev_class->restore_reset_state(priv->device);
 				ok = priv->device->dev_class->init_hardware(priv->device);
+				if (ok)
+					tenstorrent_device_restore_tlbs(priv->device);
 			} else {
 				ok = false;
 			}
@@ -362,6 +390,83 @@ static long ioctl_set_noc_cleanup(struct chardev_private *priv,
 	return 0;
 }
 
+// Size of the kernel bounce buffer, and so of each copy to or from userspace.
+#define NOC_RW_CHUNK_SIZE SZ_64K
+
+static long ioctl_noc_rw(struct chardev_private *priv, struct tenstorrent_noc_rw __user *arg, bool write)
+{
+	struct tenstorrent_device *tt_dev = priv->device;
+	struct tenstorrent_noc_rw data = {0};
+	u8 __user *buffer;
+	u8 *bounce;
+	long ret = 0;
+
+	if (!tt_dev->dev_class->configure_kernel_window)
+		return -EOPNOTSUPP;
+
+	if (copy_from_user(&data, arg, sizeof(data)) != 0)
+		return -EFAULT;
+
+	if (data.argsz != sizeof(data))
+		return -EINVAL;
+
+	if (data.flags != 0 || data.reserved0 != 0 || data.reserved1 != 0)
+		return -EINVAL;
+
+	if (data.noc > 1)
+		return -EINVAL;
+
+	// Same coordinate check as SET_NOC_CLEANUP.
+	if (data.x > 64 || data.y > 64)
+		return -EINVAL;
+
+	if (data.size == 0 || (data.addr & 0x3) || (data.size & 0x3))
+		return -EINVAL;
+
+	if (data.addr + data.size < data.addr)
+		return -EINVAL;
+
+	buffer = u64_to_user_ptr(data.buffer);
+
+	bounce = kvmalloc(min_t(u64, data.size, NOC_RW_CHUNK_SIZE), GFP_KERNEL);
+	if (!bounce)
+		return -ENOMEM;
+
+	while (data.size > 0) {
+		size_t chunk = min_t(u64, data.size, NOC_RW_CHUNK_SIZE);
+
+		if (fatal_signal_pending(current)) {
+			ret = -EINTR;
+			break;
+		}
+
+		if (write) {
+			if (copy_from_user(bounce, buffer, chunk) != 0) {
+				ret = -EFAULT;
+				break;
+			}
+
+			tenstorrent_noc_write(tt_dev, data.x, data.y, data.addr, bounce, chunk, data.noc);
+		} else {
+			tenstorrent_noc_read(tt_dev, data.x, data.y, data.addr, bounce, chunk, data.noc);
+
+			if (copy_to_user(buffer, bounce, chunk) != 0) {
+				ret = -EFAULT;
+				break;
+			}
+		}
+
+		data.addr += chunk;
+		data.size -= chunk;
+		buffer += chunk;
+
+		cond_resched();
+	}
+
+	kvfree(bounce);
+	return ret;
+}
+
 static long tt_cdev_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
 {
 	long ret = -EINVAL;
@@ -430,6 +535,58 @@ static long tt_cdev_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
 			ret = ioctl_set_noc_cleanup(priv, (struct tenstorrent_set_noc_cleanup __user *)arg);
 			break;
 
+		case TENSTORRENT_IOCTL_PIN_PAGES_BATCH:
+			ret = ioctl_pin_pages_batch(priv, (struct tenstorrent_pin_pages_batch __user *)arg);
+			break;
+
+		case TENSTORRENT_IOCTL_UNPIN_PAGES_BATCH:
+			ret = ioctl_unpin_pages_batch(priv, (struct tenstorrent_unpin_pages_batch __user *)arg);
+			break;
+
+		case TENSTORRENT_IOCTL_ALLOCATE_DMA_BUF_V2:
+			ret = ioctl_allocate_dma_buf_v2(priv, (struct tenstorrent_allocate_dma_buf_v2 __user *)arg);
+			break;
+
+		case TENSTORRENT_IOCTL_FREE_DMA_BUF_V2:
+			ret = ioctl_free_dma_buf_v2(priv, (struct tenstorrent_free_dma_buf_v2 __user *)arg);
+			break;
+
+		case TENSTORRENT_IOCTL_EXPORT_DMA_BUF:
+			ret = ioctl_export_dma_buf(priv, f, (struct tenstorrent_export_dma_buf __user *)arg);
+			break;
+
+		case TENSTORRENT_IOCTL_IMPORT_DMA_BUF:
+			ret = ioctl_import_dma_buf(priv, (struct tenstorrent_import_dma_buf __user *)arg);
+			break;
+
+		case TENSTORRENT_IOCTL_UNIMPORT_DMA_BUF:
+			ret = ioctl_unimport_dma_buf(priv, (struct tenstorrent_unimport_dma_buf __user *)arg);
+			break;
+
+		case TENSTORRENT_IOCTL_SHARE_PINNING:
+			ret = ioctl_share_pinning(priv, (struct tenstorrent_share_pinning __user *)arg);
+			break;
+
+		case TENSTORRENT_IOCTL_SYNC_PINNED_PAGES:
+			ret = ioctl_sync_pinned_pages(priv, (struct tenstorrent_sync_pinned_pages __user *)arg);
+			break;
+
+		case TENSTORRENT_IOCTL_CONFIGURE_TLB_BATCH:
+			ret = ioctl_configure_tlb_batch(priv, (struct tenstorrent_configure_tlb_batch __user *)arg);
+			break;
+
+		case TENSTORRENT_IOCTL_GET_TLB_CONFIG:
+			ret = ioctl_get_tlb_config(priv, (struct tenstorrent_get_tlb_config __user *)arg);
+			break;
+
+		case TENSTORRENT_IOCTL_NOC_READ:
+			ret = ioctl_noc_rw(priv, (struct tenstorrent_noc_rw __user *)arg, false);
+			break;
+
+		case TENSTORRENT_IOCTL_NOC_WRITE:
+			ret = ioctl_noc_rw(priv, (struct tenstorrent_noc_rw __user *)arg, true);
+			break;
+
 		default:
 			ret = -EINVAL;
 			break;
@@ -466,6 +623,18 @@ static void decrement_cdev_open_count(struct tenstorrent_device *tt_dev) {
 	mutex_unlock(&tt_dev->chardev_mutex);
 }
 
+// The slow half of tt_cdev_release: unmap, unpin and free the fd's memory.
+static void tt_cdev_release_work(struct work_struct *work)
+{
+	struct chardev_private *priv = container_of(work, struct chardev_private, release_work);
+	struct tenstorrent_device *tt_dev = priv->device;
+
+	tenstorrent_memory_cleanup(priv);
+	kfree(priv);
+
+	tenstorrent_device_put(tt_dev);
+}
+
 static int tt_cdev_open(struct inode *inode, struct file *file)
 {
 	struct tenstorrent_device *tt_dev = inode_to_tt_dev(inode);
@@ -477,8 +646,12 @@ static int tt_cdev_open(struct inode *inode, struct file *file)
 
 	mutex_init(&private_data->mutex);
 
-	hash_init(private_data->dmabufs);
-	INIT_LIST_HEAD(&private_data->pinnings);
+	idr_init(&private_data->dmabufs);
+	idr_init(&private_data->imports);
+	private_data->dmabuf_offsets = RB_ROOT;
+	private_data->pinnings = RB_ROOT_CACHED;
+	INIT_WORK(&private_data->pin_cache_work, tenstorrent_pin_cache_evict);
+	INIT_WORK(&private_data->release_work, tt_cdev_release_work);
 	INIT_LIST_HEAD(&private_data->peer_mappings);
 	INIT_LIST_HEAD(&private_data->bar_mappings);
 
@@ -503,6 +676,7 @@ static int tt_cdev_release(struct inode *inode, struct file *file)
 	struct chardev_private *priv = file->private_data;
 	struct tenstorrent_device *tt_dev = priv->device;
 	unsigned int bitpos;
+	bool deferred;
 
 	if (!tt_dev->detached && priv->noc_cleanup.enabled) {
 		tt_dev->dev_class->noc_write32(
@@ -516,7 +690,9 @@ static int tt_cdev_release(struct inode *inode, struct file *file)
 
 	decrement_cdev_open_count(tt_dev);
 
-	tenstorrent_memory_cleanup(priv);
+	// Cut off the device's access to the fd's memory now. Releasing the
+	// memory itself can take seconds for big pinnings, so that's deferred.
+	tenstorrent_memory_revoke(priv);
 
 	// Release all locally held resources.
 	for (bitpos = 0; bitpos < TENSTORRENT_RESOURCE_LOCK_COUNT; ++bitpos) {
@@ -529,14 +705,17 @@ static int tt_cdev_release(struct inode *inode, struct file *file)
 	for_each_set_bit(bitpos, priv->tlbs, TENSTORRENT_MAX_INBOUND_TLBS)
 		tenstorrent_device_free_tlb(tt_dev, bitpos);
 
-	tenstorrent_device_put(tt_dev);
+	file->private_data = NULL;
 
 	mutex_lock(&tt_dev->chardev_mutex);
 	list_del(&priv->open_fd);
+	// The work item owns priv and its device reference from here.
+	deferred = tt_dev->cleanup_wq && queue_work(tt_dev->cleanup_wq, &priv->release_work);
 	mutex_unlock(&tt_dev->chardev_mutex);
 
-	kfree(file->private_data);
-	file->private_data = NULL;
+	if (!deferred)
+		tt_cdev_release_work(&priv->release_work);
+
 	return 0;
 }
 
@@ -6,14 +6,19 @@
 
 #include <linux/types.h>
 #include <linux/mutex.h>
-#include <linux/hashtable.h>
+#include <linux/idr.h>
 #include <linux/sched.h>
 #include <linux/refcount.h>
+#include <linux/workqueue.h>
+#include <linux/rbtree.h>
 
 #include "ioctl.h"
 
 struct file;
 struct tenstorrent_device;
+struct pinned_page_range;
+struct sg_table;
+struct noc_dma_arena;
 
 enum bar_mapping_type { BAR_MAPPING_UC, BAR_MAPPING_WC };
 
@@ -26,15 +31,22 @@ struct bar_mapping {
 	refcount_t refs;
 };
 
-#define DMABUF_HASHTABLE_BITS 4
 struct dmabuf {
-	struct hlist_node hash_chain;
-
-	void *ptr;	// kernel address for dma buffer
+	void *ptr;	// kernel address for dma buffer, NULL if sgt is used
+	struct sg_table *sgt;	// dma_alloc_noncontiguous, mapped to one IOVA range
 	dma_addr_t phys;
 	u64 size;	// always a multiple of PAGE_SIZE
-	u8 index;
+	u32 id;		// ALLOCATE_DMA_BUF buf_index or ALLOCATE_DMA_BUF_V2 handle
+	u64 mmap_offset;
+	struct rb_node mmap_rb;	// V2 only, in chardev_private.dmabuf_offsets
+	u64 mmap_gap;		// free V2 offsets just below mmap_offset
+	u64 subtree_gap;	// largest mmap_gap under mmap_rb
 	int outbound_iatu_region;
+	u64 arena_noc_address;	// nonzero if in chardev_private.noc_dma_arena instead
+	refcount_t refs;	// one for chardev_private.dmabufs, one per VMA
+	bool from_pool;		// in tenstorrent_device.dma_pool
+	bool node_pages;	// sgt is ours, see alloc_dmabuf_node_pages
+	bool sgt_mapped;	// and DMA-mapped on its own, not only linked into the arena
 };
 
 // This is our device-private data assocated with each open character device fd.
@@ -42,8 +54,15 @@ struct dmabuf {
 struct chardev_private {
 	struct tenstorrent_device *device;
 	struct mutex mutex;
-	DECLARE_HASHTABLE(dmabufs, DMABUF_HASHTABLE_BITS);	// keyed on by dmabuf.index, chained on struct dmabuf.hash_chain
-	struct list_head pinnings;	// struct pinned_page_range.list
+	struct idr dmabufs;	// struct dmabuf, keyed on dmabuf.id
+	struct rb_root dmabuf_offsets;	// ALLOCATE_DMA_BUF_V2 buffers, see alloc_dmabuf_mmap_offset
+	struct rb_root_cached pinnings;	// struct pinned_page_range.rb, see pinning_tree_iter_first
+	struct idr imports;		// struct dma_buf_import from IMPORT_DMA_BUF, keyed on handle
+	struct noc_dma_arena *noc_dma_arena;	// created on first use, see noc_dma_arena_size
+	struct work_struct pin_cache_work;	// releases stale idle TENSTORRENT_PIN_PAGES_CACHED pinnings
+	struct pinned_page_range *partial_pin;	// interrupted TENSTORRENT_PIN_PAGES_RESUMABLE pin, not in pinnings
+	u64 partial_pin_size;			// and the size it was asked to pin
+	struct work_struct release_work;	// tt_cdev_release_work on tenstorrent_device.cleanup_wq
 	struct list_head peer_mappings; // struct peer_resource_mapping.list
 	struct list_head bar_mappings;	// struct bar_mapping.list
 
@@ -10,12 +10,14 @@
 #include <linux/cdev.h>
 #include <linux/reboot.h>
 #include <linux/kref.h>
+#include <linux/workqueue.h>
 
 #include "ioctl.h"
 #include "hwmon.h"
 #include "memory.h"
 
 struct tenstorrent_device_class;
+struct gen_pool;
 
 struct tenstorrent_device {
 	struct kref kref;
@@ -43,12 +45,31 @@ struct tenstorrent_device {
 	struct tt_hwmon_context hwmon_context;
 
 	struct list_head open_fds_list;	// List of struct chardev_private, linked through open_fds field
+	struct workqueue_struct *cleanup_wq;	// Deferred fd release, NULL once removed. Protected by chardev_mutex.
 
 	DECLARE_BITMAP(tlbs, TENSTORRENT_MAX_INBOUND_TLBS);
 	atomic_t tlb_refs[TENSTORRENT_MAX_INBOUND_TLBS];	// TLB mapping refecounts
 
+	// What each allocated TLB window was last programmed with, for
+	// skipping no-op CONFIGURE_TLBs, GET_TLB_CONFIG and restoring after a
+	// reset. A window's bit in tlbs_configured is cleared when it's freed.
+	// Its bit in tlbs_programmed says the registers still hold the config:
+	// a reset clears them all until the window is reprogrammed.
+	struct mutex tlb_config_mutex;
+	struct tenstorrent_noc_tlb_config tlb_configs[TENSTORRENT_MAX_INBOUND_TLBS];
+	DECLARE_BITMAP(tlbs_configured, TENSTORRENT_MAX_INBOUND_TLBS);
+	DECLARE_BITMAP(tlbs_programmed, TENSTORRENT_MAX_INBOUND_TLBS);
+
 	struct mutex iatu_mutex;
 	struct tenstorrent_outbound_iatu_region outbound_iatus[TENSTORRENT_MAX_OUTBOUND_IATU_REGIONS];
+	struct rb_root outbound_iatu_tree;	// in-use outbound_iatus by NOC address
+	DECLARE_BITMAP(outbound_iatus_used, TENSTORRENT_MAX_OUTBOUND_IATU_REGIONS);
+
+	// Coherent memory reserved at probe for ALLOCATE_DMA_BUF, see dma_pool_size.
+	struct gen_pool *dma_pool;
+	void *dma_pool_ptr;
+	dma_addr_t dma_pool_dma_addr;
+	size_t dma_pool_size;
 
 	struct attribute **telemetry_attrs;
 	struct attribute_group telemetry_group;
@@ -81,6 +102,13 @@ struct tenstorrent_device_class {
 	void (*restore_reset_state)(struct tenstorrent_device *ttdev);
 	int (*configure_outbound_atu)(struct tenstorrent_device *ttdev, u32 region, u64 base, u64 limit, u64 target);
 	void (*noc_write32)(struct tenstorrent_device *ttdev, u32 x, u32 y, u64 addr, u32 data, int noc);
+	// For tenstorrent_noc_read/write: lock the kernel TLB window used for
+	// bulk copies, point it at addr on (x, y) and return where addr is in
+	// it, with *len cut to what's left of the window. Unlocked by
+	// release_kernel_window.
+	u8 __iomem *(*configure_kernel_window)(struct tenstorrent_device *ttdev, u32 x, u32 y, u64 addr, int noc,
+					       size_t *len);
+	void (*release_kernel_window)(struct tenstorrent_device *ttdev);
 };
 
 void tenstorrent_device_put(struct tenstorrent_device *);
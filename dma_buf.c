@@ -0,0 +1,396 @@
+// SPDX-FileCopyrightText: © 2025 Tenstorrent Inc.
+// SPDX-License-Identifier: GPL-2.0-only
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/file.h>
+#include <linux/mm.h>
+#include <linux/dma-buf.h>
+#include <linux/dma-mapping.h>
+#include <linux/scatterlist.h>
+#include <linux/uaccess.h>
+
+#include "dma_buf.h"
+#include "chardev_private.h"
+#include "device.h"
+#include "memory.h"
+#include "sg_helpers.h"
+
+#ifdef TENSTORRENT_DMA_BUF
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+MODULE_IMPORT_NS("DMA_BUF");
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
+MODULE_IMPORT_NS(DMA_BUF);
+#endif
+
+// dma_buf.priv for everything we export. pages lists the memory by struct
+// page; each attachment gets a copy mapped for the importing device.
+struct tenstorrent_export {
+	struct sg_table pages;
+
+	// We hold the fd the memory belongs to, and either a dmabuf.refs or a
+	// pinning's export_refs.
+	struct chardev_private *priv;
+	struct file *file;
+	struct dmabuf *dmabuf;
+	struct pinned_page_range *pinning;
+};
+
+// dst = pages of src from byte skip to skip + len. Free with sg_free_table.
+static int copy_sg_range(struct sg_table *dst, struct sg_table *src, u64 skip, u64 len)
+{
+	struct scatterlist *s, *d;
+	unsigned int nents = 0;
+	unsigned int i;
+	u64 pos;
+	int ret;
+
+	pos = 0;
+	for_each_sg(src->sgl, s, src->orig_nents, i) {
+		if (pos + s->length > skip && pos < skip + len)
+			nents++;
+		pos += s->length;
+	}
+
+	if (nents == 0)
+		return -EINVAL;
+
+	ret = sg_alloc_table(dst, nents, GFP_KERNEL);
+	if (ret)
+		return ret;
+
+	d = dst->sgl;
+	pos = 0;
+	for_each_sg(src->sgl, s, src->orig_nents, i) {
+		u64 start = max(pos, skip);
+		u64 end = min(pos + s->length, skip + len);
+
+		if (start < end) {
+			u64 offset = s->offset + (start - pos);
+
+			sg_set_page(d, nth_page(sg_page(s), offset >> PAGE_SHIFT),
+				    end - start, offset & ~PAGE_MASK);
+			d = sg_next(d);
+		}
+
+		pos += s->length;
+	}
+
+	return 0;
+}
+
+static struct sg_table *tenstorrent_export_map(struct dma_buf_attachment *attach,
+					       enum dma_data_direction dir)
+{
+	struct tenstorrent_export *export = attach->dmabuf->priv;
+	struct sg_table *sgt;
+	int ret;
+
+	sgt = kzalloc(sizeof(*sgt), GFP_KERNEL);
+	if (!sgt)
+		return ERR_PTR(-ENOMEM);
+
+	ret = copy_sg_range(sgt, &export->pages, 0, attach->dmabuf->size);
+	if (ret)
+		goto free_sgt;
+
+	ret = dma_map_sgtable(attach->dev, sgt, dir, 0);
+	if (ret)
+		goto free_table;
+
+	return sgt;
+
+free_table:
+	sg_free_table(sgt);
+free_sgt:
+	kfree(sgt);
+	return ERR_PTR(ret);
+}
+
+static void tenstorrent_export_unmap(struct dma_buf_attachment *attach, struct sg_table *sgt,
+				     enum dma_data_direction dir)
+{
+	dma_unmap_sgtable(attach->dev, sgt, dir, 0);
+	sg_free_table(sgt);
+	kfree(sgt);
+}
+
+static void tenstorrent_export_release(struct dma_buf *buf)
+{
+	struct tenstorrent_export *export = buf->priv;
+
+	if (export->dmabuf) {
+		dmabuf_put(export->priv, export->dmabuf);
+	} else {
+		mutex_lock(&export->priv->mutex);
+		export->pinning->export_refs--;
+		mutex_unlock(&export->priv->mutex);
+	}
+
+	fput(export->file);
+
+	sg_free_table(&export->pages);
+	kfree(export);
+}
+
+static const struct dma_buf_ops tenstorrent_export_ops = {
+	.map_dma_buf = tenstorrent_export_map,
+	.unmap_dma_buf = tenstorrent_export_unmap,
+	.release = tenstorrent_export_release,
+};
+
+static struct dma_buf *export_pages(struct tenstorrent_export *export, u64 size)
+{
+	DEFINE_DMA_BUF_EXPORT_INFO(exp_info);
+
+	exp_info.ops = &tenstorrent_export_ops;
+	exp_info.size = size;
+	exp_info.flags = O_RDWR;
+	exp_info.priv = export;
+
+	return dma_buf_export(&exp_info);
+}
+
+struct dma_buf *tenstorrent_export_dmabuf(struct chardev_private *priv, struct file *file,
+					  struct dmabuf *dmabuf)
+{
+	struct tenstorrent_device *tt_dev = priv->device;
+	struct device *dev = &tt_dev->pdev->dev;
+	struct tenstorrent_export *export;
+	struct dma_buf *buf;
+	struct sg_table whole;
+	u64 skip = 0;
+	int ret;
+
+	export = kzalloc(sizeof(*export), GFP_KERNEL);
+	if (!export)
+		return ERR_PTR(-ENOMEM);
+
+	// dma_get_sgtable only works on whole allocations, so pool buffers are
+	// cut out of the pool's table.
+	if (dmabuf->sgt) {
+		ret = copy_sg_range(&export->pages, dmabuf->sgt, 0, dmabuf->size);
+	} else {
+		if (dmabuf->from_pool) {
+			ret = dma_get_sgtable(dev, &whole, tt_dev->dma_pool_ptr,
+					      tt_dev->dma_pool_dma_addr, tt_dev->dma_pool_size);
+			skip = dmabuf->phys - tt_dev->dma_pool_dma_addr;
+		} else {
+			ret = dma_get_sgtable(dev, &whole, dmabuf->ptr, dmabuf->phys, dmabuf->size);
+		}
+
+		if (ret == 0) {
+			ret = copy_sg_range(&export->pages, &whole, skip, dmabuf->size);
+			sg_free_table(&whole);
+		}
+	}
+
+	if (ret)
+		goto free_export;
+
+	export->priv = priv;
+	export->file = get_file(file);
+	export->dmabuf = dmabuf;
+	refcount_inc(&dmabuf->refs);
+
+	buf = export_pages(export, dmabuf->size);
+	if (IS_ERR(buf)) {
+		refcount_dec(&dmabuf->refs);	// can't be the last, priv->dmabufs has one
+		fput(file);
+		ret = PTR_ERR(buf);
+		goto free_pages;
+	}
+
+	return buf;
+
+free_pages:
+	sg_free_table(&export->pages);
+free_export:
+	kfree(export);
+	return ERR_PTR(ret);
+}
+
+struct dma_buf *tenstorrent_export_pinning(struct chardev_private *priv, struct file *file,
+					   struct pinned_page_range *pinning)
+{
+	struct tenstorrent_export *export;
+	struct sg_table runs;
+	struct dma_buf *buf;
+	int ret;
+
+	export = kzalloc(sizeof(*export), GFP_KERNEL);
+	if (!export)
+		return ERR_PTR(-ENOMEM);
+
+	if (!alloc_chained_sgt_for_runs(&runs, pinning->runs, pinning->run_count)) {
+		ret = -ENOMEM;
+		goto free_export;
+	}
+
+	ret = copy_sg_range(&export->pages, &runs, 0, (u64)pinning->page_count << PAGE_SHIFT);
+	free_chained_sgt(&runs);
+	if (ret)
+		goto free_export;
+
+	// The pinning keeps the pages pinned: UNPIN_PAGES leaves it alone until
+	// we're released, and holding the fd keeps it from being cleaned up.
+	export->priv = priv;
+	export->file = get_file(file);
+	export->pinning = pinning;
+	pinning->export_refs++;
+
+	buf = export_pages(export, (u64)pinning->page_count << PAGE_SHIFT);
+	if (IS_ERR(buf)) {
+		pinning->export_refs--;
+		fput(file);
+		sg_free_table(&export->pages);
+		ret = PTR_ERR(buf);
+		goto free_export;
+	}
+
+	return buf;
+
+free_export:
+	kfree(export);
+	return ERR_PTR(ret);
+}
+
+int tenstorrent_dma_buf_install_fd(struct dma_buf *buf, int __user *fd_out)
+{
+	int fd;
+
+	// Don't install the fd until userspace is sure to learn its number.
+	fd = get_unused_fd_flags(O_CLOEXEC);
+	if (fd < 0) {
+		dma_buf_put(buf);
+		return fd;
+	}
+
+	if (put_user(fd, fd_out)) {
+		put_unused_fd(fd);
+		dma_buf_put(buf);
+		return -EFAULT;
+	}
+
+	fd_install(fd, buf->file);
+	return 0;
+}
+
+// Importers don't hold the reservation lock since 6.2.
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 2, 0)
+#define dma_buf_map_attachment_unlocked dma_buf_map_attachment
+#define dma_buf_unmap_attachment_unlocked dma_buf_unmap_attachment
+#endif
+
+// The import must be one contiguous DMA range to be reachable through a
+// single iATU region, and for userspace to address it by one IOVA.
+static bool get_dma_range(struct sg_table *sgt, dma_addr_t *start, u64 *size)
+{
+	struct scatterlist *sg;
+	dma_addr_t next = 0;
+	unsigned int i;
+
+	for_each_sgtable_dma_sg(sgt, sg, i) {
+		if (i == 0)
+			*start = sg_dma_address(sg);
+		else if (sg_dma_address(sg) != next)
+			return false;
+
+		next = sg_dma_address(sg) + sg_dma_len(sg);
+	}
+
+	*size = next - *start;
+	return true;
+}
+
+struct dma_buf_import *tenstorrent_dma_buf_import(struct device *dev, int fd)
+{
+	struct dma_buf_import *import;
+	struct dma_buf *buf;
+	int ret;
+
+	import = kzalloc(sizeof(*import), GFP_KERNEL);
+	if (!import)
+		return ERR_PTR(-ENOMEM);
+
+	import->outbound_iatu_region = -1;
+
+	buf = dma_buf_get(fd);
+	if (IS_ERR(buf)) {
+		ret = PTR_ERR(buf);
+		goto free_import;
+	}
+
+	import->attach = dma_buf_attach(buf, dev);
+	if (IS_ERR(import->attach)) {
+		ret = PTR_ERR(import->attach);
+		goto put_buf;
+	}
+
+	import->sgt = dma_buf_map_attachment_unlocked(import->attach, DMA_BIDIRECTIONAL);
+	if (IS_ERR(import->sgt)) {
+		ret = PTR_ERR(import->sgt);
+		goto detach;
+	}
+
+	if (!get_dma_range(import->sgt, &import->dma_address, &import->size)
+	    || import->size != buf->size) {
+		ret = -EINVAL;
+		goto unmap;
+	}
+
+	return import;
+
+unmap:
+	dma_buf_unmap_attachment_unlocked(import->attach, import->sgt, DMA_BIDIRECTIONAL);
+detach:
+	dma_buf_detach(buf, import->attach);
+put_buf:
+	dma_buf_put(buf);
+free_import:
+	kfree(import);
+	return ERR_PTR(ret);
+}
+
+// Caller has already torn down the iATU region.
+void tenstorrent_dma_buf_unimport(struct dma_buf_import *import)
+{
+	struct dma_buf *buf = import->attach->dmabuf;
+
+	dma_buf_unmap_attachment_unlocked(import->attach, import->sgt, DMA_BIDIRECTIONAL);
+	dma_buf_detach(buf, import->attach);
+	dma_buf_put(buf);
+	kfree(import);
+}
+
+#else
+
+struct dma_buf *tenstorrent_export_dmabuf(struct chardev_private *priv, struct file *file,
+					  struct dmabuf *dmabuf)
+{
+	return ERR_PTR(-EOPNOTSUPP);
+}
+
+struct dma_buf *tenstorrent_export_pinning(struct chardev_private *priv, struct file *file,
+					   struct pinned_page_range *pinning)
+{
+	return ERR_PTR(-EOPNOTSUPP);
+}
+
+int tenstorrent_dma_buf_install_fd(struct dma_buf *buf, int __user *fd_out)
+{
+	return -EOPNOTSUPP;
+}
+
+struct dma_buf_import *tenstorrent_dma_buf_import(struct device *dev, int fd)
+{
+	return ERR_PTR(-EOPNOTSUPP);
+}
+
+void tenstorrent_dma_buf_unimport(struct dma_buf_import *import)
+{
+}
+
+#endif
@@ -0,0 +1,51 @@
+// SPDX-FileCopyrightText: © 2025 Tenstorrent Inc.
+// SPDX-License-Identifier: GPL-2.0-only
+
+#ifndef TTDRIVER_DMA_BUF_H_INCLUDED
+#define TTDRIVER_DMA_BUF_H_INCLUDED
+
+#include <linux/version.h>
+#include <linux/compiler.h>
+#include <linux/types.h>
+
+// Exporters must implement mmap before 5.10; ours don't. Importing is
+// gated with exporting to keep one configuration to test.
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 10, 0) && IS_ENABLED(CONFIG_DMA_SHARED_BUFFER)
+#define TENSTORRENT_DMA_BUF
+#endif
+
+struct dma_buf;
+struct dma_buf_attachment;
+struct sg_table;
+struct device;
+struct file;
+struct chardev_private;
+struct dmabuf;
+struct pinned_page_range;
+
+// Wrap memory in a new dma-buf that keeps it alive until the dma-buf is
+// released. Caller holds priv->mutex. Return ERR_PTR on failure.
+struct dma_buf *tenstorrent_export_dmabuf(struct chardev_private *priv, struct file *file,
+					  struct dmabuf *dmabuf);
+struct dma_buf *tenstorrent_export_pinning(struct chardev_private *priv, struct file *file,
+					   struct pinned_page_range *pinning);
+
+// Give userspace a close-on-exec fd for buf and write its number to *fd_out.
+// Consumes the reference to buf, even on failure.
+int tenstorrent_dma_buf_install_fd(struct dma_buf *buf, int __user *fd_out);
+
+// A dma-buf from another driver, attached and mapped for our device. Lives in
+// chardev_private.imports.
+struct dma_buf_import {
+	struct dma_buf_attachment *attach;
+	struct sg_table *sgt;
+	dma_addr_t dma_address;	// the whole buffer is one DMA range from here
+	u64 size;
+	int outbound_iatu_region;
+};
+
+// Return ERR_PTR on failure. outbound_iatu_region is initialized to -1.
+struct dma_buf_import *tenstorrent_dma_buf_import(struct device *dev, int fd);
+void tenstorrent_dma_buf_unimport(struct dma_buf_import *import);
+
+#endif
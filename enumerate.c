@@ -12,6 +12,7 @@
 #include <linux/seq_file.h>
 #include <linux/debugfs.h>
 #include <linux/proc_fs.h>
+#include <linux/genalloc.h>
 
 #include "enumerate.h"
 #include "interrupt.h"
@@ -22,6 +23,7 @@
 #include "chardev_private.h"
 #include "wormhole.h"
 #include "tlb.h"
+#include "dma_buf.h"
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
 #define pci_enable_pcie_error_reporting(dev) do { } while (0)
@@ -47,6 +49,7 @@ static int mappings_seq_show(struct seq_file *s, void *v)
 	unsigned int tlb_id;
 	struct tlb_descriptor desc;
 	bool sensitive = capable(CAP_SYS_ADMIN);
+	u64 noc_pcie_offset = tt_dev->dev_class->noc_pcie_offset;
 
 	seq_printf(s, "WARNING: This file is for diagnostic purposes only.\n"
 		      "Its format is not stable and may change in future driver versions.\n"
@@ -58,8 +61,9 @@ static int mappings_seq_show(struct seq_file *s, void *v)
 	mutex_lock(&tt_dev->chardev_mutex);
 	list_for_each_entry(priv, &tt_dev->open_fds_list, open_fd) {
 		struct bar_mapping *bar_mapping;
+		struct dma_buf_import *import;
 		struct dmabuf *dmabuf;
-		unsigned int bkt;
+		int id;
 
 		// Open file descriptors.
 		seq_printf(s,
@@ -78,22 +82,22 @@ static int mappings_seq_show(struct seq_file *s, void *v)
 		}
 
 		// User pinnings, including iATU entries.
-		list_for_each_entry(pinning, &priv->pinnings, list) {
+		for_each_pinning(pinning, &priv->pinnings) {
 			unsigned long long va_start = pinning->virtual_address;
 			unsigned long size_bytes = pinning->page_count * PAGE_SIZE;
 			unsigned long long addr = 0;
 			const char *addr_label;
 
-			if (pinning->dma_mapping.sgl) {
+			if (pinning->dma_mapping.sgl || pinning->iova || pinning->arena_noc_address) {
 				// IOMMU path: show IOVA
 				addr_label = "IOVA";
 				if (sensitive)
-					addr = pinning->dma_mapping.sgl->dma_address;
+					addr = pinning->dma_address;
 			} else {
 				// Non-IOMMU path: show physical address
 				addr_label = "PA";
-				if (sensitive && pinning->pages)
-					addr = page_to_phys(pinning->pages[0]);
+				if (sensitive && pinning->run_count)
+					addr = page_to_phys(pinning->runs[0].page);
 			}
 
 			if (pinning->outbound_iatu_region >= 0) {
@@ -105,6 +109,13 @@ static int mappings_seq_show(struct seq_file *s, void *v)
 					"%-8d %-16s %-14s VA: 0x%016llx -> %s: 0x%016llx -> NOC: 0x%llx (size=0x%lx)\n",
 					priv->pid, priv->comm, "PIN_PAGES+IATU", va_start, addr_label, addr,
 					sensitive ? region->base : 0, size_bytes);
+			} else if (pinning->arena_noc_address) {
+				// Through the fd's NOC DMA arena region.
+				seq_printf(
+					s,
+					"%-8d %-16s %-14s VA: 0x%016llx -> %s: 0x%016llx -> NOC: 0x%llx (size=0x%lx, arena)\n",
+					priv->pid, priv->comm, "PIN_PAGES+IATU", va_start, addr_label, addr,
+					sensitive ? pinning->arena_noc_address - noc_pcie_offset : 0, size_bytes);
 			} else {
 				seq_printf(s, "%-8d %-16s %-14s VA: 0x%016llx -> %s: 0x%016llx (size=0x%lx)\n",
 					   priv->pid, priv->comm, "PIN_PAGES", va_start, addr_label, addr, size_bytes);
@@ -112,7 +123,7 @@ static int mappings_seq_show(struct seq_file *s, void *v)
 		}
 
 		// Driver-allocated DMA buffers, including iATU entries.
-		hash_for_each(priv->dmabufs, bkt, dmabuf, hash_chain) {
+		idr_for_each_entry(&priv->dmabufs, dmabuf, id) {
 			unsigned long long addr = sensitive ? dmabuf->phys : 0;
 			unsigned long size_bytes = dmabuf->size;
 			const char *addr_label = is_iommu_translated(&priv->device->pdev->dev) ? "IOVA" : "PA";
@@ -123,11 +134,35 @@ static int mappings_seq_show(struct seq_file *s, void *v)
 
 				seq_printf(s,
 					   "%-8d %-16s %-14s ID: %-3u -> %s: 0x%016llx -> NOC: 0x%llx (size=0x%lx)\n",
-					   priv->pid, priv->comm, "DMA_BUF+IATU", dmabuf->index, addr_label, addr,
+					   priv->pid, priv->comm, "DMA_BUF+IATU", dmabuf->id, addr_label, addr,
 					   sensitive ? region->base : 0, size_bytes);
+			} else if (dmabuf->arena_noc_address) {
+				seq_printf(s,
+					   "%-8d %-16s %-14s ID: %-3u -> %s: 0x%016llx -> NOC: 0x%llx (size=0x%lx, arena)\n",
+					   priv->pid, priv->comm, "DMA_BUF+IATU", dmabuf->id, addr_label, addr,
+					   sensitive ? dmabuf->arena_noc_address - noc_pcie_offset : 0, size_bytes);
 			} else {
 				seq_printf(s, "%-8d %-16s %-14s ID: %-3u -> %s: 0x%016llx (size=0x%lx)\n", priv->pid,
-					   priv->comm, "DMA_BUF", dmabuf->index, addr_label, addr, size_bytes);
+					   priv->comm, "DMA_BUF", dmabuf->id, addr_label, addr, size_bytes);
+			}
+		}
+
+		// Imported dma-bufs, including iATU entries.
+		idr_for_each_entry(&priv->imports, import, id) {
+			unsigned long long addr = sensitive ? import->dma_address : 0;
+			unsigned long long size_bytes = import->size;
+
+			if (import->outbound_iatu_region >= 0) {
+				const struct tenstorrent_outbound_iatu_region *region;
+				region = &priv->device->outbound_iatus[import->outbound_iatu_region];
+
+				seq_printf(s,
+					   "%-8d %-16s %-14s ID: %-3d -> DMA: 0x%016llx -> NOC: 0x%llx (size=0x%llx)\n",
+					   priv->pid, priv->comm, "IMPORT+IATU", id, addr,
+					   sensitive ? region->base : 0, size_bytes);
+			} else {
+				seq_printf(s, "%-8d %-16s %-14s ID: %-3d -> DMA: 0x%016llx (size=0x%llx)\n", priv->pid,
+					   priv->comm, "IMPORT", id, addr, size_bytes);
 			}
 		}
 
@@ -173,6 +208,32 @@ static const struct file_operations mappings_fops = {
 	.release = single_release,
 };
 
+static int dma_pool_seq_show(struct seq_file *s, void *v)
+{
+	struct tenstorrent_device *tt_dev = s->private;
+	size_t size = gen_pool_size(tt_dev->dma_pool);
+	size_t avail = gen_pool_avail(tt_dev->dma_pool);
+
+	seq_printf(s, "size: %zu\n", size);
+	seq_printf(s, "used: %zu\n", size - avail);
+	seq_printf(s, "free: %zu\n", avail);
+
+	return 0;
+}
+
+static int dma_pool_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, dma_pool_seq_show, inode->i_private);
+}
+
+static const struct file_operations dma_pool_fops = {
+	.owner   = THIS_MODULE,
+	.open    = dma_pool_open,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
+	.release = single_release,
+};
+
 int pids_proc_show(struct seq_file *s, void *v)
 {
 	struct tenstorrent_device *tt_dev = s->private;
@@ -246,6 +307,11 @@ static int tenstorrent_pci_probe(struct pci_dev *dev, const struct pci_device_id
 
 	mutex_init(&tt_dev->chardev_mutex);
 	mutex_init(&tt_dev->iatu_mutex);
+	mutex_init(&tt_dev->tlb_config_mutex);
+	tt_dev->outbound_iatu_tree = RB_ROOT;
+
+	// Without it, fd release just cleans up synchronously.
+	tt_dev->cleanup_wq = alloc_workqueue("tenstorrent_%u", WQ_UNBOUND, 0, ordinal);
 
 	// Use dma_address_bits from module parameter or device class for coherent
 	// DMA mask, but use a 64-bit mask for streaming mappings. The problem this
@@ -262,6 +328,9 @@ static int tenstorrent_pci_probe(struct pci_dev *dev, const struct pci_device_id
 	dma_set_max_seg_size(&dev->dev, UINT_MAX);
 	dma_set_seg_boundary(&dev->dev, ULONG_MAX);
 
+	// Optional up-front reservation for ALLOCATE_DMA_BUF, see dma_pool_size.
+	tenstorrent_dma_pool_init(tt_dev);
+
 	pci_set_master(dev);
 	pci_enable_pcie_error_reporting(dev);
 
@@ -287,6 +356,8 @@ static int tenstorrent_pci_probe(struct pci_dev *dev, const struct pci_device_id
 		device_class->init_telemetry(tt_dev);
 
 	debugfs_create_file("mappings", 0444, tt_dev->debugfs_root, tt_dev, &mappings_fops);
+	if (tt_dev->dma_pool)
+		debugfs_create_file("dma_pool", 0444, tt_dev->debugfs_root, tt_dev, &dma_pool_fops);
 
 
 	return 0;
@@ -296,6 +367,7 @@ static void tenstorrent_pci_remove(struct pci_dev *dev)
 {
 	struct tenstorrent_device *tt_dev = pci_get_drvdata(dev);
 	struct chardev_private *priv, *tmp;
+	struct workqueue_struct *cleanup_wq;
 	u16 vendor_id;
 
 	if (tt_dev->dev_class == &wormhole_class) {
@@ -314,6 +386,16 @@ static void tenstorrent_pci_remove(struct pci_dev *dev)
 
 	tt_dev->dev_class->cleanup_device(tt_dev); // unmap BARs
 
+	// Finish deferred fd releases while the device is still bound; later
+	// releases clean up synchronously.
+	mutex_lock(&tt_dev->chardev_mutex);
+	cleanup_wq = tt_dev->cleanup_wq;
+	tt_dev->cleanup_wq = NULL;
+	mutex_unlock(&tt_dev->chardev_mutex);
+
+	if (cleanup_wq)
+		destroy_workqueue(cleanup_wq);
+
 	list_for_each_entry_safe(priv, tmp, &tt_dev->open_fds_list, open_fd) {
 		tenstorrent_memory_cleanup(priv);
 	}
@@ -343,6 +425,7 @@ static void tt_dev_release(struct kref *tt_dev_kref) {
 	if (tt_dev->dev_class->reboot)
 		unregister_reboot_notifier(&tt_dev->reboot_notifier);
 
+	tenstorrent_dma_pool_fini(tt_dev);
 
 	pci_dev_put(pdev);
 	kfree(tt_dev);
@@ -12,6 +12,10 @@
 #include <linux/iommu.h>
 #include <linux/file.h>
 #include <linux/vmalloc.h>
+#include <linux/interval_tree_generic.h>
+#include <linux/rbtree_augmented.h>
+#include <linux/genalloc.h>
+#include <linux/sizes.h>
 
 #include "chardev_private.h"
 #include "device.h"
@@ -19,143 +23,131 @@
 #include "ioctl.h"
 #include "sg_helpers.h"
 #include "tlb.h"
+#include "module.h"
+#include "dma_buf.h"
 
-#define BAR0_SIZE (1UL << 29)
-
-static int get_sorted_iatu_region_indices(const struct tenstorrent_outbound_iatu_region *regions, int *sorted_indices)
-{
-	int i;
-	int in_use_count = 0;
+#ifdef TENSTORRENT_HUGE_DMABUF_MAP
+#include <linux/huge_mm.h>
+#include <linux/cc_platform.h>
+#include <linux/dma-map-ops.h>
+#endif
 
-	// First, collect indices of in-use regions.
-	for (i = 0; i < TENSTORRENT_MAX_OUTBOUND_IATU_REGIONS; i++) {
-		if (regions[i].priv) {
-			sorted_indices[in_use_count++] = i;
-		}
-	}
+#define BAR0_SIZE (1UL << 29)
 
-	// Insertion sort the collected indices by the corresponding region's base.
-	for (i = 1; i < in_use_count; i++) {
-		int index = sorted_indices[i];
-		u64 base = regions[index].base;
-		int j = i - 1;
+// NOC address space left unmapped between neighbouring regions, so a device
+// access that runs off the end of one buffer faults rather than landing in
+// another.
+#define NOC_DMA_GUARD_SIZE	SZ_4K
 
-		while (j >= 0 && regions[sorted_indices[j]].base > base) {
-			sorted_indices[j + 1] = sorted_indices[j];
-			j--;
-		}
-		sorted_indices[j + 1] = index;
-	}
+// iATU regions translate in 4K units.
+#define NOC_DMA_ALIGN		SZ_4K
 
-	return in_use_count;
+static struct tenstorrent_outbound_iatu_region *noc_range_entry(struct rb_node *node)
+{
+	return node ? rb_entry(node, struct tenstorrent_outbound_iatu_region, node) : NULL;
 }
 
-static u64 find_iatu_region_top_down(const struct tenstorrent_outbound_iatu_region *regions, u64 max_addr, u64 size)
+// Caller holds iatu_mutex.
+static void noc_range_insert(struct tenstorrent_device *tt_dev, struct tenstorrent_outbound_iatu_region *region)
 {
-	int sorted_indices[TENSTORRENT_MAX_OUTBOUND_IATU_REGIONS];
-	u64 current_pos = max_addr;
-	int in_use_count;
-	int i;
-
-	in_use_count = get_sorted_iatu_region_indices(regions, sorted_indices);
-
-	if (in_use_count == 0) {
-		// Allocate at top if there's enough space.
-		if (size <= (max_addr + 1)) {
-			return max_addr - size + 1;
-		}
-		return U64_MAX; // Size too large for address space.
-	}
+	struct rb_node **link = &tt_dev->outbound_iatu_tree.rb_node;
+	struct rb_node *parent = NULL;
 
-	// Check each region from top to bottom.
-	for (i = in_use_count - 1; i >= 0; i--) {
-		const struct tenstorrent_outbound_iatu_region *region = &regions[sorted_indices[i]];
-
-		if ((current_pos - region->limit) >= size)
-			return current_pos - size + 1;
-
-		current_pos = region->base - 1;
+	while (*link) {
+		parent = *link;
+		if (region->base < noc_range_entry(parent)->base)
+			link = &parent->rb_left;
+		else
+			link = &parent->rb_right;
 	}
 
-	// Check gap at the bottom (from 0 to the lowest region).
-	if ((current_pos + 1) >= size)
-		return current_pos - size + 1;
-
-	return U64_MAX; // No suitable gap found.
+	rb_link_node(&region->node, parent, link);
+	rb_insert_color(&region->node, &tt_dev->outbound_iatu_tree);
 }
 
-static u64 find_iatu_region_bottom_up(const struct tenstorrent_outbound_iatu_region *regions, u64 max_addr, u64 size)
+// Best fit for size bytes of NOC address space in [0, max_addr]. Top-down and
+// bottom-up regions grow toward each other from either end of the window; a
+// gap is only considered if it's on the caller's side or between the two, and
+// the range goes at the caller's end of it. Returns the base or U64_MAX.
+// Caller holds iatu_mutex.
+static u64 find_noc_range(struct tenstorrent_device *tt_dev, u64 max_addr, u64 size, bool top_down)
 {
-	int sorted_indices[TENSTORRENT_MAX_OUTBOUND_IATU_REGIONS];
-	u64 current_pos = 0;
-	int in_use_count;
-	int i;
+	struct rb_node *node = rb_first(&tt_dev->outbound_iatu_tree);
+	struct tenstorrent_outbound_iatu_region *prev = NULL;
+	struct tenstorrent_outbound_iatu_region *next;
+	u64 best_base = U64_MAX;
+	u64 best_gap = U64_MAX;
 
-	in_use_count = get_sorted_iatu_region_indices(regions, sorted_indices);
+	do {
+		u64 lo, hi;
 
-	if (in_use_count == 0) {
-		// Allocate at bottom if there's enough space.
-		if (size <= max_addr + 1) {
-			return 0;
-		}
-		return U64_MAX;
-	}
+		next = noc_range_entry(node);
 
-	// Check each region from bottom to top.
-	for (i = 0; i < in_use_count; i++) {
-		const struct tenstorrent_outbound_iatu_region *region = &regions[sorted_indices[i]];
+		if (top_down ? (next && !next->top_down) : (prev && prev->top_down))
+			goto skip;
 
-		if ((region->base - current_pos) >= size)
-			return current_pos;
+		if (next && next->base <= NOC_DMA_GUARD_SIZE)
+			goto skip;
 
-		current_pos = region->limit + 1;
-	}
+		lo = prev ? ALIGN(prev->limit + 1 + NOC_DMA_GUARD_SIZE, NOC_DMA_ALIGN) : 0;
+		hi = next ? next->base - 1 - NOC_DMA_GUARD_SIZE : max_addr;
+
+		if (lo > hi || hi - lo + 1 < size)
+			goto skip;
+
+		// Ties go to the gap nearest the caller's end of the window.
+		if (hi - lo + 1 < best_gap || (hi - lo + 1 == best_gap && top_down)) {
+			best_gap = hi - lo + 1;
+			best_base = top_down ? ALIGN_DOWN(hi - size + 1, NOC_DMA_ALIGN) : lo;
+		}
 
-	// Check gap at the top (from highest region to max_addr).
-	if ((max_addr - current_pos + 1) >= size)
-		return current_pos;
+skip:
+		prev = next;
+		node = node ? rb_next(node) : NULL;
+	} while (next);
 
-	return U64_MAX; // No suitable gap found.
+	return best_base;
 }
 
 // returns the region number or a negative error code.
-static int configure_outbound_iatu(struct chardev_private *priv, u64 base, u64 limit, u64 target)
+// Caller holds iatu_mutex.
+static int configure_outbound_iatu(struct chardev_private *priv, u64 base, u64 limit, u64 target,
+				   bool top_down)
 {
 	struct tenstorrent_device *tt_dev = priv->device;
-	int region = -1;
-	int i;
+	struct tenstorrent_outbound_iatu_region *region;
+	int index;
 	int ret;
 
 	if (base > limit)
 		return -EINVAL;
 
-	// Find a free region.
-	for (i = 0; i < TENSTORRENT_MAX_OUTBOUND_IATU_REGIONS; ++i) {
-		if (tt_dev->outbound_iatus[i].priv == NULL) {
-			region = i;
-			break;
-		}
-	}
-
-	if (region < 0)
+	index = find_first_zero_bit(tt_dev->outbound_iatus_used, TENSTORRENT_MAX_OUTBOUND_IATU_REGIONS);
+	if (index >= TENSTORRENT_MAX_OUTBOUND_IATU_REGIONS)
 		return -ENOSPC;
 
 	// Program the hardware.
-	ret = tt_dev->dev_class->configure_outbound_atu(tt_dev, region, base, limit, target);
+	ret = tt_dev->dev_class->configure_outbound_atu(tt_dev, index, base, limit, target);
 	if (ret)
 		return ret;
 
 	// Mark region as in use.
-	tt_dev->outbound_iatus[region].priv = priv;
-	tt_dev->outbound_iatus[region].base = base;
-	tt_dev->outbound_iatus[region].limit = limit;
-	tt_dev->outbound_iatus[region].target = target;
+	region = &tt_dev->outbound_iatus[index];
+	region->priv = priv;
+	region->top_down = top_down;
+	region->base = base;
+	region->limit = limit;
+	region->target = target;
 
-	return region;
+	set_bit(index, tt_dev->outbound_iatus_used);
+	noc_range_insert(tt_dev, region);
+
+	return index;
 }
 
 // Return the iATU region number or a negative error code.
-static int setup_noc_dma(struct chardev_private *priv, bool top_down, size_t size, u64 target, u64 *noc_address)
+// Caller holds iatu_mutex.
+static int __setup_noc_dma(struct chardev_private *priv, bool top_down, size_t size, u64 target, u64 *noc_address)
 {
 	struct tenstorrent_device *tt_dev = priv->device;
 	u64 max_addr = tt_dev->dev_class->noc_dma_limit;
@@ -166,22 +158,30 @@ static int setup_noc_dma(struct chardev_private *priv, bool top_down, size_t siz
 	if (size == 0)
 		return -EINVAL;
 
-	mutex_lock(&tt_dev->iatu_mutex);
-	if (top_down)
-		base = find_iatu_region_top_down(tt_dev->outbound_iatus, max_addr, size);
-	else
-		base = find_iatu_region_bottom_up(tt_dev->outbound_iatus, max_addr, size);
+	// Don't search for space there's no region to use.
+	if (bitmap_full(tt_dev->outbound_iatus_used, TENSTORRENT_MAX_OUTBOUND_IATU_REGIONS))
+		return -ENOSPC;
 
-	if (base == U64_MAX) {
-		mutex_unlock(&tt_dev->iatu_mutex);
+	base = find_noc_range(tt_dev, max_addr, size, top_down);
+	if (base == U64_MAX)
 		return -ENOMEM;
-	}
 
 	limit = base + size - 1;
-	iatu_region = configure_outbound_iatu(priv, base, limit, target);
+	iatu_region = configure_outbound_iatu(priv, base, limit, target, top_down);
 	*noc_address = tt_dev->dev_class->noc_pcie_offset + base;
 
+	return iatu_region;
+}
+
+static int setup_noc_dma(struct chardev_private *priv, bool top_down, size_t size, u64 target, u64 *noc_address)
+{
+	struct tenstorrent_device *tt_dev = priv->device;
+	int iatu_region;
+
+	mutex_lock(&tt_dev->iatu_mutex);
+	iatu_region = __setup_noc_dma(priv, top_down, size, target, noc_address);
 	mutex_unlock(&tt_dev->iatu_mutex);
+
 	return iatu_region;
 }
 
@@ -283,6 +283,18 @@ static void unpin_user_pages_dirty_lock(struct page **pages, unsigned long npage
 }
 #endif
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 12, 0)
+static void unpin_user_page_range_dirty_lock(struct page *page, unsigned long npages, bool make_dirty)
+{
+	unsigned long i;
+
+	for (i = 0; i < npages; i++) {
+		struct page *p = nth_page(page, i);
+		unpin_user_pages_dirty_lock(&p, 1, make_dirty);
+	}
+}
+#endif
+
 #define MAX_DMA_BUF_SIZE (1u << MAX_DMA_BUF_SIZE_LOG2)
 
 // These are the mmap offsets for various resources. In the user-kernel
@@ -306,7 +318,34 @@ static void unpin_user_pages_dirty_lock(struct page **pages, unsigned long npage
 
 #define MMAP_SIZE_DMA_BUF (U64_C(1) << 32)
 
-static void teardown_outbound_iatu(struct chardev_private *priv, int iatu_region)
+// ALLOCATE_DMA_BUF_V2 buffers go between the resources and the ALLOCATE_DMA_BUF
+// buffers, so they too are in reach of mmap2. The space is too small for a
+// slot per handle: each buffer gets a piece of it just its size, see
+// alloc_dmabuf_mmap_offset. Handles start after the ALLOCATE_DMA_BUF indices,
+// they share chardev_private.dmabufs.
+#define MMAP_OFFSET_DMA_BUF_V2		(MMAP_OFFSET_TLB_WC + MMAP_RESOURCE_SIZE)
+#define MMAP_SIZE_DMA_BUF_V2		(MMAP_OFFSET_DMA_BUF - MMAP_OFFSET_DMA_BUF_V2)
+#define DMA_BUF_V2_HANDLE_MAX		((1 << 24) - 1)
+
+// dma_alloc_noncontiguous and friends arrived in 5.14. Before that,
+// dmabuf.sgt is never set.
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 14, 0)
+#define TENSTORRENT_DMA_NONCONTIGUOUS
+#else
+#define dma_mmap_noncontiguous(dev, vma, size, sgt) (-EINVAL)
+#define dma_free_noncontiguous(dev, size, sgt, dir) do { } while (0)
+#endif
+
+// dma_iova_try_alloc and friends arrived in 6.17. Without them there is no
+// NOC DMA arena and every NOC_DMA mapping takes an iATU region, and pinnings
+// behind an IOMMU are scatterlist mappings, which UNPIN_PAGES can't split.
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 17, 0)
+#define TENSTORRENT_DMA_IOVA
+#define TENSTORRENT_NOC_DMA_ARENA
+#endif
+
+// Caller holds iatu_mutex.
+static void __teardown_outbound_iatu(struct chardev_private *priv, int iatu_region)
 {
 	struct tenstorrent_device *tt_dev = priv->device;
 	struct tenstorrent_outbound_iatu_region *region;
@@ -314,477 +353,2722 @@ static void teardown_outbound_iatu(struct chardev_private *priv, int iatu_region
 	if (iatu_region < 0)
 		return;
 
-	mutex_lock(&tt_dev->iatu_mutex);
-
 	region = &priv->device->outbound_iatus[iatu_region];
 
 	if (!tt_dev->detached)
 		tt_dev->dev_class->configure_outbound_atu(tt_dev, iatu_region, 0, 0, 0);
 
+	rb_erase(&region->node, &tt_dev->outbound_iatu_tree);
+	clear_bit(iatu_region, tt_dev->outbound_iatus_used);
+
 	region->priv = NULL;
 	region->base = 0;
 	region->limit = 0;
 	region->target = 0;
+}
+
+static void teardown_outbound_iatu(struct chardev_private *priv, int iatu_region)
+{
+	struct tenstorrent_device *tt_dev = priv->device;
+
+	if (iatu_region < 0)
+		return;
 
+	mutex_lock(&tt_dev->iatu_mutex);
+	__teardown_outbound_iatu(priv, iatu_region);
 	mutex_unlock(&tt_dev->iatu_mutex);
 }
 
-static void unpin_pinned_page_range(struct chardev_private *priv,
-	struct pinned_page_range *pinning)
+#ifdef TENSTORRENT_NOC_DMA_ARENA
+// noc_dma_arena_size MiB of IOVA space behind a single iATU region. NOC_DMA
+// pinnings and buffers link their pages into pieces of it rather than taking
+// one of the TENSTORRENT_MAX_OUTBOUND_IATU_REGIONS each.
+struct noc_dma_arena {
+	struct dma_iova_state iova;
+	struct gen_pool *free;		// offsets into iova, plus PAGE_SIZE so none is 0
+	int outbound_iatu_region;	// -1 after tenstorrent_memory_revoke
+	u64 noc_address;
+};
+
+// Return the fd's arena, creating it if need be, or NULL if it can't have one:
+// it's disabled, there's no IOMMU, or no IOVA or NOC space. Caller holds
+// iatu_mutex.
+static struct noc_dma_arena *__get_noc_dma_arena(struct chardev_private *priv)
 {
-	teardown_outbound_iatu(priv, pinning->outbound_iatu_region);
+	struct device *dev = &priv->device->pdev->dev;
+	u64 size = (u64)noc_dma_arena_size << 20;
+	struct noc_dma_arena *arena;
+	int region;
 
-	dma_unmap_sgtable(&priv->device->pdev->dev, &pinning->dma_mapping, DMA_BIDIRECTIONAL, 0);
-	free_chained_sgt(&pinning->dma_mapping);
+	if (priv->noc_dma_arena || size == 0)
+		return priv->noc_dma_arena;
 
-	unpin_user_pages_dirty_lock(pinning->pages, pinning->page_count, true);
-	vfree(pinning->pages);
+	arena = kzalloc(sizeof(*arena), GFP_KERNEL);
+	if (!arena)
+		return NULL;
 
-	list_del(&pinning->list);
-	kfree(pinning);
-}
+	arena->free = gen_pool_create(PAGE_SHIFT, dev_to_node(dev));
+	if (!arena->free)
+		goto err_free_arena;
 
-struct peer_resource_mapping {
-	struct list_head list;
+	if (gen_pool_add(arena->free, PAGE_SIZE, size, dev_to_node(dev)))
+		goto err_destroy_pool;
 
-	dma_addr_t mapped_address;
-	size_t size;
-};
+	if (!dma_iova_try_alloc(dev, &arena->iova, 0, size))
+		goto err_destroy_pool;
 
-// This replaces tenstorrent_query_mappings from ioctl.h with a version
-// that uses a flexible array member rather than a zero-length array.
-// This keeps UBSAN from triggering when we write the output mappings.
-struct tenstorrent_query_mappings_flex {
-	struct tenstorrent_query_mappings_in in;
-	struct tenstorrent_mapping out_mappings[];
-};
+	region = __setup_noc_dma(priv, false, size, arena->iova.addr, &arena->noc_address);
+	if (region < 0)
+		goto err_free_iova;
+
+	arena->outbound_iatu_region = region;
+	priv->noc_dma_arena = arena;
+	return arena;
+
+err_free_iova:
+	dma_iova_free(dev, &arena->iova);
+err_destroy_pool:
+	gen_pool_destroy(arena->free);
+err_free_arena:
+	kfree(arena);
+	return NULL;
+}
 
-long ioctl_query_mappings(struct chardev_private *priv,
-			  struct tenstorrent_query_mappings __user *arg_)
+// Can this fd's NOC_DMA pinnings and buffers go in an arena at all? It may
+// still turn out to be full, or impossible to create.
+static bool noc_dma_arena_enabled(struct chardev_private *priv)
 {
-	struct tenstorrent_query_mappings_flex __user *arg = (struct tenstorrent_query_mappings_flex __user *)arg_;
-
-	struct tenstorrent_mapping mappings[6];
-	struct tenstorrent_mapping *next_mapping;
+	return noc_dma_arena_size != 0 && is_iommu_translated(&priv->device->pdev->dev);
+}
 
-	u32 valid_mappings_to_copy;
-	u32 extra_mappings_to_clear;
-	u32 valid_mappings;
+// Map the pages of an sg_table, which must not be DMA-mapped already, into a
+// free piece of the arena. That is their only IOVA: *dma_address is in the
+// arena. Caller holds iatu_mutex.
+static int __link_noc_dma_arena(struct chardev_private *priv, struct sg_table *pages, u64 size,
+				enum dma_data_direction dir, dma_addr_t *dma_address, u64 *noc_address)
+{
+	struct device *dev = &priv->device->pdev->dev;
+	struct noc_dma_arena *arena = __get_noc_dma_arena(priv);
+	struct scatterlist *sg;
+	unsigned long start;
+	size_t offset;
+	size_t linked = 0;
+	unsigned int i;
+	int ret;
 
-	resource_size_t resource_len;
+	if (!arena || arena->outbound_iatu_region < 0)
+		return -ENOSPC;
 
-	struct tenstorrent_query_mappings_in in;
-	if (copy_from_user(&in, &arg->in, sizeof(in)) != 0)
-		return -EFAULT;
+	start = gen_pool_alloc(arena->free, size);
+	if (!start)
+		return -ENOSPC;
 
-	memset(mappings, 0, sizeof(mappings));
-	next_mapping = mappings;
+	offset = start - PAGE_SIZE;
 
-	resource_len = pci_resource_len(priv->device->pdev, 0);
-	if (resource_len > 0) {
-		next_mapping->mapping_id = TENSTORRENT_MAPPING_RESOURCE0_UC;
-		next_mapping->mapping_base = MMAP_OFFSET_RESOURCE0_UC;
-		next_mapping->mapping_size = resource_len;
-		next_mapping++;
+	for_each_sgtable_sg(pages, sg, i) {
+		ret = dma_iova_link(dev, &arena->iova, sg_phys(sg), offset + linked, sg->length, dir, 0);
+		if (ret)
+			goto err_unlink;
 
-		next_mapping->mapping_id = TENSTORRENT_MAPPING_RESOURCE0_WC;
-		next_mapping->mapping_base = MMAP_OFFSET_RESOURCE0_WC;
-		next_mapping->mapping_size = resource_len;
-		next_mapping++;
+		linked += sg->length;
 	}
 
-	resource_len = pci_resource_len(priv->device->pdev, 2);
-	if (resource_len > 0) {
-		next_mapping->mapping_id = TENSTORRENT_MAPPING_RESOURCE1_UC;
-		next_mapping->mapping_base = MMAP_OFFSET_RESOURCE1_UC;
-		next_mapping->mapping_size = resource_len;
-		next_mapping++;
+	ret = dma_iova_sync(dev, &arena->iova, offset, linked);
+	if (ret)
+		goto err_unlink;
 
-		next_mapping->mapping_id = TENSTORRENT_MAPPING_RESOURCE1_WC;
-		next_mapping->mapping_base = MMAP_OFFSET_RESOURCE1_WC;
-		next_mapping->mapping_size = resource_len;
-		next_mapping++;
-	}
+	*dma_address = arena->iova.addr + offset;
+	*noc_address = arena->noc_address + offset;
+	return 0;
 
-	resource_len = pci_resource_len(priv->device->pdev, 4);
-	if (resource_len > 0) {
-		next_mapping->mapping_id = TENSTORRENT_MAPPING_RESOURCE2_UC;
-		next_mapping->mapping_base = MMAP_OFFSET_RESOURCE2_UC;
-		next_mapping->mapping_size = resource_len;
-		next_mapping++;
+err_unlink:
+	if (linked)
+		dma_iova_unlink(dev, &arena->iova, offset, linked, dir, 0);
+	gen_pool_free(arena->free, start, size);
+	return ret;
+}
 
-		next_mapping->mapping_id = TENSTORRENT_MAPPING_RESOURCE2_WC;
-		next_mapping->mapping_base = MMAP_OFFSET_RESOURCE2_WC;
-		next_mapping->mapping_size = resource_len;
-		next_mapping++;
-	}
+// Undo __link_noc_dma_arena, or part of it. Callers come from ioctls, VMA
+// close and the deferred release work, so take iatu_mutex like the link side
+// rather than rely on the pieces being disjoint.
+static void unlink_noc_dma_arena(struct chardev_private *priv, u64 noc_address, u64 size,
+				 enum dma_data_direction dir)
+{
+	struct tenstorrent_device *tt_dev = priv->device;
+	struct noc_dma_arena *arena;
+	size_t offset;
 
-	valid_mappings = next_mapping - mappings;
+	mutex_lock(&tt_dev->iatu_mutex);
 
-	valid_mappings_to_copy = min(in.output_mapping_count, valid_mappings);
-	extra_mappings_to_clear = (in.output_mapping_count > valid_mappings)
-		? in.output_mapping_count - valid_mappings : 0;
+	arena = priv->noc_dma_arena;
+	offset = noc_address - arena->noc_address;
 
-	if (U32_MAX / sizeof(struct tenstorrent_mapping) < extra_mappings_to_clear)
-		return -EFAULT;
+	dma_iova_unlink(&tt_dev->pdev->dev, &arena->iova, offset, size, dir, 0);
+	gen_pool_free(arena->free, offset + PAGE_SIZE, size);
 
-	if (copy_to_user(&arg->out_mappings, &mappings,
-			 valid_mappings_to_copy * sizeof(struct tenstorrent_mapping)))
-		return -EFAULT;
+	mutex_unlock(&tt_dev->iatu_mutex);
+}
 
-	if (clear_user(&arg->out_mappings[valid_mappings_to_copy],
-		       extra_mappings_to_clear * sizeof(struct tenstorrent_mapping)))
-		return -EFAULT;
+// Caller holds iatu_mutex.
+static void __revoke_noc_dma_arena(struct chardev_private *priv)
+{
+	struct noc_dma_arena *arena = priv->noc_dma_arena;
 
-	return 0;
+	if (arena) {
+		__teardown_outbound_iatu(priv, arena->outbound_iatu_region);
+		arena->outbound_iatu_region = -1;
+	}
 }
 
-static struct dmabuf *lookup_dmabuf_by_index(struct chardev_private *priv, u8 buf_index) {
-	struct dmabuf *dmabuf;
+// Everything linked into the arena must be gone.
+static void destroy_noc_dma_arena(struct chardev_private *priv)
+{
+	struct noc_dma_arena *arena = priv->noc_dma_arena;
 
-	hash_for_each_possible(priv->dmabufs, dmabuf, hash_chain, buf_index)
-		if (dmabuf->index == buf_index)
-			return dmabuf;
+	if (!arena)
+		return;
 
-	return NULL;
+	teardown_outbound_iatu(priv, arena->outbound_iatu_region);
+	dma_iova_free(&priv->device->pdev->dev, &arena->iova);
+	gen_pool_destroy(arena->free);
+	kfree(arena);
+	priv->noc_dma_arena = NULL;
+}
+#else
+static bool noc_dma_arena_enabled(struct chardev_private *priv)
+{
+	return false;
 }
 
-static u64 dmabuf_mapping_start(u8 buf_index) {
-	return MMAP_OFFSET_DMA_BUF + buf_index * MMAP_SIZE_DMA_BUF;
+static int __link_noc_dma_arena(struct chardev_private *priv, struct sg_table *pages, u64 size,
+				enum dma_data_direction dir, dma_addr_t *dma_address, u64 *noc_address)
+{
+	return -EOPNOTSUPP;
 }
 
-long ioctl_allocate_dma_buf(struct chardev_private *priv,
-			    struct tenstorrent_allocate_dma_buf __user *arg)
+static void unlink_noc_dma_arena(struct chardev_private *priv, u64 noc_address, u64 size,
+				 enum dma_data_direction dir)
 {
-	dma_addr_t dma_handle = 0;
-	void *dma_buf_kernel_ptr;
-	struct dmabuf *dmabuf;
-	long ret = 0;
-	int iatu_region = -1;
+}
 
-	struct tenstorrent_allocate_dma_buf_in in;
-	struct tenstorrent_allocate_dma_buf_out out;
-	memset(&in, 0, sizeof(in));
-	memset(&out, 0, sizeof(out));
+static void __revoke_noc_dma_arena(struct chardev_private *priv)
+{
+}
 
-	if (copy_from_user(&in, &arg->in, sizeof(in)) != 0)
-		return -EFAULT;
+static void destroy_noc_dma_arena(struct chardev_private *priv)
+{
+}
+#endif
 
-	if (!priv->device->dma_capable)
-		return -EINVAL;
+static u64 pinning_start(struct pinned_page_range *pinning)
+{
+	return pinning->virtual_address;
+}
 
-	if (in.buf_index >= TENSTORRENT_MAX_DMA_BUFS)
-		return -EINVAL;
+static u64 pinning_last(struct pinned_page_range *pinning)
+{
+	return pinning->virtual_address + ((u64)pinning->page_count << PAGE_SHIFT) - 1;
+}
 
-	if (in.requested_size % PAGE_SIZE != 0
-	    || in.requested_size == 0
-	    || in.requested_size > MAX_DMA_BUF_SIZE)
-		return -EINVAL;
+INTERVAL_TREE_DEFINE(struct pinned_page_range, rb, u64, __subtree_last,
+		     pinning_start, pinning_last, , pinning_tree)
 
-	mutex_lock(&priv->mutex);
+// Find the pinning that starts at va, preferring one of nr_pages.
+static struct pinned_page_range *find_pinning(struct rb_root_cached *root, u64 va, unsigned long nr_pages)
+{
+	struct pinned_page_range *pinning;
+	struct pinned_page_range *found = NULL;
 
-	if (lookup_dmabuf_by_index(priv, in.buf_index)) {
-		ret = -EINVAL;
-		goto out;
-	}
+	for (pinning = pinning_tree_iter_first(root, va, va); pinning;
+	     pinning = pinning_tree_iter_next(pinning, va, va)) {
+		if (pinning->virtual_address != va)
+			continue;
 
-	dmabuf = kzalloc(sizeof(*dmabuf), GFP_KERNEL);
-	if (!dmabuf) {
-		ret = -ENOMEM;
-		goto out;
+		found = pinning;
+		if (pinning->page_count == nr_pages)
+			break;
 	}
 
-	dma_buf_kernel_ptr = dma_alloc_coherent(&priv->device->pdev->dev,
-						in.requested_size,
-						&dma_handle, GFP_KERNEL);
+	return found;
+}
 
-	if (dma_buf_kernel_ptr == NULL) {
-		kfree(dmabuf);
-		ret = -ENOMEM;
-		goto out;
-	}
+static enum dma_data_direction pinning_dma_dir(const struct pinned_page_range *pinning)
+{
+	if (pinning->flags & TENSTORRENT_PIN_PAGES_TO_DEVICE)
+		return DMA_TO_DEVICE;
+	if (pinning->flags & TENSTORRENT_PIN_PAGES_FROM_DEVICE)
+		return DMA_FROM_DEVICE;
+	return DMA_BIDIRECTIONAL;
+}
 
-	if (in.flags & TENSTORRENT_ALLOCATE_DMA_BUF_NOC_DMA) {
-		bool top_down = true;
-		ret = setup_noc_dma(priv, top_down, in.requested_size, dma_handle, &out.noc_address);
-		if (ret < 0) {
-			dma_free_coherent(&priv->device->pdev->dev, in.requested_size, dma_buf_kernel_ptr, dma_handle);
-			kfree(dmabuf);
-			goto out;
-		}
-		iatu_region = ret;
-		ret = 0;
+// Unpins a folio at a time rather than a page at a time. Shared pages are
+// left to the last pinning using them, and always dirtied since any of the
+// devices may have written them. TO_DEVICE pages are never dirtied.
+static void unpin_page_runs(struct pinned_page_range *pinning, bool make_dirty)
+{
+	struct shared_pinned_pages *shared = pinning->shared;
+	struct pinned_page_run *runs = pinning->runs;
+	unsigned long run_count = pinning->run_count;
+	bool read_only = pinning_dma_dir(pinning) == DMA_TO_DEVICE;
+	unsigned long i;
+
+	pinning->runs = NULL;
+	pinning->run_count = 0;
+	pinning->page_count = 0;
+	pinning->shared = NULL;
+
+	if (shared) {
+		if (!refcount_dec_and_test(&shared->refs))
+			return;
+
+		kfree(shared);
+		make_dirty = true;
 	}
 
-	dmabuf->index = in.buf_index;
-	dmabuf->ptr = dma_buf_kernel_ptr;
-	dmabuf->phys = dma_handle;
-	dmabuf->size = in.requested_size;
-	dmabuf->outbound_iatu_region = iatu_region;
-
-	out.physical_address = (u64)dmabuf->phys;
-	out.mapping_offset = dmabuf_mapping_start(in.buf_index);
-	out.size = in.requested_size;
-
-	if (copy_to_user(&arg->out, &out, sizeof(out)) != 0) {
-		dma_free_coherent(&priv->device->pdev->dev, dmabuf->size,
-				  dmabuf->ptr, dmabuf->phys);
+	if (read_only)
+		make_dirty = false;
 
-		kfree(dmabuf);
-		ret = -EFAULT;
-		goto out;
+	for (i = 0; i < run_count; i++) {
+		unpin_user_page_range_dirty_lock(runs[i].page, runs[i].npages, make_dirty);
+		cond_resched();
 	}
 
-	hash_add(priv->dmabufs, &dmabuf->hash_chain, dmabuf->index);
-
-out:
-	mutex_unlock(&priv->mutex);
-	return ret;
+	kvfree(runs);
 }
 
-long ioctl_free_dma_buf(struct chardev_private *priv,
-			struct tenstorrent_free_dma_buf __user *arg)
+#ifdef TENSTORRENT_PIN_CACHE
+static bool pin_cache_invalidate(struct mmu_interval_notifier *mni,
+				 const struct mmu_notifier_range *range,
+				 unsigned long cur_seq)
 {
-	// This is unsupported until I figure out how to block freeing as long
-	// as a mapping exists. Otherwise the dma buffer is freed when the
-	// struct file is destroyed, and that's safe because the mapping
-	// refcounts the file.
-	return -EINVAL;
-}
+	struct pinned_page_range *pinning = container_of(mni, struct pinned_page_range, notifier);
 
+	// Pinned pages don't move, so protection changes (mprotect, NUMA
+	// balancing, soft-dirty tracking) leave the pinning valid.
+	if (range->event == MMU_NOTIFY_PROTECTION_VMA ||
+	    range->event == MMU_NOTIFY_PROTECTION_PAGE ||
+	    range->event == MMU_NOTIFY_SOFT_DIRTY)
+		return true;
 
-bool is_iommu_translated(struct device *dev)
-{
-	struct iommu_domain *domain = iommu_get_domain_for_dev(dev);
+	// We can't take priv->mutex here: PIN_PAGES holds it while faulting in
+	// pages, which can itself invalidate. Mark the pinning stale and let
+	// the work item release it if it's idle.
+	mmu_interval_set_seq(mni, cur_seq);
+	schedule_work(&pinning->priv->pin_cache_work);
+
+	return true;
+}
+
+static const struct mmu_interval_notifier_ops pin_cache_ops = {
+	.invalidate = pin_cache_invalidate,
+};
+
+// Must be called before pinning, so that an invalidation racing with the pin
+// is seen.
+static int pin_cache_watch(struct pinned_page_range *pinning, u64 va, u64 size)
+{
+	int ret;
+
+	ret = mmu_interval_notifier_insert(&pinning->notifier, current->mm, va, size, &pin_cache_ops);
+	if (ret)
+		return ret;
+
+	pinning->notifier_seq = mmu_interval_read_begin(&pinning->notifier);
+	return 0;
+}
+
+static void pin_cache_unwatch(struct pinned_page_range *pinning)
+{
+	if (pinning->flags & TENSTORRENT_PIN_PAGES_CACHED)
+		mmu_interval_notifier_remove(&pinning->notifier);
+}
+
+static bool pin_cache_valid(struct pinned_page_range *pinning)
+{
+	return (pinning->flags & TENSTORRENT_PIN_PAGES_CACHED)
+		&& !mmu_interval_check_retry(&pinning->notifier, pinning->notifier_seq);
+}
+#else
+static int pin_cache_watch(struct pinned_page_range *pinning, u64 va, u64 size)
+{
+	return -EOPNOTSUPP;
+}
+
+static void pin_cache_unwatch(struct pinned_page_range *pinning)
+{
+}
+
+static bool pin_cache_valid(struct pinned_page_range *pinning)
+{
+	return false;
+}
+#endif
+
+#ifdef TENSTORRENT_DMA_IOVA
+// A pinning's own IOVA range. unpin_subrange unlinks the middle of it and
+// leaves the head and tail sharing the rest, so it's freed with the last.
+struct pinning_iova {
+	refcount_t refs;
+	struct dma_iova_state state;
+};
+
+// Map the pinning into an IOVA range of its own, a run at a time, rather than
+// with dma_map_sgtable: unlike a scatterlist mapping, part of it can be
+// unmapped. Returns -EOPNOTSUPP if the DMA API can't hand out an IOVA range.
+static int link_pinning_iova(struct device *dev, struct pinned_page_range *pinning)
+{
+	enum dma_data_direction dir = pinning_dma_dir(pinning);
+	struct pinning_iova *iova;
+	size_t linked = 0;
+	unsigned long i;
+	int ret;
+
+	iova = kzalloc(sizeof(*iova), GFP_KERNEL);
+	if (!iova)
+		return -ENOMEM;
+
+	if (!dma_iova_try_alloc(dev, &iova->state, 0, (u64)pinning->page_count << PAGE_SHIFT)) {
+		kfree(iova);
+		return -EOPNOTSUPP;
+	}
+
+	for (i = 0; i < pinning->run_count; i++) {
+		size_t size = (size_t)pinning->runs[i].npages << PAGE_SHIFT;
+
+		ret = dma_iova_link(dev, &iova->state, page_to_phys(pinning->runs[i].page), linked, size, dir, 0);
+		if (ret)
+			goto err_unlink;
+
+		linked += size;
+	}
+
+	ret = dma_iova_sync(dev, &iova->state, 0, linked);
+	if (ret)
+		goto err_unlink;
+
+	refcount_set(&iova->refs, 1);
+	pinning->iova = iova;
+	pinning->dma_address = iova->state.addr;
+	return 0;
+
+err_unlink:
+	if (linked)
+		dma_iova_unlink(dev, &iova->state, 0, linked, dir, 0);
+	dma_iova_free(dev, &iova->state);
+	kfree(iova);
+	return ret;
+}
+
+// Unlink size bytes at offset into the pinning from its IOVA range.
+static void unlink_pinning_iova(struct device *dev, struct pinned_page_range *pinning, u64 offset, u64 size)
+{
+	struct pinning_iova *iova = pinning->iova;
+
+	dma_iova_unlink(dev, &iova->state, pinning->dma_address - iova->state.addr + offset, size,
+			pinning_dma_dir(pinning), 0);
+}
+
+static struct pinning_iova *get_pinning_iova(struct pinning_iova *iova)
+{
+	if (iova)
+		refcount_inc(&iova->refs);
+	return iova;
+}
+
+// Unlink all of the pinning and drop its share of the IOVA range.
+static void release_pinning_iova(struct device *dev, struct pinned_page_range *pinning)
+{
+	struct pinning_iova *iova = pinning->iova;
+
+	unlink_pinning_iova(dev, pinning, 0, (u64)pinning->page_count << PAGE_SHIFT);
+
+	if (refcount_dec_and_test(&iova->refs)) {
+		dma_iova_free(dev, &iova->state);
+		kfree(iova);
+	}
+}
+#else
+static int link_pinning_iova(struct device *dev, struct pinned_page_range *pinning)
+{
+	return -EOPNOTSUPP;
+}
+
+static void unlink_pinning_iova(struct device *dev, struct pinned_page_range *pinning, u64 offset, u64 size)
+{
+}
+
+static struct pinning_iova *get_pinning_iova(struct pinning_iova *iova)
+{
+	return iova;
+}
+
+static void release_pinning_iova(struct device *dev, struct pinned_page_range *pinning)
+{
+}
+#endif
+
+// Undo create_pinning. The pinning must no longer be in a tree or own an iATU region.
+static void release_pinning(struct chardev_private *priv,
+	struct pinned_page_range *pinning, bool make_dirty)
+{
+	pin_cache_unwatch(pinning);
+
+	if (pinning->arena_noc_address)
+		unlink_noc_dma_arena(priv, pinning->arena_noc_address, (u64)pinning->page_count << PAGE_SHIFT,
+				     pinning_dma_dir(pinning));
+
+	if (pinning->iova)
+		release_pinning_iova(&priv->device->pdev->dev, pinning);
+
+	if (pinning->dma_mapping.sgl) {
+		dma_unmap_sgtable(&priv->device->pdev->dev, &pinning->dma_mapping, pinning_dma_dir(pinning), 0);
+		free_chained_sgt(&pinning->dma_mapping);
+	}
+
+	unpin_page_runs(pinning, make_dirty);
+
+	kfree(pinning);
+}
+
+static void unpin_pinned_page_range(struct chardev_private *priv,
+	struct pinned_page_range *pinning)
+{
+	teardown_outbound_iatu(priv, pinning->outbound_iatu_region);
+	pinning_tree_remove(pinning, &priv->pinnings);
+	release_pinning(priv, pinning, true);
+}
+
+struct peer_resource_mapping {
+	struct list_head list;
+
+	dma_addr_t mapped_address;
+	size_t size;
+};
+
+// This replaces tenstorrent_query_mappings from ioctl.h with a version
+// that uses a flexible array member rather than a zero-length array.
+// This keeps UBSAN from triggering when we write the output mappings.
+struct tenstorrent_query_mappings_flex {
+	struct tenstorrent_query_mappings_in in;
+	struct tenstorrent_mapping out_mappings[];
+};
+
+long ioctl_query_mappings(struct chardev_private *priv,
+			  struct tenstorrent_query_mappings __user *arg_)
+{
+	struct tenstorrent_query_mappings_flex __user *arg = (struct tenstorrent_query_mappings_flex __user *)arg_;
+
+	struct tenstorrent_mapping mappings[6];
+	struct tenstorrent_mapping *next_mapping;
+
+	u32 valid_mappings_to_copy;
+	u32 extra_mappings_to_clear;
+	u32 valid_mappings;
+
+	resource_size_t resource_len;
+
+	struct tenstorrent_query_mappings_in in;
+	if (copy_from_user(&in, &arg->in, sizeof(in)) != 0)
+		return -EFAULT;
+
+	memset(mappings, 0, sizeof(mappings));
+	next_mapping = mappings;
+
+	resource_len = pci_resource_len(priv->device->pdev, 0);
+	if (resource_len > 0) {
+		next_mapping->mapping_id = TENSTORRENT_MAPPING_RESOURCE0_UC;
+		next_mapping->mapping_base = MMAP_OFFSET_RESOURCE0_UC;
+		next_mapping->mapping_size = resource_len;
+		next_mapping++;
+
+		next_mapping->mapping_id = TENSTORRENT_MAPPING_RESOURCE0_WC;
+		next_mapping->mapping_base = MMAP_OFFSET_RESOURCE0_WC;
+		next_mapping->mapping_size = resource_len;
+		next_mapping++;
+	}
+
+	resource_len = pci_resource_len(priv->device->pdev, 2);
+	if (resource_len > 0) {
+		next_mapping->mapping_id = TENSTORRENT_MAPPING_RESOURCE1_UC;
+		next_mapping->mapping_base = MMAP_OFFSET_RESOURCE1_UC;
+		next_mapping->mapping_size = resource_len;
+		next_mapping++;
+
+		next_mapping->mapping_id = TENSTORRENT_MAPPING_RESOURCE1_WC;
+		next_mapping->mapping_base = MMAP_OFFSET_RESOURCE1_WC;
+		next_mapping->mapping_size = resource_len;
+		next_mapping++;
+	}
+
+	resource_len = pci_resource_len(priv->device->pdev, 4);
+	if (resource_len > 0) {
+		next_mapping->mapping_id = TENSTORRENT_MAPPING_RESOURCE2_UC;
+		next_mapping->mapping_base = MMAP_OFFSET_RESOURCE2_UC;
+		next_mapping->mapping_size = resource_len;
+		next_mapping++;
+
+		next_mapping->mapping_id = TENSTORRENT_MAPPING_RESOURCE2_WC;
+		next_mapping->mapping_base = MMAP_OFFSET_RESOURCE2_WC;
+		next_mapping->mapping_size = resource_len;
+		next_mapping++;
+	}
+
+	valid_mappings = next_mapping - mappings;
+
+	valid_mappings_to_copy = min(in.output_mapping_count, valid_mappings);
+	extra_mappings_to_clear = (in.output_mapping_count > valid_mappings)
+		? in.output_mapping_count - valid_mappings : 0;
+
+	if (U32_MAX / sizeof(struct tenstorrent_mapping) < extra_mappings_to_clear)
+		return -EFAULT;
+
+	if (copy_to_user(&arg->out_mappings, &mappings,
+			 valid_mappings_to_copy * sizeof(struct tenstorrent_mapping)))
+		return -EFAULT;
+
+	if (clear_user(&arg->out_mappings[valid_mappings_to_copy],
+		       extra_mappings_to_clear * sizeof(struct tenstorrent_mapping)))
+		return -EFAULT;
+
+	return 0;
+}
+
+static struct dmabuf *lookup_dmabuf(struct chardev_private *priv, u32 id) {
+	return idr_find(&priv->dmabufs, id);
+}
+
+// chardev_private.dmabuf_offsets is an rbtree of ALLOCATE_DMA_BUF_V2 buffers
+// in mmap_offset order. Each buffer records the free offsets just below it in
+// mmap_gap, and the largest mmap_gap in its subtree in subtree_gap, so finding
+// a free piece of the V2 space takes O(log n) like finding a buffer does.
+static struct dmabuf *dmabuf_of(struct rb_node *node)
+{
+	return rb_entry_safe(node, struct dmabuf, mmap_rb);
+}
+
+static u64 dmabuf_subtree_gap(struct dmabuf *dmabuf)
+{
+	struct dmabuf *left = dmabuf_of(dmabuf->mmap_rb.rb_left);
+	struct dmabuf *right = dmabuf_of(dmabuf->mmap_rb.rb_right);
+	u64 gap = dmabuf->mmap_gap;
+
+	if (left && left->subtree_gap > gap)
+		gap = left->subtree_gap;
+	if (right && right->subtree_gap > gap)
+		gap = right->subtree_gap;
+
+	return gap;
+}
+
+static void dmabuf_gap_propagate(struct rb_node *node, struct rb_node *stop)
+{
+	while (node != stop) {
+		struct dmabuf *dmabuf = dmabuf_of(node);
+		u64 gap = dmabuf_subtree_gap(dmabuf);
+
+		if (dmabuf->subtree_gap == gap)
+			break;
+
+		dmabuf->subtree_gap = gap;
+		node = rb_parent(node);
+	}
+}
+
+static void dmabuf_gap_copy(struct rb_node *old_node, struct rb_node *new_node)
+{
+	dmabuf_of(new_node)->subtree_gap = dmabuf_of(old_node)->subtree_gap;
+}
+
+static void dmabuf_gap_rotate(struct rb_node *old_node, struct rb_node *new_node)
+{
+	struct dmabuf *old = dmabuf_of(old_node);
+
+	dmabuf_of(new_node)->subtree_gap = old->subtree_gap;
+	old->subtree_gap = dmabuf_subtree_gap(old);
+}
+
+static const struct rb_augment_callbacks dmabuf_gap_callbacks = {
+	.propagate = dmabuf_gap_propagate,
+	.copy = dmabuf_gap_copy,
+	.rotate = dmabuf_gap_rotate,
+};
+
+// The V2 buffer whose mmap range contains offset, or NULL.
+static struct dmabuf *lookup_dmabuf_mmap_offset(struct chardev_private *priv, u64 offset)
+{
+	struct rb_node *node = priv->dmabuf_offsets.rb_node;
+
+	while (node) {
+		struct dmabuf *dmabuf = dmabuf_of(node);
+
+		if (offset < dmabuf->mmap_offset)
+			node = node->rb_left;
+		else if (offset - dmabuf->mmap_offset >= dmabuf->size)
+			node = node->rb_right;
+		else
+			return dmabuf;
+	}
+
+	return NULL;
+}
+
+// The lowest V2 buffer with at least size free offsets below it, or NULL.
+static struct dmabuf *find_dmabuf_mmap_gap(struct chardev_private *priv, u64 size)
+{
+	struct rb_node *node = priv->dmabuf_offsets.rb_node;
+
+	if (!node || dmabuf_of(node)->subtree_gap < size)
+		return NULL;
+
+	for (;;) {
+		struct dmabuf *dmabuf = dmabuf_of(node);
+		struct dmabuf *left = dmabuf_of(node->rb_left);
+
+		if (left && left->subtree_gap >= size)
+			node = node->rb_left;
+		else if (dmabuf->mmap_gap >= size)
+			return dmabuf;
+		else
+			node = node->rb_right;
+	}
+}
+
+// Give an ALLOCATE_DMA_BUF_V2 buffer the lowest free piece of the V2 mmap
+// offset space that fits it, or failing that the space after the last buffer.
+// thp_get_unmapped_area aligns the mapping like the offset, so buffers big
+// enough for huge mappings get PMD-aligned offsets. Caller holds priv->mutex.
+static int alloc_dmabuf_mmap_offset(struct chardev_private *priv, struct dmabuf *dmabuf)
+{
+	u64 align = dmabuf->size >= PMD_SIZE ? PMD_SIZE : PAGE_SIZE;
+	struct rb_node **link = &priv->dmabuf_offsets.rb_node;
+	struct rb_node *parent = NULL;
+	struct dmabuf *next;
+	u64 gap_start, gap_end;
+
+	// Gaps are page-aligned, so one this big fits the buffer however its
+	// start is aligned.
+	next = find_dmabuf_mmap_gap(priv, dmabuf->size + align - PAGE_SIZE);
+	if (next) {
+		gap_end = next->mmap_offset;
+		gap_start = gap_end - next->mmap_gap;
+	} else {
+		struct dmabuf *last = dmabuf_of(rb_last(&priv->dmabuf_offsets));
+
+		gap_start = last ? last->mmap_offset + last->size : MMAP_OFFSET_DMA_BUF_V2;
+		gap_end = MMAP_OFFSET_DMA_BUF_V2 + MMAP_SIZE_DMA_BUF_V2;
+	}
+
+	if (ALIGN(gap_start, align) > gap_end || gap_end - ALIGN(gap_start, align) < dmabuf->size)
+		return -ENOSPC;
+
+	dmabuf->mmap_offset = ALIGN(gap_start, align);
+	dmabuf->mmap_gap = dmabuf->mmap_offset - gap_start;
+	dmabuf->subtree_gap = dmabuf->mmap_gap;
+
+	// We go in under every buffer passed on the way down.
+	while (*link) {
+		struct dmabuf *other;
+
+		parent = *link;
+		other = dmabuf_of(parent);
+		if (other->subtree_gap < dmabuf->mmap_gap)
+			other->subtree_gap = dmabuf->mmap_gap;
+
+		if (dmabuf->mmap_offset < other->mmap_offset)
+			link = &parent->rb_left;
+		else
+			link = &parent->rb_right;
+	}
+
+	rb_link_node(&dmabuf->mmap_rb, parent, link);
+	rb_insert_augmented(&dmabuf->mmap_rb, &priv->dmabuf_offsets, &dmabuf_gap_callbacks);
+
+	if (next) {
+		next->mmap_gap = next->mmap_offset - (dmabuf->mmap_offset + dmabuf->size);
+		dmabuf_gap_propagate(&next->mmap_rb, NULL);
+	}
+
+	return 0;
+}
+
+// The buffer's offsets join the gap below the next buffer, or the free space
+// after the last.
+static void free_dmabuf_mmap_offset(struct chardev_private *priv, struct dmabuf *dmabuf)
+{
+	struct rb_node *next = rb_next(&dmabuf->mmap_rb);
+
+	rb_erase_augmented(&dmabuf->mmap_rb, &priv->dmabuf_offsets, &dmabuf_gap_callbacks);
+
+	if (next) {
+		dmabuf_of(next)->mmap_gap += dmabuf->mmap_gap + dmabuf->size;
+		dmabuf_gap_propagate(next, NULL);
+	}
+}
+
+// Undo idr_alloc, and alloc_dmabuf_mmap_offset for a V2 buffer. Mappings keep
+// working without the offset. Caller holds priv->mutex.
+static void remove_dmabuf(struct chardev_private *priv, struct dmabuf *dmabuf)
+{
+	idr_remove(&priv->dmabufs, dmabuf->id);
+
+	if (dmabuf->id >= TENSTORRENT_MAX_DMA_BUFS)
+		free_dmabuf_mmap_offset(priv, dmabuf);
+}
+
+// Reserve dma_pool_size MiB of coherent memory for ALLOCATE_DMA_BUF to carve
+// buffers out of. With CMA, a big dma_alloc_coherent comes from the CMA area.
+// Without a pool, or when it's full, buffers come from dma_alloc_coherent.
+void tenstorrent_dma_pool_init(struct tenstorrent_device *tt_dev)
+{
+	struct device *dev = &tt_dev->pdev->dev;
+	size_t size = (size_t)dma_pool_size << 20;
+	struct gen_pool *pool;
+	dma_addr_t dma_addr;
+	void *ptr;
+
+	if (size == 0 || !tt_dev->dma_capable)
+		return;
+
+	pool = gen_pool_create(PAGE_SHIFT, dev_to_node(dev));
+	if (!pool)
+		return;
+
+	ptr = dma_alloc_coherent(dev, size, &dma_addr, GFP_KERNEL | __GFP_NOWARN);
+	if (!ptr) {
+		dev_warn(dev, "Could not reserve %u MiB DMA pool.\n", dma_pool_size);
+		gen_pool_destroy(pool);
+		return;
+	}
+
+	if (gen_pool_add_virt(pool, (unsigned long)ptr, dma_addr, size, dev_to_node(dev))) {
+		dma_free_coherent(dev, size, ptr, dma_addr);
+		gen_pool_destroy(pool);
+		return;
+	}
+
+	tt_dev->dma_pool = pool;
+	tt_dev->dma_pool_ptr = ptr;
+	tt_dev->dma_pool_dma_addr = dma_addr;
+	tt_dev->dma_pool_size = size;
+}
+
+// Every buffer must have been freed, i.e. all fds released.
+void tenstorrent_dma_pool_fini(struct tenstorrent_device *tt_dev)
+{
+	if (!tt_dev->dma_pool)
+		return;
+
+	gen_pool_destroy(tt_dev->dma_pool);
+	dma_free_coherent(&tt_dev->pdev->dev, tt_dev->dma_pool_size,
+			  tt_dev->dma_pool_ptr, tt_dev->dma_pool_dma_addr);
+	tt_dev->dma_pool = NULL;
+}
+
+// Sets dmabuf->ptr or dmabuf->sgt, and dmabuf->phys. allow_sg lets a buffer
+// behind an IOMMU be built from discontiguous pages: only the IOVA range has
+// to be contiguous, and the kernel doesn't vmap it.
+static int alloc_dmabuf_memory(struct tenstorrent_device *tt_dev, struct dmabuf *dmabuf, bool allow_sg)
+{
+	struct device *dev = &tt_dev->pdev->dev;
+
+	if (tt_dev->dma_pool) {
+		dmabuf->ptr = gen_pool_dma_alloc(tt_dev->dma_pool, dmabuf->size, &dmabuf->phys);
+		if (dmabuf->ptr) {
+			// dma_alloc_coherent zeroes, and the pool may hold a
+			// previous owner's data.
+			memset(dmabuf->ptr, 0, dmabuf->size);
+			dmabuf->from_pool = true;
+			return 0;
+		}
+	}
+
+#ifdef TENSTORRENT_DMA_NONCONTIGUOUS
+	if (allow_sg && is_iommu_translated(dev)) {
+		dmabuf->sgt = dma_alloc_noncontiguous(dev, dmabuf->size, DMA_BIDIRECTIONAL,
+						      GFP_KERNEL | __GFP_ZERO, 0);
+		if (!dmabuf->sgt)
+			return -ENOMEM;
+
+		// With an IOMMU, the whole buffer is a single DMA segment.
+		dmabuf->phys = sg_dma_address(dmabuf->sgt->sgl);
+		return 0;
+	}
+#endif
+
+	dmabuf->ptr = dma_alloc_coherent(dev, dmabuf->size, &dmabuf->phys, GFP_KERNEL);
+	return dmabuf->ptr ? 0 : -ENOMEM;
+}
+
+// Each entry of sgt is a block of 2^get_order(length) pages.
+static void free_dmabuf_node_pages(struct sg_table *sgt)
+{
+	struct scatterlist *sg;
+	unsigned int i;
+
+	for_each_sg(sgt->sgl, sg, sgt->orig_nents, i)
+		__free_pages(sg_page(sg), get_order(sg->length));
+
+	sg_free_table(sgt);
+	kfree(sgt);
+}
+
+// The DMA API allocates on the device's node, so for any other node allocate
+// the pages ourselves; map_dmabuf_node_pages makes a streaming mapping of them.
+// Behind an IOMMU they can be scattered, without one the buffer must be a
+// single block. Buffers for the NOC DMA arena are allocated this way too, on
+// the device's node, and only linked into the arena.
+// Like pinned pages, this relies on DMA being cache coherent.
+static int alloc_dmabuf_node_pages(struct tenstorrent_device *tt_dev, struct dmabuf *dmabuf, int node)
+{
+	struct device *dev = &tt_dev->pdev->dev;
+	bool iommu = is_iommu_translated(dev);
+	unsigned long remaining = dmabuf->size >> PAGE_SHIFT;
+	unsigned int max_order = get_order(dmabuf->size);
+	struct pinned_page_run *blocks;
+	unsigned long nblocks = 0;
+	struct scatterlist *sg;
+	struct sg_table *sgt;
+	unsigned long i;
+	int ret;
+
+	if (iommu)
+		max_order = min(max_order, get_order(SZ_2M));
+
+	blocks = kvmalloc_array(iommu ? remaining : 1, sizeof(*blocks), GFP_KERNEL);
+	if (!blocks)
+		return -ENOMEM;
+
+	while (remaining > 0) {
+		// Without an IOMMU the single block may be larger than the buffer.
+		unsigned int order = iommu ? min_t(unsigned int, max_order, ilog2(remaining)) : max_order;
+		struct page *page;
+
+		for (;;) {
+			gfp_t gfp = GFP_KERNEL | __GFP_ZERO | __GFP_NOWARN | __GFP_THISNODE;
+
+			if (order > 0)
+				gfp |= __GFP_NORETRY;
+
+			page = alloc_pages_node(node, gfp, order);
+			if (page || order == 0 || !iommu)
+				break;
+
+			order--;
+		}
+
+		if (!page) {
+			ret = -ENOMEM;
+			goto free_blocks;
+		}
+
+		blocks[nblocks].page = page;
+		blocks[nblocks].npages = min(1ul << order, remaining);
+		remaining -= blocks[nblocks].npages;
+		nblocks++;
+
+		cond_resched();
+	}
+
+	sgt = kzalloc(sizeof(*sgt), GFP_KERNEL);
+	if (!sgt) {
+		ret = -ENOMEM;
+		goto free_blocks;
+	}
+
+	ret = sg_alloc_table(sgt, nblocks, GFP_KERNEL);
+	if (ret) {
+		kfree(sgt);
+		goto free_blocks;
+	}
+
+	for_each_sg(sgt->sgl, sg, nblocks, i)
+		sg_set_page(sg, blocks[i].page, blocks[i].npages << PAGE_SHIFT, 0);
+
+	kvfree(blocks);
+
+	dmabuf->sgt = sgt;
+	dmabuf->node_pages = true;
+	return 0;
+
+free_blocks:
+	while (nblocks--)
+		__free_pages(blocks[nblocks].page, get_order(blocks[nblocks].npages << PAGE_SHIFT));
+	kvfree(blocks);
+	return ret;
+}
+
+// Give node pages their own DMA mapping, which must be a single IOVA range.
+static int map_dmabuf_node_pages(struct tenstorrent_device *tt_dev, struct dmabuf *dmabuf)
+{
+	struct device *dev = &tt_dev->pdev->dev;
+	int ret;
+
+	ret = dma_map_sgtable(dev, dmabuf->sgt, DMA_BIDIRECTIONAL, 0);
+	if (ret)
+		return ret;
+
+	if (dmabuf->sgt->nents != 1) {
+		dma_unmap_sgtable(dev, dmabuf->sgt, DMA_BIDIRECTIONAL, 0);
+		return -ENOMEM;
+	}
+
+	dmabuf->sgt_mapped = true;
+	dmabuf->phys = sg_dma_address(dmabuf->sgt->sgl);
+	return 0;
+}
+
+static void free_dmabuf_memory(struct tenstorrent_device *tt_dev, struct dmabuf *dmabuf)
+{
+	struct device *dev = &tt_dev->pdev->dev;
+
+	if (dmabuf->node_pages) {
+		if (dmabuf->sgt_mapped)
+			dma_unmap_sgtable(dev, dmabuf->sgt, DMA_BIDIRECTIONAL, 0);
+		free_dmabuf_node_pages(dmabuf->sgt);
+	} else if (dmabuf->sgt)
+		dma_free_noncontiguous(dev, dmabuf->size, dmabuf->sgt, DMA_BIDIRECTIONAL);
+	else if (dmabuf->from_pool)
+		gen_pool_free(tt_dev->dma_pool, (unsigned long)dmabuf->ptr, dmabuf->size);
+	else
+		dma_free_coherent(dev, dmabuf->size, dmabuf->ptr, dmabuf->phys);
+}
+
+// Free the buffer once it's neither in priv->dmabufs nor mapped or exported.
+void dmabuf_put(struct chardev_private *priv, struct dmabuf *dmabuf)
+{
+	if (!refcount_dec_and_test(&dmabuf->refs))
+		return;
+
+	teardown_outbound_iatu(priv, dmabuf->outbound_iatu_region);
+	if (dmabuf->arena_noc_address)
+		unlink_noc_dma_arena(priv, dmabuf->arena_noc_address, dmabuf->size, DMA_BIDIRECTIONAL);
+	free_dmabuf_memory(priv->device, dmabuf);
+	kfree(dmabuf);
+}
+
+// Link the buffer into the fd's arena if create_dmabuf meant it for one, or
+// failing that give it an iATU region. A buffer the arena can't take after all
+// is DMA-mapped here instead.
+static int setup_dmabuf_noc_dma(struct chardev_private *priv, struct dmabuf *dmabuf, u64 *noc_address)
+{
+	struct tenstorrent_device *tt_dev = priv->device;
+	bool top_down = true;
+	int ret = 0;
+
+	mutex_lock(&tt_dev->iatu_mutex);
+
+	if (dmabuf->node_pages && !dmabuf->sgt_mapped) {
+		if (__link_noc_dma_arena(priv, dmabuf->sgt, dmabuf->size, DMA_BIDIRECTIONAL,
+					 &dmabuf->phys, noc_address) == 0) {
+			dmabuf->arena_noc_address = *noc_address;
+			goto out;
+		}
+
+		ret = map_dmabuf_node_pages(tt_dev, dmabuf);
+		if (ret)
+			goto out;
+	}
+
+	ret = __setup_noc_dma(priv, top_down, dmabuf->size, dmabuf->phys, noc_address);
+	if (ret >= 0) {
+		dmabuf->outbound_iatu_region = ret;
+		ret = 0;
+	}
+
+out:
+	mutex_unlock(&tt_dev->iatu_mutex);
+
+	return ret;
+}
+
+// Allocate the buffer and its iATU region, the caller gives it an ID. Drop the
+// single reference with dmabuf_put. node is NUMA_NO_NODE for the device's node.
+static struct dmabuf *create_dmabuf(struct chardev_private *priv, u64 size, bool noc_dma,
+				    bool allow_sg, int node, u64 *noc_address)
+{
+	struct dmabuf *dmabuf;
+	int ret;
+
+	dmabuf = kzalloc(sizeof(*dmabuf), GFP_KERNEL);
+	if (!dmabuf)
+		return ERR_PTR(-ENOMEM);
+
+	dmabuf->size = size;
+	dmabuf->outbound_iatu_region = -1;
+	refcount_set(&dmabuf->refs, 1);
+
+	// A buffer that can go in the arena is made of pages of our own, so that
+	// the arena link is their only DMA mapping. It skips the pool, whose
+	// memory is mapped already.
+	if (noc_dma && noc_dma_arena_enabled(priv)) {
+		if (node == NUMA_NO_NODE)
+			node = dev_to_node(&priv->device->pdev->dev);
+		ret = alloc_dmabuf_node_pages(priv->device, dmabuf, node);
+	} else if (node == NUMA_NO_NODE) {
+		ret = alloc_dmabuf_memory(priv->device, dmabuf, allow_sg);
+	} else {
+		ret = alloc_dmabuf_node_pages(priv->device, dmabuf, node);
+		if (ret == 0) {
+			ret = map_dmabuf_node_pages(priv->device, dmabuf);
+			if (ret)
+				free_dmabuf_node_pages(dmabuf->sgt);
+		}
+	}
+	if (ret) {
+		kfree(dmabuf);
+		return ERR_PTR(ret);
+	}
+
+	if (noc_dma) {
+		ret = setup_dmabuf_noc_dma(priv, dmabuf, noc_address);
+		if (ret) {
+			dmabuf_put(priv, dmabuf);
+			return ERR_PTR(ret);
+		}
+	}
+
+	return dmabuf;
+}
+
+long ioctl_allocate_dma_buf(struct chardev_private *priv,
+			    struct tenstorrent_allocate_dma_buf __user *arg)
+{
+	struct dmabuf *dmabuf;
+	long ret = 0;
+
+	struct tenstorrent_allocate_dma_buf_in in;
+	struct tenstorrent_allocate_dma_buf_out out;
+	memset(&in, 0, sizeof(in));
+	memset(&out, 0, sizeof(out));
+
+	if (copy_from_user(&in, &arg->in, sizeof(in)) != 0)
+		return -EFAULT;
+
+	if (!priv->device->dma_capable)
+		return -EINVAL;
+
+	if (in.buf_index >= TENSTORRENT_MAX_DMA_BUFS)
+		return -EINVAL;
+
+	if (in.requested_size % PAGE_SIZE != 0
+	    || in.requested_size == 0
+	    || in.requested_size > MAX_DMA_BUF_SIZE)
+		return -EINVAL;
+
+	mutex_lock(&priv->mutex);
+
+	if (lookup_dmabuf(priv, in.buf_index)) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	dmabuf = create_dmabuf(priv, in.requested_size, in.flags & TENSTORRENT_ALLOCATE_DMA_BUF_NOC_DMA,
+			       false, NUMA_NO_NODE, &out.noc_address);
+	if (IS_ERR(dmabuf)) {
+		ret = PTR_ERR(dmabuf);
+		goto out;
+	}
+
+	ret = idr_alloc(&priv->dmabufs, dmabuf, in.buf_index, in.buf_index + 1, GFP_KERNEL);
+	if (ret < 0) {
+		dmabuf_put(priv, dmabuf);
+		goto out;
+	}
+
+	dmabuf->id = ret;
+	dmabuf->mmap_offset = MMAP_OFFSET_DMA_BUF + dmabuf->id * MMAP_SIZE_DMA_BUF;
+
+	out.physical_address = (u64)dmabuf->phys;
+	out.mapping_offset = dmabuf->mmap_offset;
+	out.size = in.requested_size;
+
+	if (copy_to_user(&arg->out, &out, sizeof(out)) != 0) {
+		remove_dmabuf(priv, dmabuf);
+		dmabuf_put(priv, dmabuf);
+		ret = -EFAULT;
+		goto out;
+	}
+
+	ret = 0;
+
+out:
+	mutex_unlock(&priv->mutex);
+	return ret;
+}
+
+long ioctl_allocate_dma_buf_v2(struct chardev_private *priv,
+			       struct tenstorrent_allocate_dma_buf_v2 __user *arg)
+{
+	struct tenstorrent_allocate_dma_buf_v2 args;
+	int node = NUMA_NO_NODE;
+	struct dmabuf *dmabuf;
+	long ret;
+
+	if (copy_from_user(&args, arg, sizeof(args)) != 0)
+		return -EFAULT;
+
+	if (args.argsz != sizeof(args)
+	    || (args.flags & ~(TENSTORRENT_ALLOCATE_DMA_BUF_NOC_DMA | TENSTORRENT_ALLOCATE_DMA_BUF_NUMA_NODE)))
+		return -EINVAL;
+
+	if (args.flags & TENSTORRENT_ALLOCATE_DMA_BUF_NUMA_NODE) {
+		if (args.numa_node >= MAX_NUMNODES || !node_online(args.numa_node))
+			return -EINVAL;
+		node = args.numa_node;
+	} else if (args.numa_node != 0) {
+		return -EINVAL;
+	}
+
+	if (!priv->device->dma_capable)
+		return -EINVAL;
+
+	if (args.size == 0 || !PAGE_ALIGNED(args.size) || args.size > MMAP_SIZE_DMA_BUF_V2)
+		return -EINVAL;
+
+	args.noc_address = 0;
+
+	mutex_lock(&priv->mutex);
+
+	dmabuf = create_dmabuf(priv, args.size, args.flags & TENSTORRENT_ALLOCATE_DMA_BUF_NOC_DMA,
+			       true, node, &args.noc_address);
+	if (IS_ERR(dmabuf)) {
+		ret = PTR_ERR(dmabuf);
+		goto out;
+	}
+
+	ret = idr_alloc(&priv->dmabufs, dmabuf, TENSTORRENT_MAX_DMA_BUFS, DMA_BUF_V2_HANDLE_MAX + 1,
+			GFP_KERNEL);
+	if (ret < 0) {
+		dmabuf_put(priv, dmabuf);
+		goto out;
+	}
+
+	dmabuf->id = ret;
+
+	ret = alloc_dmabuf_mmap_offset(priv, dmabuf);
+	if (ret) {
+		idr_remove(&priv->dmabufs, dmabuf->id);
+		dmabuf_put(priv, dmabuf);
+		goto out;
+	}
+
+	args.handle = dmabuf->id;
+	args.mmap_offset = dmabuf->mmap_offset;
+	args.dma_address = dmabuf->phys;
+
+	if (copy_to_user(arg, &args, sizeof(args)) != 0) {
+		remove_dmabuf(priv, dmabuf);
+		dmabuf_put(priv, dmabuf);
+		ret = -EFAULT;
+		goto out;
+	}
+
+	ret = 0;
+
+out:
+	mutex_unlock(&priv->mutex);
+	return ret;
+}
+
+static long free_dmabuf_id(struct chardev_private *priv, u32 id)
+{
+	struct dmabuf *dmabuf;
+
+	mutex_lock(&priv->mutex);
+
+	dmabuf = lookup_dmabuf(priv, id);
+	if (dmabuf)
+		remove_dmabuf(priv, dmabuf);
+
+	mutex_unlock(&priv->mutex);
+
+	if (!dmabuf)
+		return -EINVAL;
+
+	// Any mappings keep the buffer and its iATU region until they're gone.
+	dmabuf_put(priv, dmabuf);
+	return 0;
+}
+
+long ioctl_free_dma_buf(struct chardev_private *priv,
+			struct tenstorrent_free_dma_buf __user *arg)
+{
+	struct tenstorrent_free_dma_buf_in in = {0};
+
+	if (copy_from_user(&in, &arg->in, sizeof(in)) != 0)
+		return -EFAULT;
+
+	if (in.reserved0[0] || in.reserved0[1] || in.reserved0[2] || in.reserved1)
+		return -EINVAL;
+
+	return free_dmabuf_id(priv, in.buf_index);
+}
+
+long ioctl_free_dma_buf_v2(struct chardev_private *priv,
+			   struct tenstorrent_free_dma_buf_v2 __user *arg)
+{
+	struct tenstorrent_free_dma_buf_v2 args;
+
+	if (copy_from_user(&args, arg, sizeof(args)) != 0)
+		return -EFAULT;
+
+	if (args.argsz != sizeof(args) || args.flags != 0 || args.reserved != 0)
+		return -EINVAL;
+
+	// ALLOCATE_DMA_BUF indices aren't handles.
+	if (args.handle < TENSTORRENT_MAX_DMA_BUFS)
+		return -EINVAL;
+
+	return free_dmabuf_id(priv, args.handle);
+}
+
+long ioctl_export_dma_buf(struct chardev_private *priv, struct file *file,
+			  struct tenstorrent_export_dma_buf __user *arg)
+{
+	struct tenstorrent_export_dma_buf args;
+	bool pinned = false;
+	struct dma_buf *buf;
+
+	if (copy_from_user(&args, arg, sizeof(args)) != 0)
+		return -EFAULT;
+
+	if (args.argsz != sizeof(args) || (args.flags & ~TENSTORRENT_EXPORT_DMA_BUF_PINNED_PAGES))
+		return -EINVAL;
+
+	if (args.flags & TENSTORRENT_EXPORT_DMA_BUF_PINNED_PAGES) {
+		pinned = true;
+		if (args.handle != 0 || args.size == 0
+		    || !PAGE_ALIGNED(args.virtual_address) || !PAGE_ALIGNED(args.size))
+			return -EINVAL;
+	} else if (args.virtual_address != 0 || args.size != 0) {
+		return -EINVAL;
+	}
+
+	mutex_lock(&priv->mutex);
+
+	if (pinned) {
+		unsigned long nr_pages = args.size >> PAGE_SHIFT;
+		struct pinned_page_range *pinning;
+
+		pinning = find_pinning(&priv->pinnings, args.virtual_address, nr_pages);
+		// Importers may write, and TO_DEVICE pages need not be writable.
+		if (pinning && pinning->page_count == nr_pages && pinning->refs != 0
+		    && !(pinning->flags & TENSTORRENT_PIN_PAGES_TO_DEVICE))
+			buf = tenstorrent_export_pinning(priv, file, pinning);
+		else
+			buf = ERR_PTR(-EINVAL);
+	} else {
+		struct dmabuf *dmabuf = lookup_dmabuf(priv, args.handle);
+
+		if (dmabuf)
+			buf = tenstorrent_export_dmabuf(priv, file, dmabuf);
+		else
+			buf = ERR_PTR(-EINVAL);
+	}
+
+	mutex_unlock(&priv->mutex);
+
+	if (IS_ERR(buf))
+		return PTR_ERR(buf);
+
+	return tenstorrent_dma_buf_install_fd(buf, &arg->fd);
+}
+
+long ioctl_import_dma_buf(struct chardev_private *priv,
+			  struct tenstorrent_import_dma_buf __user *arg)
+{
+	struct tenstorrent_import_dma_buf args;
+	struct dma_buf_import *import;
+	long ret;
+
+	if (copy_from_user(&args, arg, sizeof(args)) != 0)
+		return -EFAULT;
+
+	if (args.argsz != sizeof(args) || (args.flags & ~TENSTORRENT_IMPORT_DMA_BUF_NOC_DMA))
+		return -EINVAL;
+
+	if (!priv->device->dma_capable)
+		return -EINVAL;
+
+	import = tenstorrent_dma_buf_import(&priv->device->pdev->dev, args.fd);
+	if (IS_ERR(import))
+		return PTR_ERR(import);
+
+	args.noc_address = 0;
+
+	if (args.flags & TENSTORRENT_IMPORT_DMA_BUF_NOC_DMA) {
+		bool top_down = false;
+
+		ret = setup_noc_dma(priv, top_down, import->size, import->dma_address, &args.noc_address);
+		if (ret < 0)
+			goto unimport;
+
+		import->outbound_iatu_region = ret;
+	}
+
+	mutex_lock(&priv->mutex);
+	ret = idr_alloc(&priv->imports, import, 1, 0, GFP_KERNEL);
+	mutex_unlock(&priv->mutex);
+
+	if (ret < 0)
+		goto unimport;
+
+	args.handle = ret;
+	args.size = import->size;
+	args.dma_address = import->dma_address;
+
+	if (copy_to_user(arg, &args, sizeof(args)) != 0) {
+		mutex_lock(&priv->mutex);
+		idr_remove(&priv->imports, args.handle);
+		mutex_unlock(&priv->mutex);
+
+		ret = -EFAULT;
+		goto unimport;
+	}
+
+	return 0;
+
+unimport:
+	teardown_outbound_iatu(priv, import->outbound_iatu_region);
+	tenstorrent_dma_buf_unimport(import);
+	return ret;
+}
+
+long ioctl_unimport_dma_buf(struct chardev_private *priv,
+			    struct tenstorrent_unimport_dma_buf __user *arg)
+{
+	struct tenstorrent_unimport_dma_buf args;
+	struct dma_buf_import *import;
+
+	if (copy_from_user(&args, arg, sizeof(args)) != 0)
+		return -EFAULT;
+
+	if (args.argsz != sizeof(args) || args.flags != 0 || args.reserved != 0)
+		return -EINVAL;
+
+	mutex_lock(&priv->mutex);
+
+	import = idr_find(&priv->imports, args.handle);
+	if (import)
+		idr_remove(&priv->imports, args.handle);
+
+	mutex_unlock(&priv->mutex);
+
+	if (!import)
+		return -EINVAL;
+
+	teardown_outbound_iatu(priv, import->outbound_iatu_region);
+	tenstorrent_dma_buf_unimport(import);
+	return 0;
+}
+
+bool is_iommu_translated(struct device *dev)
+{
+	struct iommu_domain *domain = iommu_get_domain_for_dev(dev);
 	return domain && domain->type != IOMMU_DOMAIN_IDENTITY;
 }
 
-static bool is_pin_pages_size_safe(u64 size)
+static bool is_pin_pages_size_safe(u64 size)
+{
+	// With IOMMU enabled on 5.4, 2GB pinnings may succeed, but then soft lockup on process exit.
+	// (tt_cdev_release -> unmap_sg -> __unmap_single -> iommu_unmap_page)
+	// This doesn't happen in 5.15, but I don't know exactly when it was fixed.
+#if LINUX_VERSION_CODE <= KERNEL_VERSION(5, 4, 0)
+	return size <= 1 << 30;
+#else
+	return true;
+#endif
+}
+
+static int grow_page_runs(struct pinned_page_range *pinning, unsigned long *capacity)
+{
+	unsigned long new_capacity = max(*capacity * 2, 16UL);
+	struct pinned_page_run *runs;
+
+	runs = kvmalloc_array(new_capacity, sizeof(*runs), GFP_KERNEL);
+	if (!runs)
+		return -ENOMEM;
+
+	if (pinning->runs) {
+		memcpy(runs, pinning->runs, pinning->run_count * sizeof(*runs));
+		kvfree(pinning->runs);
+	}
+
+	pinning->runs = runs;
+	*capacity = new_capacity;
+	return 0;
+}
+
+// grow_page_runs leaves up to half the array unused. Once a pin is complete,
+// give back the slack: the runs live as long as the pinning.
+static void trim_page_runs(struct pinned_page_range *pinning, unsigned long capacity)
+{
+	struct pinned_page_run *runs;
+
+	if (pinning->run_count == capacity)
+		return;
+
+	runs = kvmalloc_array(pinning->run_count, sizeof(*runs), GFP_KERNEL);
+	if (!runs)
+		return;		// keep the slack
+
+	memcpy(runs, pinning->runs, pinning->run_count * sizeof(*runs));
+	kvfree(pinning->runs);
+	pinning->runs = runs;
+}
+
+// How many of pages[0, n) are consecutive pages of the first one's folio. A
+// hugetlb folio is always mapped whole and in order, so the rest of it is
+// taken on trust. A THP may be mapped a page at a time, and after an mremap of
+// part of it not in order, so its pages are compared against the folio's.
+static unsigned long folio_span(struct page **pages, unsigned long n)
+{
+	struct page *page = pages[0];
+	unsigned long span, i;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 1, 0)
+	struct folio *folio = page_folio(page);
+
+	if (!folio_test_large(folio))
+		return 1;
+
+	span = min_t(unsigned long, folio_nr_pages(folio) - (page_to_pfn(page) - folio_pfn(folio)), n);
+	if (folio_test_hugetlb(folio))
+		return span;
+#else
+	struct page *head = compound_head(page);
+
+	if (!PageCompound(page))
+		return 1;
+
+	span = min((1UL << compound_order(head)) - (page_to_pfn(page) - page_to_pfn(head)), n);
+	if (PageHuge(head))
+		return span;
+#endif
+
+	for (i = 1; i < span; i++)
+		if (pages[i] != nth_page(page, i))
+			return i;
+
+	return span;
+}
+
+// Append a batch of freshly-pinned pages to pinning->runs, a folio (or the
+// part of one in the batch) at a time, extending the last run while the pages
+// are physically contiguous. On failure, the pages in the batch that weren't
+// recorded are unpinned.
+static int record_pinned_pages(struct pinned_page_range *pinning, unsigned long *capacity,
+			       struct page **pages, unsigned long n)
+{
+	unsigned long i = 0;
+
+	while (i < n) {
+		struct page *page = pages[i];
+		struct pinned_page_run *run = NULL;
+		unsigned long span = folio_span(pages + i, n - i);
+
+		if (pinning->run_count > 0)
+			run = &pinning->runs[pinning->run_count - 1];
+
+		if (run && page_to_pfn(run->page) + run->npages == page_to_pfn(page)) {
+			run->npages += span;
+		} else {
+			if (pinning->run_count == *capacity && grow_page_runs(pinning, capacity)) {
+				unpin_user_pages_dirty_lock(pages + i, n - i, false);
+				return -ENOMEM;
+			}
+
+			run = &pinning->runs[pinning->run_count++];
+			run->page = page;
+			run->npages = span;
+		}
+
+		pinning->page_count += span;
+		i += span;
+	}
+
+	return 0;
+}
+
+// One page of page pointers. The pages are only needed until they've been
+// folded into runs, so there's no need for an array covering the whole range.
+#define PIN_PAGES_BATCH (PAGE_SIZE / sizeof(struct page *))
+
+// Pin nr_pages starting at start into pinning->runs, carrying on from any
+// pages already there. Between batches, yield and check for signals: a fatal
+// signal aborts, and if resumable, any signal stops with -ERESTARTSYS and
+// leaves the pages pinned so far. On any other failure, nothing is left pinned.
+static int pin_page_runs(struct pinned_page_range *pinning, u64 start, unsigned long nr_pages, bool resumable)
+{
+	struct page **batch;
+	unsigned long capacity = pinning->run_count;	// grow_page_runs reallocates on the next new run
+	unsigned int gup_flags = pinning_dma_dir(pinning) == DMA_TO_DEVICE ? 0 : FOLL_WRITE;
+	int ret = 0;
+
+	batch = (struct page **)__get_free_page(GFP_KERNEL);
+	if (!batch)
+		return -ENOMEM;
+
+	while (pinning->page_count < nr_pages) {
+		unsigned long n = min_t(unsigned long, nr_pages - pinning->page_count, PIN_PAGES_BATCH);
+		u64 va = start + ((u64)pinning->page_count << PAGE_SHIFT);
+		int pinned;
+
+		pinned = pin_user_pages_fast_longterm(va, n, gup_flags, batch);
+		if (pinned == -EOPNOTSUPP) {
+			// Filesystem DAX: truncate can't wait for a long-term pin.
+			pr_warn("pin_user_pages_longterm: filesystem DAX pages can't be pinned\n");
+			ret = pinned;
+			break;
+		} else if (pinned <= 0) {
+			pr_warn("pin_user_pages_longterm failed: %d\n", pinned);
+			ret = pinned ? pinned : -EFAULT;
+			break;
+		}
+
+		ret = record_pinned_pages(pinning, &capacity, batch, pinned);
+		if (ret)
+			break;
+
+		if (pinning->page_count == nr_pages)
+			break;
+
+		cond_resched();
+
+		if (fatal_signal_pending(current)) {
+			ret = -EINTR;
+			break;
+		}
+
+		if (resumable && signal_pending(current)) {
+			free_page((unsigned long)batch);
+			return -ERESTARTSYS;
+		}
+	}
+
+	free_page((unsigned long)batch);
+
+	if (ret)
+		unpin_page_runs(pinning, false);
+	else
+		trim_page_runs(pinning, capacity);
+
+	return ret;
+}
+
+// Can a cached pinning be handed out again for a PIN_PAGES with these flags?
+static bool pin_cache_hit(struct pinned_page_range *pinning, u32 flags)
+{
+	const u32 match_flags = TENSTORRENT_PIN_PAGES_NOC_DMA | TENSTORRENT_PIN_PAGES_NOC_TOP_DOWN |
+				TENSTORRENT_PIN_PAGES_TO_DEVICE | TENSTORRENT_PIN_PAGES_FROM_DEVICE;
+
+	return (flags & TENSTORRENT_PIN_PAGES_CACHED)
+		&& ((pinning->flags ^ flags) & match_flags) == 0
+		&& pin_cache_valid(pinning);
+}
+
+void tenstorrent_pin_cache_evict(struct work_struct *work)
+{
+	struct chardev_private *priv = container_of(work, struct chardev_private, pin_cache_work);
+	struct pinned_page_range *pinning, *tmp_pinning;
+
+	mutex_lock(&priv->mutex);
+
+	for_each_pinning_safe(pinning, tmp_pinning, &priv->pinnings) {
+		if (pinning->refs == 0 && !pin_cache_valid(pinning))
+			unpin_pinned_page_range(priv, pinning);
+	}
+
+	mutex_unlock(&priv->mutex);
+}
+
+static int check_pin_pages_in(const struct tenstorrent_pin_pages_in *in)
+{
+	const u32 valid_flags = TENSTORRENT_PIN_PAGES_CONTIGUOUS | TENSTORRENT_PIN_PAGES_NOC_DMA |
+				TENSTORRENT_PIN_PAGES_NOC_TOP_DOWN | TENSTORRENT_PIN_PAGES_CACHED |
+				TENSTORRENT_PIN_PAGES_RESUMABLE | TENSTORRENT_PIN_PAGES_TO_DEVICE |
+				TENSTORRENT_PIN_PAGES_FROM_DEVICE;
+	const u32 dir_flags = TENSTORRENT_PIN_PAGES_TO_DEVICE | TENSTORRENT_PIN_PAGES_FROM_DEVICE;
+
+	if (in->flags & ~valid_flags)
+		return -EINVAL;
+
+	if ((in->flags & dir_flags) == dir_flags)
+		return -EINVAL;
+
+	if (!PAGE_ALIGNED(in->virtual_address) || !PAGE_ALIGNED(in->size) || in->size == 0)
+		return -EINVAL;
+
+	if (!is_pin_pages_size_safe(in->size))
+		return -EINVAL;
+
+	return 0;
+}
+
+static bool wants_noc_dma(u32 flags)
+{
+	return flags & (TENSTORRENT_PIN_PAGES_NOC_DMA | TENSTORRENT_PIN_PAGES_NOC_TOP_DOWN);
+}
+
+// Block duplicate (VA/size) pinnings. Prevents ambiguity in UNPIN_PAGES
+// regarding iATU teardown if the same range were pinned multiple times with
+// different NOC_DMA flags. The exception is a cached pinning: reuse it if
+// it still matches, release it if it's idle and doesn't.
+// Returns the reused pinning with its refs incremented, NULL if the caller
+// should pin, or ERR_PTR(-EEXIST). Caller holds priv->mutex.
+static struct pinned_page_range *reuse_pinning(struct chardev_private *priv,
+					       const struct tenstorrent_pin_pages_in *in,
+					       unsigned long nr_pages)
+{
+	struct pinned_page_range *pinning;
+
+	pinning = find_pinning(&priv->pinnings, in->virtual_address, nr_pages);
+	if (!pinning || pinning->page_count != nr_pages)
+		return NULL;
+
+	if (pin_cache_hit(pinning, in->flags)) {
+		pinning->refs++;
+		return pinning;
+	}
+
+	if (pinning->refs != 0)
+		return ERR_PTR(-EEXIST);
+
+	unpin_pinned_page_range(priv, pinning);
+	return NULL;
+}
+
+// DMA-map the pinned pages for dev, setting dma_address and either iova or,
+// where the DMA API has no bare IOVA ranges, dma_mapping.
+static int map_pinning(struct device *dev, struct pinned_page_range *pinning)
+{
+	struct sg_table dma_mapping = {0};
+	u64 dma_address;
+	int ret;
+
+	if (is_iommu_translated(dev)) {
+		struct scatterlist *sg;
+		unsigned int i;
+		dma_addr_t expected_next_address;
+		unsigned long total_dma_len = 0;
+
+		ret = link_pinning_iova(dev, pinning);
+		if (ret != -EOPNOTSUPP)
+			return ret;
+
+		if (!alloc_chained_sgt_for_runs(&dma_mapping, pinning->runs, pinning->run_count)) {
+			pr_warn("alloc_chained_sgt_for_runs failed for %lu runs, probably out of memory.\n", pinning->run_count);
+			return -ENOMEM;
+		}
+
+		ret = dma_map_sgtable(dev, &dma_mapping, pinning_dma_dir(pinning), 0);
+
+		if (ret != 0) {
+			pr_err("dma_map_sg failed.\n");
+			goto err_free_sgt;
+		}
+
+		// This can only happen due to a misconfiguration or a bug.
+		for_each_sgtable_dma_sg((&dma_mapping), sg, i) {
+			if (i > 0 && sg_dma_address(sg) != expected_next_address) {
+				pr_err("discontiguous mapping\n");
+				ret = -EINVAL;
+			}
+
+			expected_next_address = sg_dma_address(sg) + sg_dma_len(sg);
+			total_dma_len += sg_dma_len(sg);
+		}
+
+		if (total_dma_len != pinning->page_count * PAGE_SIZE) {
+			pr_err("dma-mapped (%lX) != original length (%lX).\n", total_dma_len, pinning->page_count * PAGE_SIZE);
+			ret = -EINVAL;
+		}
+
+		if (ret != 0) {
+			debug_print_sgtable(&dma_mapping);
+			goto err_dma_unmap;
+		}
+
+		dma_address = sg_dma_address(dma_mapping.sgl);
+	} else {
+		if (pinning->run_count != 1) {
+			pr_err("pages discontiguous, %lu runs\n", pinning->run_count);
+			return -EINVAL;
+		}
+
+		dma_address = page_to_phys(pinning->runs[0].page);
+	}
+
+	pinning->dma_address = dma_address;
+	pinning->dma_mapping = dma_mapping;
+	return 0;
+
+err_dma_unmap:
+	dma_unmap_sgtable(dev, &dma_mapping, pinning_dma_dir(pinning), 0);
+err_free_sgt:
+	free_chained_sgt(&dma_mapping);
+	return ret;
+}
+
+// A pinning that may go in the fd's arena isn't DMA-mapped by create_pinning:
+// __setup_pinning_noc_dma links it into the arena, so its pages have only one
+// IOVA. TOP_DOWN asks for a NOC address at the top of the window, which the
+// arena can't promise.
+static bool pinning_for_arena(struct chardev_private *priv, u32 flags)
+{
+	return wants_noc_dma(flags) && !(flags & TENSTORRENT_PIN_PAGES_NOC_TOP_DOWN)
+	       && noc_dma_arena_enabled(priv);
+}
+
+// Caller holds iatu_mutex.
+static int __link_pinning_noc_dma_arena(struct chardev_private *priv, struct pinned_page_range *pinning)
+{
+	struct sg_table pages;
+	int ret;
+
+	if (!alloc_chained_sgt_for_runs(&pages, pinning->runs, pinning->run_count))
+		return -ENOMEM;
+
+	ret = __link_noc_dma_arena(priv, &pages, (u64)pinning->page_count << PAGE_SHIFT, pinning_dma_dir(pinning),
+				   &pinning->dma_address, &pinning->noc_address);
+	free_chained_sgt(&pages);
+
+	if (ret == 0)
+		pinning->arena_noc_address = pinning->noc_address;
+
+	return ret;
+}
+
+// Make the pinning NOC-visible through the fd's arena, or failing that, through
+// an iATU region of its own. A pinning meant for the arena that doesn't fit is
+// DMA-mapped here. Caller holds iatu_mutex.
+static int __setup_pinning_noc_dma(struct chardev_private *priv, struct pinned_page_range *pinning)
+{
+	bool top_down = pinning->flags & TENSTORRENT_PIN_PAGES_NOC_TOP_DOWN;
+	u64 size = (u64)pinning->page_count << PAGE_SHIFT;
+	int region;
+	int ret;
+
+	if (pinning_for_arena(priv, pinning->flags)) {
+		if (__link_pinning_noc_dma_arena(priv, pinning) == 0)
+			return 0;
+
+		ret = map_pinning(&priv->device->pdev->dev, pinning);
+		if (ret)
+			return ret;
+	}
+
+	region = __setup_noc_dma(priv, top_down, size, pinning->dma_address, &pinning->noc_address);
+	if (region < 0)
+		return region;
+
+	pinning->outbound_iatu_region = region;
+	return 0;
+}
+
+static int setup_pinning_noc_dma(struct chardev_private *priv, struct pinned_page_range *pinning)
+{
+	struct tenstorrent_device *tt_dev = priv->device;
+	int ret;
+
+	mutex_lock(&tt_dev->iatu_mutex);
+	ret = __setup_pinning_noc_dma(priv, pinning);
+	mutex_unlock(&tt_dev->iatu_mutex);
+
+	return ret;
+}
+
+// Pin and DMA-map a range (unless it's for the arena, see pinning_for_arena),
+// but don't give it an iATU region or put it in a tree. *new_pinning is NULL
+// or an interrupted TENSTORRENT_PIN_PAGES_RESUMABLE pin of the same range to
+// carry on with. If the pin is interrupted again, returns -ERESTARTSYS with
+// the partial pinning in *new_pinning.
+static int create_pinning(struct chardev_private *priv,
+			  const struct tenstorrent_pin_pages_in *in,
+			  unsigned long nr_pages,
+			  struct pinned_page_range **new_pinning)
+{
+	struct pinned_page_range *pinning = *new_pinning;
+	int ret;
+
+	if (!pinning) {
+		pinning = kzalloc(sizeof(*pinning), GFP_KERNEL);
+		if (!pinning)
+			return -ENOMEM;
+
+		pinning->priv = priv;
+		pinning->flags = in->flags;
+		pinning->virtual_address = in->virtual_address;
+
+		if (in->flags & TENSTORRENT_PIN_PAGES_CACHED) {
+			ret = pin_cache_watch(pinning, in->virtual_address, in->size);
+			if (ret)
+				goto err_free_pinning;
+		}
+	}
+
+	ret = pin_page_runs(pinning, in->virtual_address, nr_pages,
+			    in->flags & TENSTORRENT_PIN_PAGES_RESUMABLE);
+	if (ret == -ERESTARTSYS) {
+		*new_pinning = pinning;
+		return ret;
+	}
+	if (ret)
+		goto err_unwatch;
+
+	if (!pinning_for_arena(priv, pinning->flags)) {
+		ret = map_pinning(&priv->device->pdev->dev, pinning);
+		if (ret)
+			goto err_unpin_pages;
+	}
+
+	pinning->refs = 1;
+	pinning->outbound_iatu_region = -1;
+
+	*new_pinning = pinning;
+	return 0;
+
+err_unpin_pages:
+	unpin_page_runs(pinning, false);
+err_unwatch:
+	pin_cache_unwatch(pinning);
+err_free_pinning:
+	kfree(pinning);
+	return ret;
+}
+
+// Take the fd's interrupted TENSTORRENT_PIN_PAGES_RESUMABLE pin if it's for
+// this range. Caller holds priv->mutex.
+static struct pinned_page_range *take_partial_pin(struct chardev_private *priv,
+						  const struct tenstorrent_pin_pages_in *in)
+{
+	struct pinned_page_range *pinning = priv->partial_pin;
+
+	if (!(in->flags & TENSTORRENT_PIN_PAGES_RESUMABLE) || !pinning)
+		return NULL;
+
+	if (pinning->virtual_address != in->virtual_address || pinning->flags != in->flags
+	    || priv->partial_pin_size != in->size)
+		return NULL;
+
+	priv->partial_pin = NULL;
+	return pinning;
+}
+
+// Keep an interrupted pin for the restarted call, dropping any older one.
+static void stash_partial_pin(struct chardev_private *priv, struct pinned_page_range *pinning, u64 size)
+{
+	mutex_lock(&priv->mutex);
+
+	if (priv->partial_pin)
+		release_pinning(priv, priv->partial_pin, false);
+	priv->partial_pin = pinning;
+	priv->partial_pin_size = size;
+
+	mutex_unlock(&priv->mutex);
+}
+
+long ioctl_pin_pages(struct chardev_private *priv,
+		     struct tenstorrent_pin_pages __user *arg)
+{
+	unsigned long nr_pages;
+	struct pinned_page_range *pinning;
+	struct pinned_page_range *existing;
+	long ret;
+	u32 bytes_to_copy;
+
+	struct tenstorrent_pin_pages_in in;
+	struct tenstorrent_pin_pages_out_extended out;
+	memset(&in, 0, sizeof(in));
+	memset(&out, 0, sizeof(out));
+
+	if (copy_from_user(&in, &arg->in, sizeof(in)) != 0)
+		return -EFAULT;
+
+	ret = check_pin_pages_in(&in);
+	if (ret)
+		return ret;
+
+	nr_pages = PAGE_ALIGN(in.size) >> PAGE_SHIFT;
+
+	mutex_lock(&priv->mutex);
+
+	pinning = reuse_pinning(priv, &in, nr_pages);
+	if (IS_ERR(pinning)) {
+		mutex_unlock(&priv->mutex);
+		return PTR_ERR(pinning);
+	}
+
+	if (pinning) {
+		out.physical_address = pinning->dma_address;
+		out.noc_address = pinning->noc_address;
+		mutex_unlock(&priv->mutex);
+		goto copy_out;
+	}
+
+	pinning = take_partial_pin(priv, &in);
+
+	mutex_unlock(&priv->mutex);
+
+	// Pinning and mapping a big range takes a while, don't block the fd's
+	// other users meanwhile.
+	ret = create_pinning(priv, &in, nr_pages, &pinning);
+	if (ret == -ERESTARTSYS) {
+		out.bytes_pinned = (u64)pinning->page_count << PAGE_SHIFT;
+		stash_partial_pin(priv, pinning, in.size);
+		goto copy_out;
+	}
+	if (ret)
+		return ret;
+
+	if (wants_noc_dma(in.flags)) {
+		ret = setup_pinning_noc_dma(priv, pinning);
+		if (ret) {
+			release_pinning(priv, pinning, false);
+			return ret;
+		}
+	}
+
+	mutex_lock(&priv->mutex);
+
+	// Another thread may have pinned the same range in the meantime, in which
+	// case its pinning wins.
+	existing = reuse_pinning(priv, &in, nr_pages);
+	if (!existing) {
+		pinning_tree_insert(pinning, &priv->pinnings);
+		existing = pinning;
+		pinning = NULL;
+	}
+
+	if (!IS_ERR(existing)) {
+		out.physical_address = existing->dma_address;
+		out.noc_address = existing->noc_address;
+	}
+
+	mutex_unlock(&priv->mutex);
+
+	if (pinning) {
+		teardown_outbound_iatu(priv, pinning->outbound_iatu_region);
+		release_pinning(priv, pinning, false);
+	}
+
+	if (IS_ERR(existing))
+		return PTR_ERR(existing);
+
+copy_out:
+	if (ret != -ERESTARTSYS) {
+		out.bytes_pinned = in.size;
+		ret = 0;
+	}
+
+	if (clear_user(&arg->out, in.output_size_bytes) != 0)
+		return -EFAULT;
+
+	bytes_to_copy = min(in.output_size_bytes, (u32)sizeof(out));
+
+	if (copy_to_user(&arg->out, &out, bytes_to_copy) != 0)
+		return -EFAULT;
+
+	return ret;
+}
+
+long ioctl_pin_pages_batch(struct chardev_private *priv,
+			   struct tenstorrent_pin_pages_batch __user *arg)
 {
-	// With IOMMU enabled on 5.4, 2GB pinnings may succeed, but then soft lockup on process exit.
-	// (tt_cdev_release -> unmap_sg -> __unmap_single -> iommu_unmap_page)
-	// This doesn't happen in 5.15, but I don't know exactly when it was fixed.
-#if LINUX_VERSION_CODE <= KERNEL_VERSION(5, 4, 0)
-	return size <= 1 << 30;
-#else
-	return true;
-#endif
+	struct tenstorrent_device *tt_dev = priv->device;
+	struct tenstorrent_pin_pages_batch batch = {0};
+	struct tenstorrent_pin_pages_batch_entry *entries;
+	struct pinned_page_range **pinnings;
+	struct pinned_page_range *pinning;
+	// Pinnings made by this batch stay here until they have their iATU
+	// regions, so that a later entry can't reuse a half-built one.
+	struct rb_root_cached new_pinnings = RB_ROOT_CACHED;
+	bool invalid = false;
+	long ret = 0;
+	u32 i;
+
+	if (copy_from_user(&batch, arg, sizeof(batch)) != 0)
+		return -EFAULT;
+
+	if (batch.argsz != sizeof(batch) || batch.flags != 0 || batch.reserved != 0)
+		return -EINVAL;
+
+	if (batch.count == 0 || batch.count > TENSTORRENT_PAGES_BATCH_MAX)
+		return -EINVAL;
+
+	entries = kvmalloc_array(batch.count, sizeof(*entries), GFP_KERNEL);
+	pinnings = kvmalloc_array(batch.count, sizeof(*pinnings), GFP_KERNEL | __GFP_ZERO);
+	if (!entries || !pinnings) {
+		ret = -ENOMEM;
+		goto out_free;
+	}
+
+	if (copy_from_user(entries, u64_to_user_ptr(batch.entries), batch.count * sizeof(*entries)) != 0) {
+		ret = -EFAULT;
+		goto out_free;
+	}
+
+	// Validate everything before pinning anything. Resumable pins are one at a time.
+	for (i = 0; i < batch.count; i++) {
+		memset(&entries[i].out, 0, sizeof(entries[i].out));
+		entries[i].reserved = 0;
+		entries[i].status = check_pin_pages_in(&entries[i].in);
+		if (entries[i].in.flags & TENSTORRENT_PIN_PAGES_RESUMABLE)
+			entries[i].status = -EINVAL;
+		if (entries[i].status)
+			invalid = true;
+	}
+
+	if (invalid) {
+		ret = -EINVAL;
+		goto out_copy;
+	}
+
+	mutex_lock(&priv->mutex);
+
+	for (i = 0; i < batch.count; i++) {
+		const struct tenstorrent_pin_pages_in *in = &entries[i].in;
+		unsigned long nr_pages = in->size >> PAGE_SHIFT;
+
+		pinning = find_pinning(&new_pinnings, in->virtual_address, nr_pages);
+		if (pinning && pinning->page_count == nr_pages) {
+			entries[i].status = -EEXIST;
+			continue;
+		}
+
+		pinning = reuse_pinning(priv, in, nr_pages);
+		if (IS_ERR(pinning)) {
+			entries[i].status = PTR_ERR(pinning);
+			continue;
+		}
+
+		if (!pinning) {
+			entries[i].status = create_pinning(priv, in, nr_pages, &pinning);
+			if (entries[i].status)
+				continue;
+
+			pinning_tree_insert(pinning, &new_pinnings);
+		}
+
+		pinnings[i] = pinning;
+	}
+
+	// Program all the new iATU regions in one pass. A reused pinning already
+	// has its NOC mapping.
+	mutex_lock(&tt_dev->iatu_mutex);
+
+	for (i = 0; i < batch.count; i++) {
+		pinning = pinnings[i];
+		if (!pinning || !wants_noc_dma(pinning->flags)
+		    || pinning->outbound_iatu_region >= 0 || pinning->arena_noc_address)
+			continue;
+
+		entries[i].status = __setup_pinning_noc_dma(priv, pinning);
+		if (entries[i].status) {
+			pinning_tree_remove(pinning, &new_pinnings);
+			release_pinning(priv, pinning, false);
+			pinnings[i] = NULL;
+		}
+	}
+
+	mutex_unlock(&tt_dev->iatu_mutex);
+
+	for (i = 0; i < batch.count; i++) {
+		pinning = pinnings[i];
+		if (!pinning)
+			continue;
+
+		entries[i].out.physical_address = pinning->dma_address;
+		entries[i].out.noc_address = pinning->noc_address;
+		entries[i].out.bytes_pinned = entries[i].in.size;
+	}
+
+	while ((pinning = pinning_tree_iter_first(&new_pinnings, 0, U64_MAX))) {
+		pinning_tree_remove(pinning, &new_pinnings);
+		pinning_tree_insert(pinning, &priv->pinnings);
+	}
+
+	mutex_unlock(&priv->mutex);
+
+out_copy:
+	if (copy_to_user(u64_to_user_ptr(batch.entries), entries, batch.count * sizeof(*entries)) != 0)
+		ret = -EFAULT;
+
+out_free:
+	kvfree(pinnings);
+	kvfree(entries);
+	return ret;
 }
 
-long ioctl_pin_pages(struct chardev_private *priv,
-		     struct tenstorrent_pin_pages __user *arg)
+// Number of runs that pages [index, page_count) of the pinning occupy.
+static unsigned long count_runs_from(const struct pinned_page_range *pinning, unsigned long index)
 {
-	const u32 valid_flags = TENSTORRENT_PIN_PAGES_CONTIGUOUS | TENSTORRENT_PIN_PAGES_NOC_DMA |
-				TENSTORRENT_PIN_PAGES_NOC_TOP_DOWN;
-	unsigned long nr_pages;
-	struct page **pages;
-	int pages_pinned;
+	unsigned long first = 0;
+	unsigned long i;
+
+	for (i = 0; i < pinning->run_count; i++) {
+		if (index < first + pinning->runs[i].npages)
+			return pinning->run_count - i;
+		first += pinning->runs[i].npages;
+	}
+
+	return 0;
+}
+
+// Move pages [index, page_count) of the pinning into rest, whose runs array
+// must have room for count_runs_from(pinning, index) runs.
+static void split_runs_at(struct pinned_page_range *pinning, unsigned long index,
+			  struct pinned_page_range *rest)
+{
+	unsigned long first = 0;
+	unsigned long i;
+
+	for (i = 0; i < pinning->run_count; i++) {
+		if (index < first + pinning->runs[i].npages)
+			break;
+		first += pinning->runs[i].npages;
+	}
+
+	rest->run_count = pinning->run_count - i;
+	rest->page_count = pinning->page_count - index;
+	memcpy(rest->runs, &pinning->runs[i], rest->run_count * sizeof(*rest->runs));
+
+	if (rest->run_count > 0 && index > first) {
+		// The split falls inside run i.
+		unsigned long offset = index - first;
+
+		rest->runs[0].page = nth_page(pinning->runs[i].page, offset);
+		rest->runs[0].npages -= offset;
+		pinning->runs[i].npages = offset;
+		i++;
+	}
+
+	pinning->run_count = i;
+	pinning->page_count = index;
+}
+
+// Caller holds iatu_mutex.
+static void move_outbound_iatu(struct chardev_private *priv, int iatu_region, u64 base, u64 limit, u64 target)
+{
+	struct tenstorrent_device *tt_dev = priv->device;
+	struct tenstorrent_outbound_iatu_region *region = &tt_dev->outbound_iatus[iatu_region];
+
+	if (tt_dev->dev_class->configure_outbound_atu(tt_dev, iatu_region, base, limit, target))
+		pr_warn("Failed to reconfigure outbound iATU region %d.\n", iatu_region);
+
+	rb_erase(&region->node, &tt_dev->outbound_iatu_tree);
+	region->base = base;
+	region->limit = limit;
+	region->target = target;
+	noc_range_insert(tt_dev, region);
+}
+
+// Unpin part of a pinning, leaving a head, a tail, or both pinned. Their DMA
+// and NOC addresses don't move: the iATU region shrinks to the head and the
+// tail gets a region of its own, or both keep their places in the arena.
+// Caller holds priv->mutex.
+static int unpin_subrange(struct chardev_private *priv, u64 va, unsigned long nr_pages)
+{
+	struct tenstorrent_device *tt_dev = priv->device;
+	u64 last = va + ((u64)nr_pages << PAGE_SHIFT) - 1;
+	struct pinned_page_range *pinning = NULL;
+	struct pinned_page_range *candidate;
+	struct pinned_page_range *tail = NULL;
+	struct pinned_page_range middle = {0};
+	unsigned long head_pages, tail_index;
+	u64 head_size, middle_size, tail_offset;
+	int region = -1;
+	int ret;
+
+	if (!PAGE_ALIGNED(va) || last < va)
+		return -EINVAL;
+
+	// Exactly one pinning must contain the whole range.
+	for (candidate = pinning_tree_iter_first(&priv->pinnings, va, last); candidate;
+	     candidate = pinning_tree_iter_next(candidate, va, last)) {
+		if (candidate->refs == 0 || pinning_start(candidate) > va || pinning_last(candidate) < last)
+			continue;
+		if (pinning)
+			return -EINVAL;
+		pinning = candidate;
+	}
+
+	if (!pinning)
+		return -EINVAL;
+
+	// Other devices may be using a shared or exported pinning's runs.
+	if (pinning->refs > 1 || pinning->shared || pinning->export_refs != 0)
+		return -EBUSY;
+
+	// The DMA API can only unmap a scatterlist mapping as a whole, and the
+	// cache notifier covers the whole range.
+	if (pinning->dma_mapping.sgl || (pinning->flags & TENSTORRENT_PIN_PAGES_CACHED))
+		return -EOPNOTSUPP;
+
+	head_pages = (va - pinning->virtual_address) >> PAGE_SHIFT;
+	tail_index = head_pages + nr_pages;
+	head_size = (u64)head_pages << PAGE_SHIFT;
+	middle_size = (u64)nr_pages << PAGE_SHIFT;
+	tail_offset = (u64)tail_index << PAGE_SHIFT;
+
+	middle.runs = kvmalloc_array(count_runs_from(pinning, head_pages), sizeof(*middle.runs), GFP_KERNEL);
+	if (!middle.runs)
+		return -ENOMEM;
+
+	if (head_pages > 0 && tail_index < pinning->page_count) {
+		tail = kzalloc(sizeof(*tail), GFP_KERNEL);
+		if (!tail) {
+			ret = -ENOMEM;
+			goto err_free;
+		}
+
+		tail->runs = kvmalloc_array(count_runs_from(pinning, tail_index), sizeof(*tail->runs), GFP_KERNEL);
+		if (!tail->runs) {
+			ret = -ENOMEM;
+			goto err_free;
+		}
+	}
+
+	// Retarget the iATU before anything is unpinned so the device can't reach
+	// the released pages through it.
+	if (pinning->outbound_iatu_region >= 0) {
+		struct tenstorrent_outbound_iatu_region *iatu;
+
+		mutex_lock(&tt_dev->iatu_mutex);
+		iatu = &tt_dev->outbound_iatus[pinning->outbound_iatu_region];
+
+		if (tail) {
+			// The new tail region briefly overlaps the old one, with the same translation.
+			region = configure_outbound_iatu(priv, iatu->base + tail_offset, iatu->limit,
+							 iatu->target + tail_offset, iatu->top_down);
+			if (region < 0) {
+				mutex_unlock(&tt_dev->iatu_mutex);
+				ret = region;
+				goto err_free;
+			}
+		}
+
+		if (head_pages == 0)
+			move_outbound_iatu(priv, pinning->outbound_iatu_region, iatu->base + tail_offset,
+					   iatu->limit, iatu->target + tail_offset);
+		else
+			move_outbound_iatu(priv, pinning->outbound_iatu_region, iatu->base,
+					   iatu->base + head_size - 1, iatu->target);
+
+		mutex_unlock(&tt_dev->iatu_mutex);
+	}
+
+	// Likewise unmap the middle. The head and tail keep their IOVAs, in the
+	// arena or in a range they share.
+	if (pinning->arena_noc_address)
+		unlink_noc_dma_arena(priv, pinning->arena_noc_address + head_size, middle_size,
+				     pinning_dma_dir(pinning));
+	else if (pinning->iova)
+		unlink_pinning_iova(&tt_dev->pdev->dev, pinning, head_size, middle_size);
+
+	pinning_tree_remove(pinning, &priv->pinnings);
+
+	if (head_pages == 0) {
+		// Keep the pages after the range and move the pinning up to them.
+		split_runs_at(pinning, nr_pages, &middle);
+		swap(pinning->runs, middle.runs);
+		swap(pinning->run_count, middle.run_count);
+		swap(pinning->page_count, middle.page_count);
+
+		pinning->virtual_address += tail_offset;
+		pinning->dma_address += tail_offset;
+		if (pinning->outbound_iatu_region >= 0 || pinning->arena_noc_address)
+			pinning->noc_address += tail_offset;
+		if (pinning->arena_noc_address)
+			pinning->arena_noc_address += tail_offset;
+	} else {
+		if (tail) {
+			split_runs_at(pinning, tail_index, tail);
+
+			tail->priv = priv;
+			tail->flags = pinning->flags;
+			tail->refs = 1;
+			tail->dma_address = pinning->dma_address + tail_offset;
+			tail->iova = get_pinning_iova(pinning->iova);
+			if (pinning->arena_noc_address) {
+				tail->arena_noc_address = pinning->arena_noc_address + tail_offset;
+				tail->noc_address = pinning->noc_address + tail_offset;
+			} else {
+				tail->noc_address = region >= 0 ? pinning->noc_address + tail_offset : 0;
+			}
+			tail->virtual_address = pinning->virtual_address + tail_offset;
+			tail->outbound_iatu_region = region;
+			pinning_tree_insert(tail, &priv->pinnings);
+		}
+
+		split_runs_at(pinning, head_pages, &middle);
+	}
+
+	middle.flags = pinning->flags;
+	unpin_page_runs(&middle, true);
+	pinning_tree_insert(pinning, &priv->pinnings);
+
+	return 0;
+
+err_free:
+	if (tail)
+		kvfree(tail->runs);
+	kfree(tail);
+	kvfree(middle.runs);
+	return ret;
+}
+
+// Decrement a pinning's refs, or unpin part of one. Returns the pinning,
+// removed from the tree, if the caller should release it, NULL if not, or an
+// ERR_PTR. Caller holds priv->mutex.
+static struct pinned_page_range *unref_pinning(struct chardev_private *priv,
+					       const struct tenstorrent_unpin_pages_in *in)
+{
+	unsigned long nr_pages = in->size >> PAGE_SHIFT;
 	struct pinned_page_range *pinning;
-	struct sg_table dma_mapping = {0};
-	long ret;
-	u32 bytes_to_copy;
-	u64 noc_address = 0;
-	int iatu_region = -1;
-	bool noc_dma = false;
-	bool top_down = false;
 
-	struct tenstorrent_pin_pages_in in;
-	struct tenstorrent_pin_pages_out_extended out;
-	memset(&in, 0, sizeof(in));
-	memset(&out, 0, sizeof(out));
+	if (in->reserved != 0 || in->size == 0 || nr_pages == 0)
+		return ERR_PTR(-EINVAL);
+
+	pinning = find_pinning(&priv->pinnings, in->virtual_address, nr_pages);
+	if (!pinning || pinning->page_count != nr_pages) {
+		int ret = -EINVAL;
+
+		if (PAGE_ALIGNED(in->size))
+			ret = unpin_subrange(priv, in->virtual_address, nr_pages);
+
+		return ret ? ERR_PTR(ret) : NULL;
+	}
+
+	if (pinning->refs == 0)
+		return ERR_PTR(-EINVAL);
+
+	// Exported pages stay pinned until the dma-buf is released.
+	if (pinning->refs == 1 && pinning->export_refs != 0)
+		return ERR_PTR(-EBUSY);
+
+	// A valid cached pinning stays around for the next PIN_PAGES.
+	if (--pinning->refs != 0 || pin_cache_valid(pinning))
+		return NULL;
+
+	pinning_tree_remove(pinning, &priv->pinnings);
+	return pinning;
+}
+
+long ioctl_unpin_pages(struct chardev_private *priv,
+		       struct tenstorrent_unpin_pages __user *arg)
+{
+	struct tenstorrent_unpin_pages_in in = {0};
+	struct pinned_page_range *pinning;
 
 	if (copy_from_user(&in, &arg->in, sizeof(in)) != 0)
 		return -EFAULT;
 
-	if (in.flags & ~valid_flags)
-		return -EINVAL;
+	mutex_lock(&priv->mutex);
+
+	pinning = unref_pinning(priv, &in);
+	if (!IS_ERR_OR_NULL(pinning)) {
+		teardown_outbound_iatu(priv, pinning->outbound_iatu_region);
+		release_pinning(priv, pinning, true);
+	}
+
+	mutex_unlock(&priv->mutex);
+
+	return PTR_ERR_OR_ZERO(pinning);
+}
+
+long ioctl_unpin_pages_batch(struct chardev_private *priv,
+			     struct tenstorrent_unpin_pages_batch __user *arg)
+{
+	struct tenstorrent_device *tt_dev = priv->device;
+	struct tenstorrent_unpin_pages_batch batch = {0};
+	struct tenstorrent_unpin_pages_batch_entry *entries;
+	struct pinned_page_range **doomed;
+	unsigned int doomed_count = 0;
+	unsigned int i;
+	long ret = 0;
 
-	if (!PAGE_ALIGNED(in.virtual_address) || !PAGE_ALIGNED(in.size) || in.size == 0)
+	if (copy_from_user(&batch, arg, sizeof(batch)) != 0)
+		return -EFAULT;
+
+	if (batch.argsz != sizeof(batch) || batch.flags != 0 || batch.reserved != 0)
 		return -EINVAL;
 
-	if (!is_pin_pages_size_safe(in.size))
+	if (batch.count == 0 || batch.count > TENSTORRENT_PAGES_BATCH_MAX)
 		return -EINVAL;
 
-	noc_dma = in.flags & (TENSTORRENT_PIN_PAGES_NOC_DMA | TENSTORRENT_PIN_PAGES_NOC_TOP_DOWN);
-	top_down = in.flags & TENSTORRENT_PIN_PAGES_NOC_TOP_DOWN;
+	entries = kvmalloc_array(batch.count, sizeof(*entries), GFP_KERNEL);
+	doomed = kvmalloc_array(batch.count, sizeof(*doomed), GFP_KERNEL);
+	if (!entries || !doomed) {
+		ret = -ENOMEM;
+		goto out_free;
+	}
+
+	if (copy_from_user(entries, u64_to_user_ptr(batch.entries), batch.count * sizeof(*entries)) != 0) {
+		ret = -EFAULT;
+		goto out_free;
+	}
 
 	mutex_lock(&priv->mutex);
 
-	// Block duplicate (VA/size) pinnings. Prevents ambiguity in UNPIN_PAGES
-	// regarding iATU teardown if the same range were pinned multiple times with
-	// different NOC_DMA flags.
-	list_for_each_entry(pinning, &priv->pinnings, list) {
-		if (pinning->virtual_address == in.virtual_address &&
-		    pinning->page_count == PAGE_ALIGN(in.size) >> PAGE_SHIFT) {
-			mutex_unlock(&priv->mutex);
-			return -EEXIST;
-		}
+	for (i = 0; i < batch.count; i++) {
+		struct pinned_page_range *pinning = unref_pinning(priv, &entries[i].in);
+
+		entries[i].status = PTR_ERR_OR_ZERO(pinning);
+		entries[i].reserved = 0;
+
+		if (!IS_ERR_OR_NULL(pinning))
+			doomed[doomed_count++] = pinning;
 	}
 
-	pinning = kmalloc(sizeof(*pinning), GFP_KERNEL);
-	if (!pinning) {
-		mutex_unlock(&priv->mutex);
-		return -ENOMEM;
+	mutex_lock(&tt_dev->iatu_mutex);
+	for (i = 0; i < doomed_count; i++)
+		__teardown_outbound_iatu(priv, doomed[i]->outbound_iatu_region);
+	mutex_unlock(&tt_dev->iatu_mutex);
+
+	for (i = 0; i < doomed_count; i++)
+		release_pinning(priv, doomed[i], true);
+
+	mutex_unlock(&priv->mutex);
+
+	if (copy_to_user(u64_to_user_ptr(batch.entries), entries, batch.count * sizeof(*entries)) != 0)
+		ret = -EFAULT;
+
+out_free:
+	kvfree(doomed);
+	kvfree(entries);
+	return ret;
+}
+
+// Give the peer fd its own pinning of source's pages.
+static int share_pinning_with(struct chardev_private *priv, const struct pinned_page_range *source,
+			      u32 flags, struct tenstorrent_share_pinning_peer *peer)
+{
+	struct pinned_page_range *existing;
+	struct pinned_page_range *pinning;
+	struct chardev_private *peer_priv;
+	struct file *peer_file;
+	int ret;
+
+	peer_file = fget(peer->fd);
+	if (!peer_file)
+		return -EBADF;
+
+	peer_priv = get_tenstorrent_priv(peer_file);
+	if (!peer_priv || peer_priv->device == priv->device) {
+		ret = -EINVAL;
+		goto out_fput;
 	}
 
-	nr_pages = PAGE_ALIGN(in.size) >> PAGE_SHIFT;
-	pages = vzalloc(nr_pages * sizeof(struct page *));
-	if (!pages) {
-		pr_err("vzalloc failed for %lu page pointers\n", nr_pages);
+	pinning = kzalloc(sizeof(*pinning), GFP_KERNEL);
+	if (!pinning) {
 		ret = -ENOMEM;
-		goto err_free_pinning;
+		goto out_fput;
 	}
 
-	pages_pinned = pin_user_pages_fast_longterm(in.virtual_address, nr_pages, FOLL_WRITE, pages);
-	if (pages_pinned < 0) {
-		pr_warn("pin_user_pages_longterm failed: %d\n", pages_pinned);
-		ret = pages_pinned;
-		goto err_vfree_pages;
+	refcount_inc(&source->shared->refs);
+
+	pinning->priv = peer_priv;
+	pinning->flags = flags | source->flags;
+	pinning->refs = 1;
+	pinning->virtual_address = source->virtual_address;
+	pinning->page_count = source->page_count;
+	pinning->run_count = source->run_count;
+	pinning->runs = source->runs;
+	pinning->shared = source->shared;
+	pinning->outbound_iatu_region = -1;
+
+	if (!pinning_for_arena(peer_priv, pinning->flags)) {
+		ret = map_pinning(&peer_priv->device->pdev->dev, pinning);
+		if (ret) {
+			unpin_page_runs(pinning, false);
+			kfree(pinning);
+			goto out_fput;
+		}
 	}
 
-	if (pages_pinned != nr_pages) {
-		pr_err("could only pin %d of %lu pages\n", pages_pinned, nr_pages);
-		ret = -EINVAL;
-		goto err_unpin_pages;
+	if (wants_noc_dma(flags)) {
+		ret = setup_pinning_noc_dma(peer_priv, pinning);
+		if (ret)
+			goto err_release;
 	}
 
-	if (is_iommu_translated(&priv->device->pdev->dev)) {
-		struct scatterlist *sg;
-		unsigned int i;
-		dma_addr_t expected_next_address;
-		unsigned long total_dma_len = 0;
+	mutex_lock(&peer_priv->mutex);
+
+	existing = find_pinning(&peer_priv->pinnings, pinning->virtual_address, pinning->page_count);
+	if (existing && existing->page_count == pinning->page_count) {
+		ret = -EEXIST;
+	} else {
+		pinning_tree_insert(pinning, &peer_priv->pinnings);
+		ret = 0;
+	}
+
+	mutex_unlock(&peer_priv->mutex);
+
+	if (ret)
+		goto err_release;
 
-		if (!alloc_chained_sgt_for_pages(&dma_mapping, pages, nr_pages)) {
-			pr_warn("alloc_chained_sgt_for_pages failed for %lu pages, probably out of memory.\n", nr_pages);
-			ret = -ENOMEM;
-			goto err_unpin_pages;
-		}
+	peer->dma_address = pinning->dma_address;
+	peer->noc_address = pinning->noc_address;
 
-		ret = dma_map_sgtable(&priv->device->pdev->dev, &dma_mapping, DMA_BIDIRECTIONAL, 0);
+	fput(peer_file);
+	return 0;
 
-		if (ret != 0) {
-			pr_err("dma_map_sg failed.\n");
-			goto err_unlock_priv;
-		}
+err_release:
+	teardown_outbound_iatu(peer_priv, pinning->outbound_iatu_region);
+	release_pinning(peer_priv, pinning, false);
+out_fput:
+	fput(peer_file);
+	return ret;
+}
 
-		// This can only happen due to a misconfiguration or a bug.
-		for_each_sgtable_dma_sg((&dma_mapping), sg, i) {
-			if (i > 0 && sg_dma_address(sg) != expected_next_address) {
-				pr_err("discontiguous mapping\n");
-				ret = -EINVAL;
-			}
+long ioctl_share_pinning(struct chardev_private *priv,
+			 struct tenstorrent_share_pinning __user *arg)
+{
+	const u32 valid_flags = TENSTORRENT_PIN_PAGES_NOC_DMA | TENSTORRENT_PIN_PAGES_NOC_TOP_DOWN;
+	struct tenstorrent_share_pinning args = {0};
+	struct tenstorrent_share_pinning_peer *peers;
+	struct pinned_page_range source = {0};
+	struct pinned_page_range *pinning;
+	unsigned long nr_pages;
+	long ret = 0;
+	u32 i;
 
-			expected_next_address = sg_dma_address(sg) + sg_dma_len(sg);
-			total_dma_len += sg_dma_len(sg);
-		}
+	if (copy_from_user(&args, arg, sizeof(args)) != 0)
+		return -EFAULT;
 
-		if (total_dma_len != nr_pages * PAGE_SIZE) {
-			pr_err("dma-mapped (%lX) != original length (%lX).\n", total_dma_len, nr_pages * PAGE_SIZE);
-			ret = -EINVAL;
-		}
+	if (args.argsz != sizeof(args) || (args.flags & ~valid_flags) || args.reserved != 0)
+		return -EINVAL;
 
-		if (ret != 0) {
-			debug_print_sgtable(&dma_mapping);
-			goto err_dma_unmap;
-		}
+	if (args.count == 0 || args.count > TENSTORRENT_SHARE_PINNING_MAX_PEERS)
+		return -EINVAL;
 
-		out.physical_address = sg_dma_address(dma_mapping.sgl);
+	if (!PAGE_ALIGNED(args.virtual_address) || !PAGE_ALIGNED(args.size) || args.size == 0)
+		return -EINVAL;
 
-		if (noc_dma) {
-			ret = setup_noc_dma(priv, top_down, in.size, out.physical_address, &noc_address);
+	nr_pages = args.size >> PAGE_SHIFT;
 
-			if (ret < 0)
-				goto err_dma_unmap;
-			iatu_region = ret;
-		}
-	} else {
-		int i;
+	peers = kvmalloc_array(args.count, sizeof(*peers), GFP_KERNEL);
+	if (!peers)
+		return -ENOMEM;
 
-		for (i = 1; i < pages_pinned; i++) {
-			if (page_to_pfn(pages[i]) != page_to_pfn(pages[i-1]) + 1) {
-				pr_err("pages discontiguous at %d\n", i);
-				ret = -EINVAL;
-				goto err_unpin_pages;
-			}
-		}
+	if (copy_from_user(peers, u64_to_user_ptr(args.peers), args.count * sizeof(*peers)) != 0) {
+		ret = -EFAULT;
+		goto out_free;
+	}
 
-		out.physical_address = page_to_phys(pages[0]);
+	// Take a reference to the pages for the duration, so the pinning can
+	// be unpinned meanwhile without holding priv->mutex across peers.
+	mutex_lock(&priv->mutex);
 
-		if (noc_dma) {
-			ret = setup_noc_dma(priv, top_down, in.size, out.physical_address, &noc_address);
+	pinning = find_pinning(&priv->pinnings, args.virtual_address, nr_pages);
+	if (!pinning || pinning->page_count != nr_pages || pinning->refs == 0) {
+		mutex_unlock(&priv->mutex);
+		ret = -EINVAL;
+		goto out_free;
+	}
 
-			if (ret < 0)
-				goto err_unpin_pages;
-			iatu_region = ret;
+	if (!pinning->shared) {
+		pinning->shared = kzalloc(sizeof(*pinning->shared), GFP_KERNEL);
+		if (!pinning->shared) {
+			mutex_unlock(&priv->mutex);
+			ret = -ENOMEM;
+			goto out_free;
 		}
+		refcount_set(&pinning->shared->refs, 1);
 	}
 
-	pinning->page_count = nr_pages;
-	pinning->pages = pages;
-	pinning->dma_mapping = dma_mapping;
-	pinning->virtual_address = in.virtual_address;
-	pinning->outbound_iatu_region = iatu_region;
+	refcount_inc(&pinning->shared->refs);
 
-	list_add(&pinning->list, &priv->pinnings);
-	mutex_unlock(&priv->mutex);
+	// Peers get the same direction: TO_DEVICE pages may not be writable.
+	source.flags = pinning->flags & (TENSTORRENT_PIN_PAGES_TO_DEVICE | TENSTORRENT_PIN_PAGES_FROM_DEVICE);
+	source.virtual_address = pinning->virtual_address;
+	source.page_count = pinning->page_count;
+	source.run_count = pinning->run_count;
+	source.runs = pinning->runs;
+	source.shared = pinning->shared;
 
-	out.noc_address = noc_address;
-	if (clear_user(&arg->out, in.output_size_bytes) != 0)
-		return -EFAULT;
+	mutex_unlock(&priv->mutex);
 
-	bytes_to_copy = min(in.output_size_bytes, (u32)sizeof(out));
+	for (i = 0; i < args.count; i++) {
+		peers[i].dma_address = 0;
+		peers[i].noc_address = 0;
+		peers[i].status = share_pinning_with(priv, &source, args.flags, &peers[i]);
+	}
 
-	if (copy_to_user(&arg->out, &out, bytes_to_copy) != 0)
-		return -EFAULT;
+	unpin_page_runs(&source, true);
 
-	return 0;
+	if (copy_to_user(u64_to_user_ptr(args.peers), peers, args.count * sizeof(*peers)) != 0)
+		ret = -EFAULT;
 
-err_dma_unmap:
-	dma_unmap_sgtable(&priv->device->pdev->dev, &dma_mapping, DMA_BIDIRECTIONAL, 0);
-err_unlock_priv:
-	free_chained_sgt(&dma_mapping);
-err_unpin_pages:
-	unpin_user_pages_dirty_lock(pages, pages_pinned, false);
-err_vfree_pages:
-	vfree(pages);
-err_free_pinning:
-	kfree(pinning);
-	mutex_unlock(&priv->mutex);
+out_free:
+	kvfree(peers);
 	return ret;
 }
 
-long ioctl_unpin_pages(struct chardev_private *priv,
-		       struct tenstorrent_unpin_pages __user *arg)
+// Sync a pinning linked into an IOVA range rather than mapped as a scatterlist.
+// The IOMMU translates each run's part of the range back to its pages.
+static void sync_linked_pinning(struct device *dev, struct pinned_page_range *pinning, bool for_device)
 {
-	struct tenstorrent_unpin_pages_in in = {0};
-	struct pinned_page_range *pinning, *tmp_pinning;
+	enum dma_data_direction dir = pinning_dma_dir(pinning);
+	dma_addr_t addr = pinning->dma_address;
+	unsigned long i;
+
+	for (i = 0; i < pinning->run_count; i++) {
+		size_t size = pinning->runs[i].npages << PAGE_SHIFT;
+
+		if (for_device)
+			dma_sync_single_for_device(dev, addr, size, dir);
+		else
+			dma_sync_single_for_cpu(dev, addr, size, dir);
+
+		addr += size;
+	}
+}
+
+long ioctl_sync_pinned_pages(struct chardev_private *priv,
+			     struct tenstorrent_sync_pinned_pages __user *arg)
+{
+	const u32 valid_flags = TENSTORRENT_SYNC_PINNED_PAGES_FOR_DEVICE | TENSTORRENT_SYNC_PINNED_PAGES_FOR_CPU;
+	struct device *dev = &priv->device->pdev->dev;
+	struct tenstorrent_sync_pinned_pages args = {0};
+	struct pinned_page_range *pinning;
+	enum dma_data_direction dir;
 	unsigned long nr_pages;
-	long ret = -EINVAL;
+	long ret = 0;
 
-	if (copy_from_user(&in, &arg->in, sizeof(in)) != 0)
+	if (copy_from_user(&args, arg, sizeof(args)) != 0)
 		return -EFAULT;
 
-	nr_pages = in.size >> PAGE_SHIFT;
+	if (args.argsz != sizeof(args) || (args.flags & ~valid_flags) || hweight32(args.flags) != 1)
+		return -EINVAL;
 
-	if (in.reserved != 0 || in.size == 0 || nr_pages == 0)
+	if (!PAGE_ALIGNED(args.virtual_address) || !PAGE_ALIGNED(args.size) || args.size == 0)
 		return -EINVAL;
 
+	nr_pages = args.size >> PAGE_SHIFT;
+
 	mutex_lock(&priv->mutex);
 
-	list_for_each_entry_safe(pinning, tmp_pinning, &priv->pinnings, list) {
-		if (pinning->virtual_address != in.virtual_address)
-			continue;
+	pinning = find_pinning(&priv->pinnings, args.virtual_address, nr_pages);
+	if (!pinning || pinning->page_count != nr_pages || pinning->refs == 0) {
+		ret = -EINVAL;
+		goto out_unlock;
+	}
 
-		if (pinning->page_count != nr_pages) {
-			ret = -EINVAL;
-			break;
-		}
+	dir = pinning_dma_dir(pinning);
 
-		unpin_pinned_page_range(priv, pinning);
-		ret = 0;
-		break;
+	// Without an IOMMU the device uses the pages' physical addresses; there
+	// is no mapping to sync.
+	if (pinning->dma_mapping.sgl) {
+		if (args.flags & TENSTORRENT_SYNC_PINNED_PAGES_FOR_DEVICE)
+			dma_sync_sgtable_for_device(dev, &pinning->dma_mapping, dir);
+		else
+			dma_sync_sgtable_for_cpu(dev, &pinning->dma_mapping, dir);
+	} else if (pinning->arena_noc_address || pinning->iova) {
+		sync_linked_pinning(dev, pinning, args.flags & TENSTORRENT_SYNC_PINNED_PAGES_FOR_DEVICE);
 	}
 
+out_unlock:
 	mutex_unlock(&priv->mutex);
 	return ret;
 }
@@ -980,6 +3264,98 @@ unlock:
 	return ret;
 }
 
+long ioctl_configure_tlb_batch(struct chardev_private *priv,
+			       struct tenstorrent_configure_tlb_batch __user *arg)
+{
+	struct tenstorrent_device *tt_dev = priv->device;
+	struct tenstorrent_configure_tlb_batch batch = {0};
+	struct tenstorrent_configure_tlb_batch_entry *entries;
+	unsigned int i;
+	long ret = 0;
+
+	if (copy_from_user(&batch, arg, sizeof(batch)) != 0)
+		return -EFAULT;
+
+	if (batch.argsz != sizeof(batch) || batch.flags != 0 || batch.reserved != 0)
+		return -EINVAL;
+
+	if (batch.count == 0 || batch.count > TENSTORRENT_CONFIGURE_TLB_BATCH_MAX)
+		return -EINVAL;
+
+	if (!tt_dev->dev_class->configure_tlb)
+		return -EINVAL;
+
+	entries = kvmalloc_array(batch.count, sizeof(*entries), GFP_KERNEL);
+	if (!entries)
+		return -ENOMEM;
+
+	if (copy_from_user(entries, u64_to_user_ptr(batch.entries), batch.count * sizeof(*entries)) != 0) {
+		ret = -EFAULT;
+		goto out_free;
+	}
+
+	// Hold priv->mutex so no window can be freed between the ownership
+	// check and its configuration.
+	mutex_lock(&priv->mutex);
+
+	for (i = 0; i < batch.count; i++) {
+		if (entries[i].id >= TENSTORRENT_MAX_INBOUND_TLBS)
+			entries[i].status = -EINVAL;
+		else if (!test_bit(entries[i].id, priv->tlbs))
+			entries[i].status = -EPERM;
+		else
+			entries[i].status = 0;
+
+		if (entries[i].status && !ret)
+			ret = entries[i].status;
+	}
+
+	if (ret == 0) {
+		mutex_lock(&tt_dev->tlb_config_mutex);
+		for (i = 0; i < batch.count; i++)
+			entries[i].status = __tenstorrent_device_configure_tlb(tt_dev, entries[i].id,
+									       &entries[i].config);
+		mutex_unlock(&tt_dev->tlb_config_mutex);
+	}
+
+	mutex_unlock(&priv->mutex);
+
+	if (copy_to_user(u64_to_user_ptr(batch.entries), entries, batch.count * sizeof(*entries)) != 0)
+		ret = -EFAULT;
+
+out_free:
+	kvfree(entries);
+	return ret;
+}
+
+long ioctl_get_tlb_config(struct chardev_private *priv,
+			  struct tenstorrent_get_tlb_config __user *arg)
+{
+	struct tenstorrent_get_tlb_config args = {0};
+	int ret;
+
+	if (copy_from_user(&args, arg, sizeof(args)) != 0)
+		return -EFAULT;
+
+	if (args.argsz != sizeof(args) || args.flags != 0 || args.reserved != 0)
+		return -EINVAL;
+
+	if (args.id >= TENSTORRENT_MAX_INBOUND_TLBS)
+		return -EINVAL;
+
+	if (!test_bit(args.id, priv->tlbs))
+		return -EPERM;
+
+	ret = tenstorrent_device_get_tlb_config(priv->device, args.id, &args.config);
+	if (ret)
+		return ret;
+
+	if (copy_to_user(&arg->config, &args.config, sizeof(args.config)) != 0)
+		return -EFAULT;
+
+	return 0;
+}
+
 long ioctl_configure_tlb(struct chardev_private *priv,
 			 struct tenstorrent_configure_tlb __user *arg) {
 	struct tenstorrent_device *tt_dev = priv->device;
@@ -1015,30 +3391,191 @@ static bool vma_target_range(struct vm_area_struct *vma, u64 start, resource_siz
 
 static struct dmabuf *vma_dmabuf_target(struct chardev_private *priv,
 					struct vm_area_struct *vma) {
-	unsigned long dmabuf_index;
+	u64 offset = (u64)vma->vm_pgoff << PAGE_SHIFT;
+	unsigned long dmabuf_id;
 	struct dmabuf *dmabuf;
 
-	if (vma->vm_pgoff < MMAP_OFFSET_DMA_BUF >> PAGE_SHIFT)
-		// Not in DMA buffer offset range (too low).
-		return NULL;
+	if (offset >= MMAP_OFFSET_DMA_BUF) {
+		dmabuf_id = (vma->vm_pgoff - (MMAP_OFFSET_DMA_BUF >> PAGE_SHIFT)) / (MMAP_SIZE_DMA_BUF >> PAGE_SHIFT);
+		if (dmabuf_id >= TENSTORRENT_MAX_DMA_BUFS)
+			// Not in DMA buffer offset range (too high).
+			return NULL;
 
-	dmabuf_index = (vma->vm_pgoff - (MMAP_OFFSET_DMA_BUF >> PAGE_SHIFT)) / (MMAP_SIZE_DMA_BUF >> PAGE_SHIFT);
-	if (dmabuf_index >= TENSTORRENT_MAX_DMA_BUFS)
-		// Not in DMA buffer offset range (too high).
+		dmabuf = lookup_dmabuf(priv, dmabuf_id);
+	} else if (offset >= MMAP_OFFSET_DMA_BUF_V2) {
+		dmabuf = lookup_dmabuf_mmap_offset(priv, offset);
+	} else {
+		// Not in DMA buffer offset range (too low).
 		return NULL;
+	}
 
-	dmabuf = lookup_dmabuf_by_index(priv, dmabuf_index);
 	if (!dmabuf)
-		// No allocated DMA buffer for that index.
+		// No allocated DMA buffer at that offset.
 		return NULL;
 
-	if (vma_target_range(vma, dmabuf_mapping_start(dmabuf_index), dmabuf->size))
+	if (vma_target_range(vma, dmabuf->mmap_offset, dmabuf->size))
 		return dmabuf;
 	else
 		// Allocated DMA buffer does not cover requested size.
 		return NULL;
 }
 
+static void dmabuf_vma_open(struct vm_area_struct *vma)
+{
+	struct dmabuf *dmabuf = vma->vm_private_data;
+
+	refcount_inc(&dmabuf->refs);
+}
+
+static void dmabuf_vma_close(struct vm_area_struct *vma)
+{
+	struct chardev_private *priv = vma->vm_file->private_data;
+
+	dmabuf_put(priv, vma->vm_private_data);
+}
+
+static const struct vm_operations_struct dmabuf_vm_ops = {
+	.open = dmabuf_vma_open,
+	.close = dmabuf_vma_close,
+};
+
+// Caller holds priv->mutex, so the buffer can't be freed meanwhile.
+#ifdef TENSTORRENT_HUGE_DMABUF_MAP
+// Buffers in the kernel's linear map are physically contiguous, so map them on
+// demand with PMD entries where user VA and PA are both aligned and with PTEs
+// elsewhere. dma_mmap_coherent would install PTEs up front. The PFNs go in
+// with the VMA's own pgprot, so that's only right for a coherent device:
+// dma_mmap_coherent picks the uncached one the others need.
+static bool dmabuf_in_linear_map(struct device *dev, struct dmabuf *dmabuf)
+{
+	return dmabuf->ptr && !is_vmalloc_addr(dmabuf->ptr) && virt_addr_valid(dmabuf->ptr)
+	       && !cc_platform_has(CC_ATTR_MEM_ENCRYPT) && dev_is_dma_coherent(dev);
+}
+
+static unsigned long dmabuf_pfn(struct dmabuf *dmabuf, pgoff_t pgoff)
+{
+	return PHYS_PFN(virt_to_phys(dmabuf->ptr)) + pgoff;
+}
+
+static vm_fault_t dmabuf_vma_fault(struct vm_fault *vmf)
+{
+	struct dmabuf *dmabuf = vmf->vma->vm_private_data;
+
+	if (vmf->pgoff >= dmabuf->size >> PAGE_SHIFT)
+		return VM_FAULT_SIGBUS;
+
+	return vmf_insert_pfn(vmf->vma, vmf->address, dmabuf_pfn(dmabuf, vmf->pgoff));
+}
+
+static vm_fault_t dmabuf_vma_huge_fault(struct vm_fault *vmf, unsigned int order)
+{
+	struct vm_area_struct *vma = vmf->vma;
+	struct dmabuf *dmabuf = vma->vm_private_data;
+	unsigned long addr = vmf->address & PMD_MASK;
+	unsigned long pfn;
+	pgoff_t pgoff;
+
+	if (order != PMD_ORDER || addr < vma->vm_start || addr + PMD_SIZE > vma->vm_end)
+		return VM_FAULT_FALLBACK;
+
+	pgoff = vma->vm_pgoff + ((addr - vma->vm_start) >> PAGE_SHIFT);
+	pfn = dmabuf_pfn(dmabuf, pgoff);
+
+	if (pgoff + (1ul << PMD_ORDER) > dmabuf->size >> PAGE_SHIFT || !IS_ALIGNED(pfn, 1ul << PMD_ORDER))
+		return VM_FAULT_FALLBACK;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 17, 0)
+	return vmf_insert_pfn_pmd(vmf, pfn, vmf->flags & FAULT_FLAG_WRITE);
+#else
+	return vmf_insert_pfn_pmd(vmf, __pfn_to_pfn_t(pfn, PFN_DEV), vmf->flags & FAULT_FLAG_WRITE);
+#endif
+}
+
+static const struct vm_operations_struct dmabuf_huge_vm_ops = {
+	.open = dmabuf_vma_open,
+	.close = dmabuf_vma_close,
+	.fault = dmabuf_vma_fault,
+	.huge_fault = dmabuf_vma_huge_fault,
+};
+#endif
+
+static int mmap_dmabuf_node_pages(struct vm_area_struct *vma, struct sg_table *sgt)
+{
+	unsigned long skip = vma->vm_pgoff << PAGE_SHIFT;
+	unsigned long addr = vma->vm_start;
+	struct scatterlist *sg;
+	unsigned int i;
+	int ret;
+
+	for_each_sg(sgt->sgl, sg, sgt->orig_nents, i) {
+		unsigned long len;
+
+		if (skip >= sg->length) {
+			skip -= sg->length;
+			continue;
+		}
+
+		len = min_t(unsigned long, sg->length - skip, vma->vm_end - addr);
+		ret = remap_pfn_range(vma, addr, page_to_pfn(sg_page(sg)) + (skip >> PAGE_SHIFT),
+				      len, vma->vm_page_prot);
+		if (ret)
+			return ret;
+
+		addr += len;
+		skip = 0;
+
+		if (addr == vma->vm_end)
+			break;
+	}
+
+	return 0;
+}
+
+static int map_dmabuf(struct chardev_private *priv, struct vm_area_struct *vma, struct dmabuf *dmabuf)
+{
+	struct tenstorrent_device *tt_dev = priv->device;
+	int ret;
+
+#ifdef TENSTORRENT_HUGE_DMABUF_MAP
+	// vmf_insert_pfn can't fill a private writable (COW) PFN mapping, so
+	// those go through dma_mmap_coherent like any other buffer.
+	if ((vma->vm_flags & VM_SHARED) && dmabuf_in_linear_map(&tt_dev->pdev->dev, dmabuf)) {
+		// VM_HUGEPAGE: with THP in madvise mode, the core only calls
+		// huge_fault for VMAs that asked for it.
+		vm_flags_set(vma, VM_PFNMAP | VM_DONTEXPAND | VM_DONTDUMP | VM_HUGEPAGE);
+
+		refcount_inc(&dmabuf->refs);
+		vma->vm_ops = &dmabuf_huge_vm_ops;
+		vma->vm_private_data = dmabuf;
+
+		return 0;
+	}
+#endif
+
+	if (dmabuf->node_pages) {
+		ret = mmap_dmabuf_node_pages(vma, dmabuf->sgt);
+	} else if (dmabuf->sgt) {
+		ret = dma_mmap_noncontiguous(&tt_dev->pdev->dev, vma, dmabuf->size, dmabuf->sgt);
+	} else if (dmabuf->from_pool) {
+		// dma_mmap_coherent only accepts whole allocations, so map the
+		// buffer as an offset into the pool.
+		vma->vm_pgoff += (dmabuf->phys - tt_dev->dma_pool_dma_addr) >> PAGE_SHIFT;
+		ret = dma_mmap_coherent(&tt_dev->pdev->dev, vma, tt_dev->dma_pool_ptr,
+					tt_dev->dma_pool_dma_addr, tt_dev->dma_pool_size);
+	} else {
+		ret = dma_mmap_coherent(&tt_dev->pdev->dev, vma, dmabuf->ptr, dmabuf->phys, dmabuf->size);
+	}
+
+	if (ret)
+		return ret;
+
+	refcount_inc(&dmabuf->refs);
+	vma->vm_ops = &dmabuf_vm_ops;
+	vma->vm_private_data = dmabuf;
+
+	return 0;
+}
+
 static void bar_vma_open(struct vm_area_struct *vma)
 {
 	struct bar_mapping *mapping = vma->vm_private_data;
@@ -1277,37 +3814,89 @@ int tenstorrent_mmap(struct chardev_private *priv, struct vm_area_struct *vma)
 		return map_tlb_window(priv, vma);
 
 	} else {
-		struct dmabuf *dmabuf = vma_dmabuf_target(priv, vma);
+		struct dmabuf *dmabuf;
+		int ret = -EINVAL;
+
+		mutex_lock(&priv->mutex);
+
+		dmabuf = vma_dmabuf_target(priv, vma);
 		if (dmabuf != NULL)
-			return dma_mmap_coherent(&pdev->dev, vma, dmabuf->ptr,
-						 dmabuf->phys, dmabuf->size);
-		else
-			return -EINVAL;
+			ret = map_dmabuf(priv, vma, dmabuf);
+
+		mutex_unlock(&priv->mutex);
+		return ret;
 	}
 }
 
-void tenstorrent_memory_cleanup(struct chardev_private *priv)
+// Tear down the fd's iATU regions so the device can no longer reach its
+// memory. tenstorrent_memory_cleanup releases the memory later.
+void tenstorrent_memory_revoke(struct chardev_private *priv)
 {
 	struct tenstorrent_device *tt_dev = priv->device;
+	struct pinned_page_range *pinning;
+	struct dma_buf_import *import;
+	struct dmabuf *dmabuf;
+	int id;
+
+	mutex_lock(&priv->mutex);
+	mutex_lock(&tt_dev->iatu_mutex);
+
+	idr_for_each_entry(&priv->dmabufs, dmabuf, id) {
+		__teardown_outbound_iatu(priv, dmabuf->outbound_iatu_region);
+		dmabuf->outbound_iatu_region = -1;
+	}
+
+	for_each_pinning(pinning, &priv->pinnings) {
+		__teardown_outbound_iatu(priv, pinning->outbound_iatu_region);
+		pinning->outbound_iatu_region = -1;
+	}
+
+	idr_for_each_entry(&priv->imports, import, id) {
+		__teardown_outbound_iatu(priv, import->outbound_iatu_region);
+		import->outbound_iatu_region = -1;
+	}
+
+	// Arena users keep their pieces until they're freed.
+	__revoke_noc_dma_arena(priv);
+
+	mutex_unlock(&tt_dev->iatu_mutex);
+	mutex_unlock(&priv->mutex);
+}
+
+void tenstorrent_memory_cleanup(struct chardev_private *priv)
+{
 	struct pinned_page_range *pinning, *tmp_pinning;
-	struct hlist_node *tmp_dmabuf;
+	struct dma_buf_import *import;
 	struct dmabuf *dmabuf;
-	unsigned int i;
+	int id;
 	struct peer_resource_mapping *peer_mapping, *tmp_peer_mapping;
 
 	mutex_lock(&priv->mutex);
 
-	hash_for_each_safe(priv->dmabufs, i, tmp_dmabuf, dmabuf, hash_chain) {
-		dma_free_coherent(&tt_dev->pdev->dev, dmabuf->size, dmabuf->ptr, dmabuf->phys);
-		teardown_outbound_iatu(priv, dmabuf->outbound_iatu_region);
-		hash_del(&dmabuf->hash_chain);
-		kfree(dmabuf);
+	idr_for_each_entry(&priv->dmabufs, dmabuf, id) {
+		remove_dmabuf(priv, dmabuf);
+		dmabuf_put(priv, dmabuf);
 	}
+	idr_destroy(&priv->dmabufs);
 
-	list_for_each_entry_safe(pinning, tmp_pinning, &priv->pinnings, list) {
+	for_each_pinning_safe(pinning, tmp_pinning, &priv->pinnings) {
 		unpin_pinned_page_range(priv, pinning);
 	}
 
+	idr_for_each_entry(&priv->imports, import, id) {
+		idr_remove(&priv->imports, id);
+		teardown_outbound_iatu(priv, import->outbound_iatu_region);
+		tenstorrent_dma_buf_unimport(import);
+	}
+	idr_destroy(&priv->imports);
+
+	if (priv->partial_pin) {
+		release_pinning(priv, priv->partial_pin, false);
+		priv->partial_pin = NULL;
+	}
+
+	destroy_noc_dma_arena(priv);
+
 	list_for_each_entry_safe(peer_mapping, tmp_peer_mapping, &priv->peer_mappings, list) {
 		dma_unmap_resource(&priv->device->pdev->dev, peer_mapping->mapped_address, peer_mapping->size, DMA_BIDIRECTIONAL, 0);
 
@@ -1316,4 +3905,7 @@ void tenstorrent_memory_cleanup(struct chardev_private *priv)
 	}
 
 	mutex_unlock(&priv->mutex);
+
+	// No notifiers are left to queue it again.
+	cancel_work_sync(&priv->pin_cache_work);
 }
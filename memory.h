@@ -6,29 +6,112 @@
 
 #include <linux/compiler.h>
 #include <linux/scatterlist.h>
+#include <linux/version.h>
+#include <linux/mmu_notifier.h>
+#include <linux/rbtree.h>
+#include <linux/refcount.h>
 
 #define MAX_DMA_BUF_SIZE_LOG2 28
 
+// TENSTORRENT_PIN_PAGES_CACHED relies on mmu_interval_notifier (5.5).
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 5, 0) && IS_ENABLED(CONFIG_MMU_NOTIFIER)
+#define TENSTORRENT_PIN_CACHE
+#endif
+
+// Map DMA buffers with PMD entries where possible. A huge PFN mapping needs
+// pmd_special, or the rest of mm takes it for a THP (6.12).
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 12, 0) && IS_ENABLED(CONFIG_TRANSPARENT_HUGEPAGE) \
+	&& IS_ENABLED(CONFIG_ARCH_SUPPORTS_PMD_PFNMAP)
+#define TENSTORRENT_HUGE_DMABUF_MAP
+#endif
+
 struct chardev_private;
+struct tenstorrent_device;
 struct tenstorrent_query_mappings;
 struct tenstorrent_allocate_dma_buf;
 struct tenstorrent_free_dma_buf;
+struct tenstorrent_allocate_dma_buf_v2;
+struct tenstorrent_free_dma_buf_v2;
+struct tenstorrent_export_dma_buf;
+struct tenstorrent_import_dma_buf;
+struct tenstorrent_unimport_dma_buf;
+struct dmabuf;
+struct file;
 struct tenstorrent_pin_pages;
+struct tenstorrent_pin_pages_batch;
+struct tenstorrent_unpin_pages_batch;
+struct tenstorrent_share_pinning;
+struct tenstorrent_sync_pinned_pages;
+struct tenstorrent_configure_tlb_batch;
+struct tenstorrent_get_tlb_config;
 struct tenstorrent_map_peer_bar;
 struct vm_area_struct;
+struct work_struct;
+
+// Physically contiguous pinned pages, at least one folio (or part of one at
+// either end of the pinning).
+struct pinned_page_run {
+	struct page *page;	// first page of the run
+	unsigned long npages;
+};
+
+// Pages pinned once and mapped to several devices by
+// TENSTORRENT_IOCTL_SHARE_PINNING. Every pinning sharing them points at the
+// same runs array, which is read-only from then on. The last pinning to go
+// unpins the pages and frees the runs.
+struct shared_pinned_pages {
+	refcount_t refs;	// one per pinning
+};
+
+struct pinning_iova;
 
 struct pinned_page_range {
-	struct list_head list;
+	struct rb_node rb;		// in chardev_private.pinnings
+	u64 __subtree_last;
+	struct chardev_private *priv;
+
+	u32 flags;		// TENSTORRENT_PIN_PAGES_*
+	unsigned int refs;	// PIN_PAGES calls not yet undone by UNPIN_PAGES
+	unsigned int export_refs;	// EXPORT_DMA_BUF dma-bufs not yet released
+	u64 dma_address;	// as returned by PIN_PAGES
+	u64 noc_address;
 
 	unsigned long page_count;
-	struct page **pages;	// vmalloc/vfree
+	unsigned long run_count;
+	struct pinned_page_run *runs;	// kvmalloc/kvfree
+	struct shared_pinned_pages *shared;	// NULL if the runs are ours alone
 
-	struct sg_table dma_mapping;	// alloc_chained_sgt_for_pages / free_chained_sgt
+	struct sg_table dma_mapping;	// alloc_chained_sgt_for_runs / free_chained_sgt, empty if in the arena
+	struct pinning_iova *iova;	// instead of dma_mapping where the DMA API allows
 	u64 virtual_address;
 
 	int outbound_iatu_region;
+	u64 arena_noc_address;	// nonzero if in chardev_private.noc_dma_arena instead
+
+#ifdef TENSTORRENT_PIN_CACHE
+	// Only for TENSTORRENT_PIN_PAGES_CACHED: tells us when the VA range no
+	// longer maps the pinned pages.
+	struct mmu_interval_notifier notifier;
+	unsigned long notifier_seq;
+#endif
 };
 
+// chardev_private.pinnings is an interval tree keyed on the pinned VA range.
+void pinning_tree_insert(struct pinned_page_range *node, struct rb_root_cached *root);
+void pinning_tree_remove(struct pinned_page_range *node, struct rb_root_cached *root);
+struct pinned_page_range *pinning_tree_iter_first(struct rb_root_cached *root, u64 start, u64 last);
+struct pinned_page_range *pinning_tree_iter_next(struct pinned_page_range *node, u64 start, u64 last);
+
+// Visit all pinnings in VA order. Caller holds priv->mutex.
+#define for_each_pinning(pinning, root) \
+	for (pinning = pinning_tree_iter_first(root, 0, U64_MAX); pinning; \
+	     pinning = pinning_tree_iter_next(pinning, 0, U64_MAX))
+
+// Same, but pinning may be removed from the tree.
+#define for_each_pinning_safe(pinning, tmp, root) \
+	for (pinning = pinning_tree_iter_first(root, 0, U64_MAX); \
+	     pinning && (tmp = pinning_tree_iter_next(pinning, 0, U64_MAX), 1); \
+	     pinning = tmp)
 
 long ioctl_query_mappings(struct chardev_private *priv,
 			  struct tenstorrent_query_mappings __user *arg);
@@ -36,10 +119,28 @@ long ioctl_allocate_dma_buf(struct chardev_private *priv,
 			    struct tenstorrent_allocate_dma_buf __user *arg);
 long ioctl_free_dma_buf(struct chardev_private *priv,
 			struct tenstorrent_free_dma_buf __user *arg);
+long ioctl_allocate_dma_buf_v2(struct chardev_private *priv,
+			       struct tenstorrent_allocate_dma_buf_v2 __user *arg);
+long ioctl_free_dma_buf_v2(struct chardev_private *priv,
+			   struct tenstorrent_free_dma_buf_v2 __user *arg);
+long ioctl_export_dma_buf(struct chardev_private *priv, struct file *file,
+			  struct tenstorrent_export_dma_buf __user *arg);
+long ioctl_import_dma_buf(struct chardev_private *priv,
+			  struct tenstorrent_import_dma_buf __user *arg);
+long ioctl_unimport_dma_buf(struct chardev_private *priv,
+			    struct tenstorrent_unimport_dma_buf __user *arg);
 long ioctl_pin_pages(struct chardev_private *priv,
 		     struct tenstorrent_pin_pages __user *arg);
 long ioctl_unpin_pages(struct chardev_private *priv,
 		     struct tenstorrent_unpin_pages __user *arg);
+long ioctl_pin_pages_batch(struct chardev_private *priv,
+			   struct tenstorrent_pin_pages_batch __user *arg);
+long ioctl_unpin_pages_batch(struct chardev_private *priv,
+			     struct tenstorrent_unpin_pages_batch __user *arg);
+long ioctl_share_pinning(struct chardev_private *priv,
+			 struct tenstorrent_share_pinning __user *arg);
+long ioctl_sync_pinned_pages(struct chardev_private *priv,
+			     struct tenstorrent_sync_pinned_pages __user *arg);
 long ioctl_map_peer_bar(struct chardev_private *priv,
 			struct tenstorrent_map_peer_bar __user *arg);
 long ioctl_allocate_tlb(struct chardev_private *priv,
@@ -48,14 +149,25 @@ long ioctl_free_tlb(struct chardev_private *priv,
 			struct tenstorrent_free_tlb __user *arg);
 long ioctl_configure_tlb(struct chardev_private *priv,
 			struct tenstorrent_configure_tlb __user *arg);
+long ioctl_configure_tlb_batch(struct chardev_private *priv,
+			       struct tenstorrent_configure_tlb_batch __user *arg);
+long ioctl_get_tlb_config(struct chardev_private *priv,
+			  struct tenstorrent_get_tlb_config __user *arg);
 
 int tenstorrent_mmap(struct chardev_private *priv, struct vm_area_struct *vma);
+void dmabuf_put(struct chardev_private *priv, struct dmabuf *dmabuf);
+void tenstorrent_dma_pool_init(struct tenstorrent_device *tt_dev);
+void tenstorrent_dma_pool_fini(struct tenstorrent_device *tt_dev);
+void tenstorrent_memory_revoke(struct chardev_private *priv);
 void tenstorrent_memory_cleanup(struct chardev_private *priv);
+void tenstorrent_pin_cache_evict(struct work_struct *work);
 bool is_iommu_translated(struct device *dev);
 
 #define TENSTORRENT_MAX_OUTBOUND_IATU_REGIONS 16
 struct tenstorrent_outbound_iatu_region {
 	struct chardev_private *priv;	// Owner of this region
+	struct rb_node node;		// in tenstorrent_device.outbound_iatu_tree while owned
+	bool top_down;			// allocated from the top of the NOC window
 	u64 base;
 	u64 limit;
 	u64 target;
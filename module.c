@@ -42,6 +42,14 @@ unsigned char auto_reset_timeout = 10;
 module_param(auto_reset_timeout, byte, 0444);
 MODULE_PARM_DESC(auto_reset_timeout, "Timeout duration in seconds for M3 auto reset to occur.");
 
+uint dma_pool_size = 0;
+module_param(dma_pool_size, uint, 0444);
+MODULE_PARM_DESC(dma_pool_size, "MiB of coherent memory reserved per device for DMA buffers, 0 to disable.");
+
+uint noc_dma_arena_size = 0;
+module_param(noc_dma_arena_size, uint, 0444);
+MODULE_PARM_DESC(noc_dma_arena_size, "MiB of IOVA space per fd that NOC_DMA pins and buffers share one iATU region in, 0 to disable.");
+
 const struct pci_device_id tenstorrent_ids[] = {
 	{ PCI_DEVICE(PCI_VENDOR_ID_TENSTORRENT, PCI_DEVICE_ID_GRAYSKULL),
 	  .driver_data=(kernel_ulong_t)NULL}, // Deprecated
@@ -8,14 +8,16 @@
 #include <linux/pci.h>
 
 #define TENSTORRENT_DRIVER_VERSION_MAJOR 2
-#define TENSTORRENT_DRIVER_VERSION_MINOR 6
-#define TENSTORRENT_DRIVER_VERSION_PATCH 2
+#define TENSTORRENT_DRIVER_VERSION_MINOR 7
+#define TENSTORRENT_DRIVER_VERSION_PATCH 0
 #define TENSTORRENT_DRIVER_VERSION_SUFFIX "-pre"
 
 // Module options that need to be passed to other files
 extern uint dma_address_bits;
 extern uint reset_limit;
 extern unsigned char auto_reset_timeout;
+extern uint dma_pool_size;
+extern uint noc_dma_arena_size;
 
 extern struct tenstorrent_device_class wormhole_class;
 extern struct tenstorrent_device_class blackhole_class;
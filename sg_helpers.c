@@ -1,7 +1,9 @@
 #include "sg_helpers.h"
+#include "memory.h"
 
 #include <linux/kernel.h>
 #include <linux/bug.h>
+#include <linux/slab.h>
 
 // -1 because the chain entry requires its own struct scatterlist, and
 // for simplicity we reserve the last entry of every page for the chain.
@@ -13,28 +15,41 @@
 #define MAX_PAGES_PER_SCL (UINT_MAX / PAGE_SIZE)
 
 // This is very similar to sg_alloc_table_from_pages, but we need to go big so
-// we use single-page allocations and scatterlist chaining for unlimited scaling.
-bool alloc_chained_sgt_for_pages(struct sg_table *table, struct page **pages, unsigned int n_pages)
+// we use at most page-sized allocations and scatterlist chaining for unlimited
+// scaling. The runs are already physically contiguous, so each becomes one
+// scatterlist entry unless it's too long for sg->length. The last chunk is
+// sized to fit, so a pinning of a few runs costs a few entries, not a page.
+bool alloc_chained_sgt_for_runs(struct sg_table *table, const struct pinned_page_run *runs, unsigned long n_runs)
 {
-	struct page **pages_end = pages + n_pages;
+	const struct pinned_page_run *runs_end = runs + n_runs;
+	unsigned long run_offset = 0;	// pages of *runs already consumed
+	unsigned long remaining = 0;	// scatterlist entries still to write
+	unsigned long i;
 
-	struct scatterlist *current_scl = NULL; // last entry of previous page of scatterlists
+	struct scatterlist *current_scl = NULL; // last entry of previous chunk of scatterlists
 
 	memset(table, 0, sizeof(*table));
 
-	if (n_pages == 0)
+	if (n_runs == 0)
 		return true;
 
-	while (pages < pages_end) {
-		// Zeroed because sg_set_page preserves the page_link chain/end bits.
-		struct page *new_page = alloc_page(GFP_KERNEL | __GFP_ZERO);
+	for (i = 0; i < n_runs; i++)
+		remaining += DIV_ROUND_UP(runs[i].npages, MAX_PAGES_PER_SCL);
+
+	if (remaining > UINT_MAX)
+		return false;
+
+	while (runs < runs_end) {
+		// Room for the chain entry only if another chunk follows.
+		unsigned long chunk = remaining > SCL_PER_PAGE ? SCL_PER_PAGE + 1 : remaining;
 		struct scatterlist *page_first_scl;
 
-		if (!new_page)
+		// Zeroed because sg_set_page preserves the page_link chain/end bits.
+		page_first_scl = kcalloc(chunk, sizeof(*page_first_scl), GFP_KERNEL);
+		if (!page_first_scl)
 			goto out_free;
 
-		// Attach the new page to the chain.
-		page_first_scl = page_address(new_page);
+		// Attach the new chunk to the chain.
 
 		if (current_scl) {
 			sg_chain(current_scl, 1, page_first_scl);
@@ -44,26 +59,29 @@ bool alloc_chained_sgt_for_pages(struct sg_table *table, struct page **pages, un
 
 		current_scl = page_first_scl;
 
-		// Measure out contiguous page ranges and write each into a scatterlist entry in the
-		// current scatterlist page.
-		while (pages < pages_end && current_scl - page_first_scl < SCL_PER_PAGE) {
-			struct page **contig_start = pages++;
+		// Write each run (or MAX_PAGES_PER_SCL piece of a run) into a scatterlist
+		// entry in the current chunk.
+		while (runs < runs_end && current_scl - page_first_scl < SCL_PER_PAGE) {
+			unsigned long npages = min_t(unsigned long, runs->npages - run_offset, MAX_PAGES_PER_SCL);
 
-			for (; pages < pages_end && pages - contig_start < MAX_PAGES_PER_SCL; pages++)
-				if (page_to_pfn(pages[-1]) + 1 != page_to_pfn(pages[0]))
-					break;
+			sg_set_page(current_scl++, nth_page(runs->page, run_offset), npages * PAGE_SIZE, 0);
 
-			sg_set_page(current_scl++, *contig_start, (pages - contig_start) * PAGE_SIZE, 0);
+			run_offset += npages;
+			if (run_offset == runs->npages) {
+				runs++;
+				run_offset = 0;
+			}
 		}
 
+		remaining -= current_scl - page_first_scl;
 		table->nents += current_scl - page_first_scl;
+		table->orig_nents = table->nents;
 
 		// Note that current_scl points to the extra entry reserved for chaining.
 		// Chaining entries are not included in table->nents. sg_next() just skips over them.
 	}
 
-	table->orig_nents = table->nents;
-	sg_mark_end(current_scl);
+	sg_mark_end(current_scl - 1);
 	return true;
 
 out_free:
@@ -71,14 +89,15 @@ out_free:
 	return false;
 }
 
-// Free a chained scatterlist created by alloc_chained_sgt_for_pages.
+// Free a chained scatterlist created by alloc_chained_sgt_for_runs.
 // Doesn't check each scatterlist entry if it's chain/end, rather asssumes that there are always
-// SCL_PER_PAGE except for the last page.
-// Also, alloc_chained_sgt_for_pages calls this on failure, in which case there's no SG_END marker.
+// SCL_PER_PAGE except for the last chunk.
+// Also, alloc_chained_sgt_for_runs calls this on failure, in which case there's no SG_END marker.
+// orig_nents, not nents: dma_map_sgtable replaces nents with the mapped count.
 void free_chained_sgt(struct sg_table *table)
 {
 	struct scatterlist *next_page = table->sgl;
-	unsigned int num_entries = table->nents;
+	unsigned int num_entries = table->orig_nents;
 
 	while (next_page) {
 		struct scatterlist *current_page = next_page;
@@ -94,7 +113,7 @@ void free_chained_sgt(struct sg_table *table)
 			next_page = NULL;
 		}
 
-		__free_page(virt_to_page(current_page));
+		kfree(current_page);
 	}
 }
 
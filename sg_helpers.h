@@ -29,11 +29,23 @@ static inline void dma_unmap_sgtable(struct device *dev, struct sg_table *dma_ma
 	dma_unmap_sg_attrs(dev, dma_mapping->sgl, dma_mapping->nents, dir, attrs);
 }
 
+static inline void dma_sync_sgtable_for_cpu(struct device *dev, struct sg_table *dma_mapping, enum dma_data_direction dir)
+{
+	dma_sync_sg_for_cpu(dev, dma_mapping->sgl, dma_mapping->orig_nents, dir);
+}
+
+static inline void dma_sync_sgtable_for_device(struct device *dev, struct sg_table *dma_mapping, enum dma_data_direction dir)
+{
+	dma_sync_sg_for_device(dev, dma_mapping->sgl, dma_mapping->orig_nents, dir);
+}
+
 #define for_each_sgtable_dma_sg(sgt, tmp_scl, tmp_idx) for_each_sg((sgt)->sgl, tmp_scl, (sgt)->nents, tmp_idx)
 
 #endif
 
-bool alloc_chained_sgt_for_pages(struct sg_table *table, struct page **pages, unsigned int n_pages);
+struct pinned_page_run;
+
+bool alloc_chained_sgt_for_runs(struct sg_table *table, const struct pinned_page_run *runs, unsigned long n_runs);
 void free_chained_sgt(struct sg_table *table); // Safe to pass zero-intialized sg_table.
 
 void debug_print_sgtable(struct sg_table *table);
@@ -1,13 +1,19 @@
 // SPDX-FileCopyrightText: © 2023 Tenstorrent Inc.
 // SPDX-License-Identifier: GPL-2.0-only
 
+#include <algorithm>
+#include <chrono>
+#include <iostream>
 #include <limits>
+#include <set>
 #include <variant>
 #include <cerrno>
 #include <cstdint>
+#include <cstring>
 
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <fcntl.h>
 #include <unistd.h>
 
 #include "ioctl.h"
@@ -126,6 +132,440 @@ void VerifyMultipleNocMappedBuffers(int dev_fd)
         THROW_TEST_FAILURE("Second NOC-mapped DMA buffer allocation failed.");
 }
 
+int FreeDmaBuf(int dev_fd, std::uint8_t index)
+{
+    tenstorrent_free_dma_buf free_dma_buf;
+    zero(&free_dma_buf);
+
+    free_dma_buf.in.buf_index = index;
+
+    return ioctl(dev_fd, TENSTORRENT_IOCTL_FREE_DMA_BUF, &free_dma_buf) == 0 ? 0 : errno;
+}
+
+// Free a buffer while it's mapped, check the mapping still works and the index can be reused.
+void VerifyFreeDmaBuf(int dev_fd)
+{
+    if (FreeDmaBuf(dev_fd, 0) != EINVAL)
+        THROW_TEST_FAILURE("Freeing an unallocated DMA buffer did not fail with EINVAL.");
+
+    auto buf = AllocateDmaBuf(dev_fd, page_size(), 0, TENSTORRENT_ALLOCATE_DMA_BUF_NOC_DMA);
+    if (std::holds_alternative<int>(buf))
+        THROW_TEST_FAILURE("DMA buffer allocation failed.");
+
+    const auto &b = std::get<tenstorrent_allocate_dma_buf_out>(buf);
+
+    void *p = mmap(nullptr, b.size, PROT_READ | PROT_WRITE, MAP_SHARED, dev_fd, b.mapping_offset);
+    if (p == MAP_FAILED)
+        THROW_TEST_FAILURE("DMA buffer mapping failed.");
+
+    if (FreeDmaBuf(dev_fd, 0) != 0)
+        THROW_TEST_FAILURE("Freeing a mapped DMA buffer failed.");
+
+    if (FreeDmaBuf(dev_fd, 0) != EINVAL)
+        THROW_TEST_FAILURE("Freeing a DMA buffer twice did not fail with EINVAL.");
+
+    std::memset(p, 0xA5, b.size);
+    if (static_cast<unsigned char*>(p)[b.size - 1] != 0xA5)
+        THROW_TEST_FAILURE("Mapping of a freed DMA buffer did not keep the buffer.");
+
+    auto reused = AllocateDmaBuf(dev_fd, page_size(), 0, TENSTORRENT_ALLOCATE_DMA_BUF_NOC_DMA);
+    if (std::holds_alternative<int>(reused))
+        THROW_TEST_FAILURE("DMA buffer index could not be reused after free.");
+
+    munmap(p, b.size);
+
+    if (FreeDmaBuf(dev_fd, 0) != 0)
+        THROW_TEST_FAILURE("Freeing an unmapped DMA buffer failed.");
+}
+
+std::variant<tenstorrent_allocate_dma_buf_v2, int>
+AllocateDmaBufV2(int dev_fd, std::uint64_t size, std::uint32_t flags)
+{
+    tenstorrent_allocate_dma_buf_v2 allocate_dma_buf;
+    zero(&allocate_dma_buf);
+
+    allocate_dma_buf.argsz = sizeof(allocate_dma_buf);
+    allocate_dma_buf.flags = flags;
+    allocate_dma_buf.size = size;
+
+    if (ioctl(dev_fd, TENSTORRENT_IOCTL_ALLOCATE_DMA_BUF_V2, &allocate_dma_buf) != 0)
+        return errno;
+
+    return allocate_dma_buf;
+}
+
+int FreeDmaBufV2(int dev_fd, std::uint32_t handle)
+{
+    tenstorrent_free_dma_buf_v2 free_dma_buf;
+    zero(&free_dma_buf);
+
+    free_dma_buf.argsz = sizeof(free_dma_buf);
+    free_dma_buf.handle = handle;
+
+    return ioctl(dev_fd, TENSTORRENT_IOCTL_FREE_DMA_BUF_V2, &free_dma_buf) == 0 ? 0 : errno;
+}
+
+void VerifyMapDmaBufV2(int dev_fd, const tenstorrent_allocate_dma_buf_v2 &b, unsigned char value)
+{
+    // 32-bit mmap2 takes the offset in pages.
+    if (b.mmap_offset + b.size > std::uint64_t(page_size()) << 32)
+        THROW_TEST_FAILURE("DMA buffer v2 mmap offset is out of reach of mmap2.");
+
+    void *p = mmap(nullptr, b.size, PROT_READ | PROT_WRITE, MAP_SHARED, dev_fd, b.mmap_offset);
+    if (p == MAP_FAILED)
+        THROW_TEST_FAILURE("DMA buffer v2 mapping failed.");
+
+    auto bytes = static_cast<unsigned char*>(p);
+    if (bytes[0] != 0 || bytes[b.size - 1] != 0)
+        THROW_TEST_FAILURE("New DMA buffer v2 was not zeroed.");
+
+    bytes[0] = value;
+    bytes[b.size - 1] = value;
+
+    munmap(p, b.size);
+}
+
+// More buffers than ALLOCATE_DMA_BUF allows, and one larger than its size limit
+// if there's memory for it. Runs with every ALLOCATE_DMA_BUF index in use.
+void VerifyDmaBufV2(int dev_fd, std::size_t max_dma_buf_size)
+{
+    std::vector<tenstorrent_allocate_dma_buf_v2> buffers;
+
+    for (unsigned int i = 0; i < 2 * TENSTORRENT_MAX_DMA_BUFS; i++)
+    {
+        auto buf = AllocateDmaBufV2(dev_fd, page_size(), 0);
+        if (std::holds_alternative<int>(buf))
+            THROW_TEST_FAILURE("Tiny DMA buffer v2 allocation failed.");
+
+        const auto &b = std::get<tenstorrent_allocate_dma_buf_v2>(buf);
+        if (b.handle < TENSTORRENT_MAX_DMA_BUFS)
+            THROW_TEST_FAILURE("DMA buffer v2 handle overlaps the ALLOCATE_DMA_BUF indices.");
+
+        buffers.push_back(b);
+    }
+
+    for (unsigned int i = 0; i < buffers.size(); i++)
+        VerifyMapDmaBufV2(dev_fd, buffers[i], i);
+
+    // Freeing every other buffer leaves page-sized holes that new buffers of
+    // the same size fill, lowest first.
+    std::set<std::uint64_t> holes;
+    for (unsigned int i = 1; i < buffers.size(); i += 2)
+    {
+        if (FreeDmaBufV2(dev_fd, buffers[i].handle) != 0)
+            THROW_TEST_FAILURE("Freeing a DMA buffer v2 failed.");
+        holes.insert(buffers[i].mmap_offset);
+    }
+
+    for (unsigned int i = 1; i < buffers.size(); i += 2)
+    {
+        auto buf = AllocateDmaBufV2(dev_fd, page_size(), 0);
+        if (std::holds_alternative<int>(buf))
+            THROW_TEST_FAILURE("Tiny DMA buffer v2 allocation after free failed.");
+
+        buffers[i] = std::get<tenstorrent_allocate_dma_buf_v2>(buf);
+        if (buffers[i].mmap_offset != *holes.begin())
+            THROW_TEST_FAILURE("DMA buffer v2 did not get the lowest free mmap offset.");
+        holes.erase(holes.begin());
+
+        VerifyMapDmaBufV2(dev_fd, buffers[i], i);
+    }
+
+    auto big = AllocateDmaBufV2(dev_fd, 2 * max_dma_buf_size, 0);
+    if (std::holds_alternative<int>(big))
+    {
+        if (std::get<int>(big) != ENOMEM)
+            THROW_TEST_FAILURE("Large DMA buffer v2 allocation failed for a reason other than ENOMEM.");
+    }
+    else
+    {
+        const auto &b = std::get<tenstorrent_allocate_dma_buf_v2>(big);
+        VerifyMapDmaBufV2(dev_fd, b, 1);
+
+        if (FreeDmaBufV2(dev_fd, b.handle) != 0)
+            THROW_TEST_FAILURE("Freeing a large DMA buffer v2 failed.");
+    }
+
+    // Explicitly on the device's own node, which must be online.
+    tenstorrent_allocate_dma_buf_v2 on_node;
+    zero(&on_node);
+    on_node.argsz = sizeof(on_node);
+    on_node.flags = TENSTORRENT_ALLOCATE_DMA_BUF_NUMA_NODE;
+    on_node.size = 4 * page_size();
+    on_node.numa_node = std::max(GetDeviceInfo(dev_fd).numa_node, 0);
+
+    if (ioctl(dev_fd, TENSTORRENT_IOCTL_ALLOCATE_DMA_BUF_V2, &on_node) != 0)
+        THROW_TEST_FAILURE("DMA buffer v2 allocation on an explicit NUMA node failed.");
+
+    VerifyMapDmaBufV2(dev_fd, on_node, 2);
+
+    if (FreeDmaBufV2(dev_fd, on_node.handle) != 0)
+        THROW_TEST_FAILURE("Freeing a DMA buffer v2 from an explicit NUMA node failed.");
+
+    if (!std::holds_alternative<int>(AllocateDmaBufV2(dev_fd, page_size() + 1, 0)))
+        THROW_TEST_FAILURE("DMA buffer v2 allocation with unaligned size was permitted unexpectedly.");
+
+    if (FreeDmaBufV2(dev_fd, 0) != EINVAL)
+        THROW_TEST_FAILURE("FREE_DMA_BUF_V2 accepted an ALLOCATE_DMA_BUF index.");
+
+    for (const auto &b : buffers)
+        if (FreeDmaBufV2(dev_fd, b.handle) != 0)
+            THROW_TEST_FAILURE("Freeing a DMA buffer v2 failed.");
+
+    if (FreeDmaBufV2(dev_fd, buffers[0].handle) != EINVAL)
+        THROW_TEST_FAILURE("Freeing a DMA buffer v2 twice did not fail with EINVAL.");
+}
+
+// Sequential write bandwidth through a mapping of a large buffer. The first
+// pass includes faulting the mapping in, which is where PMD mappings pay off;
+// the second shows the TLB reach. Also checks the data survives a remap.
+// Without an IOMMU, a large buffer is in the kernel's linear map and mapped
+// with PMDs on demand. PFN mappings aren't counted in AnonHugePages or
+// FilePmdMapped, so check that the VMA is THP-eligible instead: in madvise
+// mode that takes VM_HUGEPAGE, without which huge_fault is never called.
+void VerifyDmaBufHugeMapping(const EnumeratedDevice &dev)
+{
+    static const char thp_enabled[] = "/sys/kernel/mm/transparent_hugepage/enabled";
+    const std::size_t size = 4 * 1024 * 1024;
+
+    if (dev.iommu_translated || !kernel_version_at_least(6, 12) || access(thp_enabled, R_OK) != 0
+        || read_file(thp_enabled).find("[never]") != std::string::npos)
+    {
+        std::cout << "DMA buffers can't be mapped with PMDs here, VerifyDmaBufHugeMapping skipped.\n";
+        return;
+    }
+
+    DevFd dev_fd(dev.path);
+
+    auto buf = AllocateDmaBufV2(dev_fd.get(), size, 0);
+    if (std::holds_alternative<int>(buf))
+    {
+        std::cout << "No memory for VerifyDmaBufHugeMapping, test skipped.\n";
+        return;
+    }
+
+    const auto &b = std::get<tenstorrent_allocate_dma_buf_v2>(buf);
+
+    void *p = mmap(nullptr, b.size, PROT_READ | PROT_WRITE, MAP_SHARED, dev_fd.get(), b.mmap_offset);
+    if (p == MAP_FAILED)
+        THROW_TEST_FAILURE("Large DMA buffer mapping failed.");
+
+    static_cast<volatile unsigned char*>(p)[0] = 1;
+
+    // THPeligible is a flag, not a size, but smaps_kb parses it all the same.
+    bool eligible = smaps_kb(p, "THPeligible") == 1;
+
+    munmap(p, b.size);
+
+    if (!eligible)
+        THROW_TEST_FAILURE("Large DMA buffer mapping is not THP-eligible.");
+}
+
+// A private writable mapping is a COW mapping, which the PMD fault path can't
+// fill. It must still map, and faulting it in must not bring the kernel down.
+void VerifyPrivateDmaBufMapping(int dev_fd)
+{
+    const std::size_t size = 4 * 1024 * 1024;
+
+    auto buf = AllocateDmaBufV2(dev_fd, size, 0);
+    if (std::holds_alternative<int>(buf))
+    {
+        std::cout << "No memory for VerifyPrivateDmaBufMapping, test skipped.\n";
+        return;
+    }
+
+    const auto &b = std::get<tenstorrent_allocate_dma_buf_v2>(buf);
+
+    void *p = mmap(nullptr, b.size, PROT_READ | PROT_WRITE, MAP_PRIVATE, dev_fd, b.mmap_offset);
+    if (p == MAP_FAILED)
+        THROW_TEST_FAILURE("Private DMA buffer mapping failed.");
+
+    auto bytes = static_cast<volatile unsigned char*>(p);
+    for (std::size_t i = 0; i < b.size; i += page_size())
+    {
+        if (bytes[i] != 0)
+            THROW_TEST_FAILURE("Private DMA buffer mapping was not zeroed.");
+        bytes[i] = 1;
+    }
+
+    munmap(p, b.size);
+
+    if (FreeDmaBufV2(dev_fd, b.handle) != 0)
+        THROW_TEST_FAILURE("Freeing a privately mapped DMA buffer failed.");
+}
+
+void VerifyDmaBufWriteBandwidth(int dev_fd)
+{
+    const std::size_t size = 256 << 20;
+
+    auto buf = AllocateDmaBufV2(dev_fd, size, 0);
+    if (std::holds_alternative<int>(buf))
+    {
+        std::cout << "No memory for a 256MB DMA buffer, skipping bandwidth test.\n";
+        return;
+    }
+
+    const auto &b = std::get<tenstorrent_allocate_dma_buf_v2>(buf);
+
+    void *p = mmap(nullptr, b.size, PROT_READ | PROT_WRITE, MAP_SHARED, dev_fd, b.mmap_offset);
+    if (p == MAP_FAILED)
+        THROW_TEST_FAILURE("Large DMA buffer v2 mapping failed.");
+
+    for (unsigned int pass = 0; pass < 2; pass++)
+    {
+        auto start = std::chrono::steady_clock::now();
+        std::memset(p, pass + 1, b.size);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        std::cout << "DMA buffer write, " << (pass == 0 ? "first" : "second") << " pass: "
+                  << b.size / elapsed.count() / 1e9 << " GB/s\n";
+    }
+
+    munmap(p, b.size);
+
+    p = mmap(nullptr, b.size, PROT_READ, MAP_SHARED, dev_fd, b.mmap_offset);
+    if (p == MAP_FAILED)
+        THROW_TEST_FAILURE("Large DMA buffer v2 remapping failed.");
+
+    auto bytes = static_cast<const unsigned char*>(p);
+    for (std::size_t i = 0; i < b.size; i += page_size())
+        if (bytes[i] != 2)
+            THROW_TEST_FAILURE("Large DMA buffer v2 contents changed across mappings.");
+
+    munmap(p, b.size);
+
+    if (FreeDmaBufV2(dev_fd, b.handle) != 0)
+        THROW_TEST_FAILURE("Freeing a large DMA buffer v2 failed.");
+}
+
+// Returns the dma-buf fd, or -errno.
+int ExportDmaBuf(int dev_fd, std::uint32_t flags, std::uint32_t handle, std::uint64_t va, std::uint64_t size)
+{
+    tenstorrent_export_dma_buf export_dma_buf;
+    zero(&export_dma_buf);
+
+    export_dma_buf.argsz = sizeof(export_dma_buf);
+    export_dma_buf.flags = flags;
+    export_dma_buf.handle = handle;
+    export_dma_buf.virtual_address = va;
+    export_dma_buf.size = size;
+
+    if (ioctl(dev_fd, TENSTORRENT_IOCTL_EXPORT_DMA_BUF, &export_dma_buf) != 0)
+        return -errno;
+
+    return export_dma_buf.fd;
+}
+
+// Export a driver buffer and a pinning. The buffer must outlive being freed
+// by the fd that made it, and the pinning can't be unpinned while exported.
+void VerifyExportDmaBuf(int dev_fd)
+{
+    int bad = ExportDmaBuf(dev_fd, 0, 0, 0, 0);
+    if (bad == -EOPNOTSUPP)
+        return;
+
+    if (bad != -EINVAL)
+        THROW_TEST_FAILURE("Exporting an unallocated DMA buffer did not fail with EINVAL.");
+
+    auto buf = AllocateDmaBuf(dev_fd, page_size(), 0);
+    if (std::holds_alternative<int>(buf))
+        THROW_TEST_FAILURE("DMA buffer allocation failed.");
+
+    int dma_buf_fd = ExportDmaBuf(dev_fd, 0, 0, 0, 0);
+    if (dma_buf_fd < 0)
+        THROW_TEST_FAILURE("Exporting a DMA buffer failed.");
+
+    if (!(fcntl(dma_buf_fd, F_GETFD) & FD_CLOEXEC))
+        THROW_TEST_FAILURE("Exported DMA buffer fd is not close-on-exec.");
+
+    if (FreeDmaBuf(dev_fd, 0) != 0)
+        THROW_TEST_FAILURE("Freeing an exported DMA buffer failed.");
+
+    close(dma_buf_fd);
+
+    void *p = mmap(nullptr, page_size(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        THROW_TEST_FAILURE("Anonymous mapping for pinning failed.");
+
+    std::memset(p, 0, page_size());
+
+    tenstorrent_pin_pages pin_pages;
+    zero(&pin_pages);
+    pin_pages.in.output_size_bytes = sizeof(pin_pages.out);
+    pin_pages.in.virtual_address = reinterpret_cast<std::uintptr_t>(p);
+    pin_pages.in.size = page_size();
+
+    if (ioctl(dev_fd, TENSTORRENT_IOCTL_PIN_PAGES, &pin_pages) != 0)
+        THROW_TEST_FAILURE("Pinning a page to export failed.");
+
+    if (ExportDmaBuf(dev_fd, TENSTORRENT_EXPORT_DMA_BUF_PINNED_PAGES, 0,
+                     pin_pages.in.virtual_address, 2 * page_size()) != -EINVAL)
+        THROW_TEST_FAILURE("Exporting a pinning with the wrong size did not fail with EINVAL.");
+
+    dma_buf_fd = ExportDmaBuf(dev_fd, TENSTORRENT_EXPORT_DMA_BUF_PINNED_PAGES, 0,
+                              pin_pages.in.virtual_address, page_size());
+    if (dma_buf_fd < 0)
+        THROW_TEST_FAILURE("Exporting a pinning failed.");
+
+    tenstorrent_unpin_pages unpin_pages;
+    zero(&unpin_pages);
+    unpin_pages.in.virtual_address = pin_pages.in.virtual_address;
+    unpin_pages.in.size = page_size();
+
+    if (ioctl(dev_fd, TENSTORRENT_IOCTL_UNPIN_PAGES, &unpin_pages) != -1 || errno != EBUSY)
+        THROW_TEST_FAILURE("Unpinning an exported pinning did not fail with EBUSY.");
+
+    close(dma_buf_fd);
+
+    if (ioctl(dev_fd, TENSTORRENT_IOCTL_UNPIN_PAGES, &unpin_pages) != 0)
+        THROW_TEST_FAILURE("Unpinning a pinning after releasing its export failed.");
+
+    munmap(p, page_size());
+}
+
+// Import one of our own buffers through a dma-buf.
+void VerifyImportDmaBuf(int dev_fd)
+{
+    auto buf = AllocateDmaBuf(dev_fd, page_size(), 0);
+    if (std::holds_alternative<int>(buf))
+        THROW_TEST_FAILURE("DMA buffer allocation failed.");
+
+    int dma_buf_fd = ExportDmaBuf(dev_fd, 0, 0, 0, 0);
+    if (dma_buf_fd == -EOPNOTSUPP)
+        return;
+
+    if (dma_buf_fd < 0)
+        THROW_TEST_FAILURE("Exporting a DMA buffer to import failed.");
+
+    tenstorrent_import_dma_buf import_dma_buf;
+    zero(&import_dma_buf);
+    import_dma_buf.argsz = sizeof(import_dma_buf);
+    import_dma_buf.flags = TENSTORRENT_IMPORT_DMA_BUF_NOC_DMA;
+    import_dma_buf.fd = dma_buf_fd;
+
+    if (ioctl(dev_fd, TENSTORRENT_IOCTL_IMPORT_DMA_BUF, &import_dma_buf) != 0)
+        THROW_TEST_FAILURE("Importing a dma-buf failed.");
+
+    close(dma_buf_fd);
+
+    if (import_dma_buf.handle == 0 || import_dma_buf.size != page_size())
+        THROW_TEST_FAILURE("Imported dma-buf has the wrong handle or size.");
+
+    tenstorrent_unimport_dma_buf unimport_dma_buf;
+    zero(&unimport_dma_buf);
+    unimport_dma_buf.argsz = sizeof(unimport_dma_buf);
+    unimport_dma_buf.handle = import_dma_buf.handle;
+
+    if (ioctl(dev_fd, TENSTORRENT_IOCTL_UNIMPORT_DMA_BUF, &unimport_dma_buf) != 0)
+        THROW_TEST_FAILURE("Unimporting a dma-buf failed.");
+
+    if (ioctl(dev_fd, TENSTORRENT_IOCTL_UNIMPORT_DMA_BUF, &unimport_dma_buf) != -1 || errno != EINVAL)
+        THROW_TEST_FAILURE("Unimporting a dma-buf twice did not fail with EINVAL.");
+
+    if (FreeDmaBuf(dev_fd, 0) != 0)
+        THROW_TEST_FAILURE("Freeing an imported DMA buffer failed.");
+}
+
 // Allocate TENSTORRENT_MAX_DMA_BUFS tiny buffers.
 // Allocate two buffers both for the same buf_index.
 // Allocate for buf_index = TENSTORRENT_MAX_DMA_BUFS.
@@ -166,10 +606,29 @@ void TestDmaBuf(const EnumeratedDevice &dev)
     VerifyTooLargeIndexFails(dev_fd.get());
 
     VerifyBufferMapping(dev_fd.get(), buffers);
+
+    VerifyDmaBufV2(dev_fd.get(), max_dma_buf_size);
+
+    VerifyDmaBufHugeMapping(dev);
+
+    DevFd private_dev_fd(dev.path);
+    VerifyPrivateDmaBufMapping(private_dev_fd.get());
+
+    DevFd bandwidth_dev_fd(dev.path);
+    VerifyDmaBufWriteBandwidth(bandwidth_dev_fd.get());
 }
 
 void TestNocDmaBuf(const EnumeratedDevice &dev)
 {
     DevFd dev_fd(dev.path);
     VerifyMultipleNocMappedBuffers(dev_fd.get());
+
+    DevFd free_dev_fd(dev.path);
+    VerifyFreeDmaBuf(free_dev_fd.get());
+
+    DevFd export_dev_fd(dev.path);
+    VerifyExportDmaBuf(export_dev_fd.get());
+
+    DevFd import_dev_fd(dev.path);
+    VerifyImportDmaBuf(import_dev_fd.get());
 }
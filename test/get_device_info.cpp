@@ -3,6 +3,8 @@
 
 #include <string>
 
+#include <cstddef>
+
 #include <sys/ioctl.h>
 
 #include "ioctl.h"
@@ -63,4 +65,23 @@ void TestGetDeviceInfo(const EnumeratedDevice &dev)
 
     if (get_device_info.out.max_dma_buf_size_log2 > 63)
         THROW_TEST_FAILURE("max_dma_buf_size_log2 is improbably large for " + dev.path);
+
+    std::size_t numa_get_device_info_out
+        = offsetof(tenstorrent_get_device_info_out, local_cpus)
+          + sizeof(get_device_info.out.local_cpus);
+
+    if (get_device_info.out.output_size_bytes >= numa_get_device_info_out)
+    {
+        auto expected_numa_node = std::stol(read_file(sysfs_pci_dir + "/numa_node"));
+
+        if (get_device_info.out.numa_node != expected_numa_node)
+            THROW_TEST_FAILURE("Wrong NUMA node for " + dev.path);
+
+        bool any_local_cpu = false;
+        for (auto cpus : get_device_info.out.local_cpus)
+            any_local_cpu = any_local_cpu || cpus != 0;
+
+        if (!any_local_cpu)
+            THROW_TEST_FAILURE("No local CPUs for " + dev.path);
+    }
 }
@@ -26,6 +26,19 @@
 #define TENSTORRENT_IOCTL_FREE_TLB		_IO(TENSTORRENT_IOCTL_MAGIC, 12)
 #define TENSTORRENT_IOCTL_CONFIGURE_TLB		_IO(TENSTORRENT_IOCTL_MAGIC, 13)
 #define TENSTORRENT_IOCTL_SET_NOC_CLEANUP		_IO(TENSTORRENT_IOCTL_MAGIC, 14)
+#define TENSTORRENT_IOCTL_PIN_PAGES_BATCH		_IO(TENSTORRENT_IOCTL_MAGIC, 15)
+#define TENSTORRENT_IOCTL_UNPIN_PAGES_BATCH		_IO(TENSTORRENT_IOCTL_MAGIC, 16)
+#define TENSTORRENT_IOCTL_ALLOCATE_DMA_BUF_V2		_IO(TENSTORRENT_IOCTL_MAGIC, 17)
+#define TENSTORRENT_IOCTL_FREE_DMA_BUF_V2		_IO(TENSTORRENT_IOCTL_MAGIC, 18)
+#define TENSTORRENT_IOCTL_EXPORT_DMA_BUF		_IO(TENSTORRENT_IOCTL_MAGIC, 19)
+#define TENSTORRENT_IOCTL_IMPORT_DMA_BUF		_IO(TENSTORRENT_IOCTL_MAGIC, 20)
+#define TENSTORRENT_IOCTL_UNIMPORT_DMA_BUF		_IO(TENSTORRENT_IOCTL_MAGIC, 21)
+#define TENSTORRENT_IOCTL_SHARE_PINNING		_IO(TENSTORRENT_IOCTL_MAGIC, 22)
+#define TENSTORRENT_IOCTL_SYNC_PINNED_PAGES		_IO(TENSTORRENT_IOCTL_MAGIC, 23)
+#define TENSTORRENT_IOCTL_CONFIGURE_TLB_BATCH		_IO(TENSTORRENT_IOCTL_MAGIC, 24)
+#define TENSTORRENT_IOCTL_GET_TLB_CONFIG		_IO(TENSTORRENT_IOCTL_MAGIC, 25)
+#define TENSTORRENT_IOCTL_NOC_READ			_IO(TENSTORRENT_IOCTL_MAGIC, 26)
+#define TENSTORRENT_IOCTL_NOC_WRITE			_IO(TENSTORRENT_IOCTL_MAGIC, 27)
 
 // For tenstorrent_mapping.mapping_id. These are not array indices.
 #define TENSTORRENT_MAPPING_UNUSED		0
@@ -55,6 +68,9 @@ struct tenstorrent_get_device_info_out {
 	__u16 max_dma_buf_size_log2;	// Since 1.0
 	__u16 pci_domain;		// Since 1.23
 	__u16 reserved;
+	__s32 numa_node;		// Since 2.7, -1 if unknown
+	__u32 local_cpus[32];		// Since 2.7, bit i % 32 of local_cpus[i / 32] is CPU i
+					// CPUs 1024 and up are left out, see sysfs local_cpus
 };
 
 struct tenstorrent_get_device_info {
@@ -85,6 +101,7 @@ struct tenstorrent_query_mappings {
 
 // tenstorrent_allocate_dma_buf_in.flags
 #define TENSTORRENT_ALLOCATE_DMA_BUF_NOC_DMA 2
+#define TENSTORRENT_ALLOCATE_DMA_BUF_NUMA_NODE 4	// ALLOCATE_DMA_BUF_V2 only
 
 struct tenstorrent_allocate_dma_buf_in {
 	__u32 requested_size;
@@ -108,7 +125,12 @@ struct tenstorrent_allocate_dma_buf {
 	struct tenstorrent_allocate_dma_buf_out out;
 };
 
+// Frees the buffer once it is no longer mmapped, and the buffer index can be
+// reused immediately.
 struct tenstorrent_free_dma_buf_in {
+	__u8  buf_index;	// as passed to ALLOCATE_DMA_BUF
+	__u8  reserved0[3];
+	__u32 reserved1;
 };
 
 struct tenstorrent_free_dma_buf_out {
@@ -167,6 +189,38 @@ struct tenstorrent_reset_device {
 #define TENSTORRENT_PIN_PAGES_CONTIGUOUS 1	// app attests that the pages are physically contiguous
 #define TENSTORRENT_PIN_PAGES_NOC_DMA 2		// app wants to use the pages for NOC DMA
 #define TENSTORRENT_PIN_PAGES_NOC_TOP_DOWN 4	// NOC DMA will be allocated top-down (default is bottom-up)
+#define TENSTORRENT_PIN_PAGES_CACHED 8		// keep pinned after the last UNPIN_PAGES, see below
+#define TENSTORRENT_PIN_PAGES_RESUMABLE 16	// a signal interrupts the pin without losing progress, see below
+#define TENSTORRENT_PIN_PAGES_TO_DEVICE 32	// the device only reads the pages, see below
+#define TENSTORRENT_PIN_PAGES_FROM_DEVICE 64	// the device only writes the pages, see below
+
+// TENSTORRENT_PIN_PAGES_CACHED: the driver keeps the pinning, its IOVA and its
+// NOC address after the matching UNPIN_PAGES. A later PIN_PAGES with the same
+// VA, size and NOC flags returns the same addresses without pinning again.
+// Repeat pins nest; each needs its own UNPIN_PAGES. The cached pinning is
+// dropped once the VA range is unmapped or remapped, or when the fd is closed.
+// Fails with EOPNOTSUPP on kernels without mmu_interval_notifier.
+
+// TENSTORRENT_PIN_PAGES_RESUMABLE: for very large ranges. Pages are pinned in
+// chunks and a pending signal stops the pin between chunks. The pages pinned so
+// far stay pinned and the call fails with EINTR (or is restarted transparently
+// if the handler has SA_RESTART). bytes_pinned in the extended output reports
+// the progress. Repeating the call with the same VA, size and flags carries on
+// where it stopped. Each fd keeps at most one interrupted pin. It is dropped by
+// the next interrupted pin or when the fd is closed.
+
+// TENSTORRENT_PIN_PAGES_TO_DEVICE / FROM_DEVICE: at most one. The pages are
+// DMA-mapped for that direction only, which halves bounce buffering under
+// SWIOTLB. A TO_DEVICE pin works on read-only memory (e.g. a file mapped
+// PROT_READ) and never dirties the pages. Without either flag the mapping is
+// bidirectional. On hosts where DMA isn't cache-coherent, use
+// TENSTORRENT_IOCTL_SYNC_PINNED_PAGES around device access.
+//
+// A TO_DEVICE pin of a file mapping (shared, or private and not yet written)
+// pins the page cache pages themselves, so processes pinning the same file
+// share one copy. Device DAX files work the same way. Filesystem DAX pages
+// can't be pinned long-term and fail with EOPNOTSUPP; map the file without
+// DAX or copy it to anonymous memory.
 
 struct tenstorrent_pin_pages_in {
 	__u32 output_size_bytes;
@@ -182,9 +236,17 @@ struct tenstorrent_pin_pages_out {
 struct tenstorrent_pin_pages_out_extended {
 	__u64 physical_address;	// or IOVA
 	__u64 noc_address;
+	__u64 bytes_pinned;	// size on success, progress of an interrupted RESUMABLE pin
 };
 
-// unpinning subset of a pinned buffer is not supported
+// An UNPIN_PAGES range that doesn't match a pinning exactly must be a
+// page-aligned part of exactly one pinning. Those pages are unpinned and the
+// rest remains pinned as a head and/or tail, each unpinned separately later
+// with its own VA and size. Their DMA and NOC addresses are unchanged, but a
+// tail with a head needs another iATU region (ENOSPC if none is free).
+// Fails with EBUSY for a pinning pinned more than once or exported, and with
+// EOPNOTSUPP for TENSTORRENT_PIN_PAGES_CACHED pinnings, and when the IOMMU
+// translates on kernels before 6.17, which can only unmap a pinning as a whole.
 struct tenstorrent_unpin_pages_in {
 	__u64 virtual_address;	// original VA used to pin, not current VA if remapped
 	__u64 size;
@@ -336,5 +398,374 @@ struct tenstorrent_set_noc_cleanup {
 	__u64 data;
 };
 
+// Largest tenstorrent_pin_pages_batch.count / tenstorrent_unpin_pages_batch.count.
+#define TENSTORRENT_PAGES_BATCH_MAX 4096
+
+struct tenstorrent_pin_pages_batch_entry {
+	struct tenstorrent_pin_pages_in in;	// in.output_size_bytes is ignored
+	struct tenstorrent_pin_pages_out_extended out;
+	__s32 status;				// 0 or negative errno
+	__u32 reserved;
+};
+
+/**
+ * TENSTORRENT_IOCTL_PIN_PAGES_BATCH - Pin many ranges in one call
+ *
+ * Equivalent to one TENSTORRENT_IOCTL_PIN_PAGES per entry, but the driver
+ * takes its locks once for the whole batch and programs all the iATU regions
+ * for TENSTORRENT_PIN_PAGES_NOC_DMA entries together.
+ *
+ * Every entry's in is checked before anything is pinned. If any is malformed,
+ * the call fails with EINVAL, nothing is pinned, and status identifies the bad
+ * entries. Otherwise the call succeeds and each entry reports its own result
+ * in status; out is valid only where status is 0. Successful entries are
+ * undone with TENSTORRENT_IOCTL_UNPIN_PAGES or UNPIN_PAGES_BATCH as usual.
+ * An entry with the same VA and size as an earlier entry of the same batch
+ * fails with EEXIST, even if both are TENSTORRENT_PIN_PAGES_CACHED.
+ *
+ * @argsz: Must be sizeof(struct tenstorrent_pin_pages_batch).
+ * @flags: Reserved for future use, must be 0.
+ * @count: Number of entries, 1 to TENSTORRENT_PAGES_BATCH_MAX.
+ * @entries: User pointer to count struct tenstorrent_pin_pages_batch_entry.
+ */
+struct tenstorrent_pin_pages_batch {
+	__u32 argsz;
+	__u32 flags;
+	__u32 count;
+	__u32 reserved;
+	__u64 entries;
+};
+
+struct tenstorrent_unpin_pages_batch_entry {
+	struct tenstorrent_unpin_pages_in in;
+	__s32 status;				// 0 or negative errno
+	__u32 reserved;
+};
+
+/**
+ * TENSTORRENT_IOCTL_UNPIN_PAGES_BATCH - Unpin many ranges in one call
+ *
+ * Equivalent to one TENSTORRENT_IOCTL_UNPIN_PAGES per entry. Each entry
+ * reports its own result in status; the call itself fails only if the
+ * argument or the entry array can't be read or written.
+ *
+ * @argsz: Must be sizeof(struct tenstorrent_unpin_pages_batch).
+ * @flags: Reserved for future use, must be 0.
+ * @count: Number of entries, 1 to TENSTORRENT_PAGES_BATCH_MAX.
+ * @entries: User pointer to count struct tenstorrent_unpin_pages_batch_entry.
+ */
+struct tenstorrent_unpin_pages_batch {
+	__u32 argsz;
+	__u32 flags;
+	__u32 count;
+	__u32 reserved;
+	__u64 entries;
+};
+
+/**
+ * TENSTORRENT_IOCTL_ALLOCATE_DMA_BUF_V2 - Allocate a driver-owned DMA buffer
+ *
+ * Like TENSTORRENT_IOCTL_ALLOCATE_DMA_BUF, without its limits on buffer size
+ * and count: the driver picks the handle and the mmap offset. Behind an IOMMU,
+ * large buffers are made of discontiguous pages mapped to one contiguous IOVA
+ * range, so only the IOVA space limits their size.
+ *
+ * Freed with TENSTORRENT_IOCTL_FREE_DMA_BUF_V2 or when the fd is closed, in
+ * either case once the buffer is no longer mmapped.
+ *
+ * mmap offsets stay below PAGE_SIZE << 32, in reach of 32-bit mmap2. An fd's
+ * buffers share that space (almost 15 TiB with 4K pages); fails with ENOSPC
+ * when there's no room left for another.
+ *
+ * Buffers are allocated on the device's NUMA node (see GET_DEVICE_INFO) unless
+ * TENSTORRENT_ALLOCATE_DMA_BUF_NUMA_NODE asks for another. Without an IOMMU,
+ * such buffers must fit in one physically contiguous block.
+ *
+ * @argsz: Must be sizeof(struct tenstorrent_allocate_dma_buf_v2).
+ * @flags: TENSTORRENT_ALLOCATE_DMA_BUF_NOC_DMA, TENSTORRENT_ALLOCATE_DMA_BUF_NUMA_NODE.
+ * @size: [in] Buffer size in bytes, a nonzero multiple of the page size.
+ * @numa_node: [in] With TENSTORRENT_ALLOCATE_DMA_BUF_NUMA_NODE, the online
+ *             node to allocate on. Otherwise 0.
+ * @handle: [out] Identifies the buffer to FREE_DMA_BUF_V2.
+ * @mmap_offset: [out] Offset to mmap the buffer at.
+ * @dma_address: [out] Physical address or IOVA of the buffer.
+ * @noc_address: [out] Valid if TENSTORRENT_ALLOCATE_DMA_BUF_NOC_DMA is set.
+ */
+struct tenstorrent_allocate_dma_buf_v2 {
+	__u32 argsz;
+	__u32 flags;
+	__u64 size;
+	__u32 numa_node;
+	__u32 handle;
+	__u64 mmap_offset;
+	__u64 dma_address;
+	__u64 noc_address;
+};
+
+/**
+ * TENSTORRENT_IOCTL_FREE_DMA_BUF_V2 - Free a buffer from ALLOCATE_DMA_BUF_V2
+ *
+ * The handle is invalid immediately, but the memory is released once the
+ * buffer is no longer mmapped.
+ *
+ * @argsz: Must be sizeof(struct tenstorrent_free_dma_buf_v2).
+ * @flags: Reserved for future use, must be 0.
+ * @handle: As returned by ALLOCATE_DMA_BUF_V2.
+ */
+struct tenstorrent_free_dma_buf_v2 {
+	__u32 argsz;
+	__u32 flags;
+	__u32 handle;
+	__u32 reserved;
+};
+
+// tenstorrent_export_dma_buf.flags
+#define TENSTORRENT_EXPORT_DMA_BUF_PINNED_PAGES	1
+
+/**
+ * TENSTORRENT_IOCTL_EXPORT_DMA_BUF - Share memory with other drivers
+ *
+ * Wraps a buffer from ALLOCATE_DMA_BUF or ALLOCATE_DMA_BUF_V2, or a range
+ * pinned by PIN_PAGES, in a new dma-buf fd. Other drivers (RDMA NICs, video
+ * decoders, ...) can import it and DMA into the memory directly.
+ *
+ * The dma-buf keeps the memory alive and this fd open until it is released.
+ * An exported driver buffer outlives FREE_DMA_BUF. The UNPIN_PAGES that would
+ * undo an exported pinning's last PIN_PAGES fails with EBUSY instead, so the
+ * pages stay pinned. The dma-buf doesn't support mmap; use the original
+ * mapping. Importing an exported buffer into the same fd with IMPORT_DMA_BUF
+ * makes a reference cycle that only UNIMPORT_DMA_BUF breaks.
+ *
+ * Fails with EOPNOTSUPP if the kernel is older than 5.10 or lacks dma-buf
+ * support.
+ *
+ * @argsz: Must be sizeof(struct tenstorrent_export_dma_buf).
+ * @flags: 0 to export a driver buffer, TENSTORRENT_EXPORT_DMA_BUF_PINNED_PAGES
+ *         to export a pinning.
+ * @handle: [in] buf_index or ALLOCATE_DMA_BUF_V2 handle, 0 for a pinning.
+ * @fd: [out] The new dma-buf fd, opened close-on-exec.
+ * @virtual_address: [in] For a pinning, as passed to PIN_PAGES, otherwise 0.
+ * @size: [in] For a pinning, as passed to PIN_PAGES, otherwise 0.
+ */
+struct tenstorrent_export_dma_buf {
+	__u32 argsz;
+	__u32 flags;
+	__u32 handle;
+	__s32 fd;
+	__u64 virtual_address;
+	__u64 size;
+};
+
+// tenstorrent_import_dma_buf.flags
+#define TENSTORRENT_IMPORT_DMA_BUF_NOC_DMA	1
+
+/**
+ * TENSTORRENT_IOCTL_IMPORT_DMA_BUF - Make another driver's dma-buf device-visible
+ *
+ * The PIN_PAGES equivalent for memory exported by other drivers (udmabuf,
+ * NICs, other accelerators). Attaches the dma-buf to the device, and maps it
+ * for DMA and optionally for NOC access. The buffer must map to a single
+ * contiguous DMA range, which in practice needs an IOMMU unless the exporter
+ * allocated physically contiguous memory; otherwise the call fails with
+ * EINVAL.
+ *
+ * The import holds its own reference to the dma-buf; fd may be closed
+ * afterwards. Undo with TENSTORRENT_IOCTL_UNIMPORT_DMA_BUF or by closing the
+ * device fd.
+ *
+ * Fails with EOPNOTSUPP where TENSTORRENT_IOCTL_EXPORT_DMA_BUF does.
+ *
+ * @argsz: Must be sizeof(struct tenstorrent_import_dma_buf).
+ * @flags: TENSTORRENT_IMPORT_DMA_BUF_NOC_DMA or 0.
+ * @fd: [in] dma-buf fd to import.
+ * @handle: [out] Identifies the import to UNIMPORT_DMA_BUF, never 0.
+ * @size: [out] Size of the dma-buf in bytes.
+ * @dma_address: [out] Physical address or IOVA of the buffer.
+ * @noc_address: [out] Valid if TENSTORRENT_IMPORT_DMA_BUF_NOC_DMA is set.
+ */
+struct tenstorrent_import_dma_buf {
+	__u32 argsz;
+	__u32 flags;
+	__s32 fd;
+	__u32 handle;
+	__u64 size;
+	__u64 dma_address;
+	__u64 noc_address;
+};
+
+/**
+ * TENSTORRENT_IOCTL_UNIMPORT_DMA_BUF - Undo TENSTORRENT_IOCTL_IMPORT_DMA_BUF
+ *
+ * @argsz: Must be sizeof(struct tenstorrent_unimport_dma_buf).
+ * @flags: Reserved for future use, must be 0.
+ * @handle: As returned by IMPORT_DMA_BUF.
+ */
+struct tenstorrent_unimport_dma_buf {
+	__u32 argsz;
+	__u32 flags;
+	__u32 handle;
+	__u32 reserved;
+};
+
+// Largest tenstorrent_share_pinning.count.
+#define TENSTORRENT_SHARE_PINNING_MAX_PEERS 256
+
+struct tenstorrent_share_pinning_peer {
+	__s32 fd;		// [in] device fd to share with
+	__s32 status;		// [out] 0 or negative errno
+	__u64 dma_address;	// [out] physical address or IOVA for the peer device
+	__u64 noc_address;	// [out] valid if a NOC_DMA flag was given
+};
+
+/**
+ * TENSTORRENT_IOCTL_SHARE_PINNING - Map a pinned range to other devices
+ *
+ * Makes a range pinned by PIN_PAGES on this fd DMA-able by other devices
+ * without pinning it again. Each peer fd gets its own pinning of the same VA
+ * and size, as if PIN_PAGES had been called on it: it has its own DMA mapping
+ * and iATU region, and is undone by UNPIN_PAGES on the peer fd or by closing
+ * it. The pages stay pinned until the original pinning and all of its peers
+ * are gone, in any order. A shared pinning can only be unpinned whole.
+ *
+ * Each peer reports its own result in status; out fields are valid only where
+ * it is 0. A peer fails with EINVAL if it is not a device fd or is for the
+ * same device as this fd, and with EEXIST if it already has a pinning of the
+ * range. The call itself fails with EINVAL if the range is not pinned on
+ * this fd.
+ *
+ * @argsz: Must be sizeof(struct tenstorrent_share_pinning).
+ * @flags: TENSTORRENT_PIN_PAGES_NOC_DMA or TENSTORRENT_PIN_PAGES_NOC_TOP_DOWN
+ *         to give each peer pinning an iATU region, or 0.
+ * @virtual_address: As passed to PIN_PAGES.
+ * @size: As passed to PIN_PAGES.
+ * @count: Number of peers, 1 to TENSTORRENT_SHARE_PINNING_MAX_PEERS.
+ * @peers: User pointer to count struct tenstorrent_share_pinning_peer.
+ */
+struct tenstorrent_share_pinning {
+	__u32 argsz;
+	__u32 flags;
+	__u64 virtual_address;
+	__u64 size;
+	__u32 count;
+	__u32 reserved;
+	__u64 peers;
+};
+
+// tenstorrent_sync_pinned_pages.flags, exactly one
+#define TENSTORRENT_SYNC_PINNED_PAGES_FOR_DEVICE	1
+#define TENSTORRENT_SYNC_PINNED_PAGES_FOR_CPU		2
+
+/**
+ * TENSTORRENT_IOCTL_SYNC_PINNED_PAGES - Hand a pinning between CPU and device
+ *
+ * FOR_DEVICE makes CPU writes visible to the device before it reads the
+ * pages. FOR_CPU makes device writes visible to the CPU after the device is
+ * done. Needed on hosts where DMA isn't cache-coherent or is bounced through
+ * SWIOTLB; elsewhere it does nothing and costs little. A sync in a direction
+ * the pinning doesn't allow (FOR_CPU on a TO_DEVICE pin, FOR_DEVICE on a
+ * FROM_DEVICE pin) does nothing.
+ *
+ * @argsz: Must be sizeof(struct tenstorrent_sync_pinned_pages).
+ * @flags: TENSTORRENT_SYNC_PINNED_PAGES_FOR_DEVICE or _FOR_CPU.
+ * @virtual_address: As passed to PIN_PAGES.
+ * @size: As passed to PIN_PAGES.
+ */
+struct tenstorrent_sync_pinned_pages {
+	__u32 argsz;
+	__u32 flags;
+	__u64 virtual_address;
+	__u64 size;
+};
+
+// Largest tenstorrent_configure_tlb_batch.count.
+#define TENSTORRENT_CONFIGURE_TLB_BATCH_MAX	TENSTORRENT_MAX_INBOUND_TLBS
+
+struct tenstorrent_configure_tlb_batch_entry {
+	__u32 id;				// as returned by ALLOCATE_TLB
+	__s32 status;				// [out] 0 or negative errno
+	struct tenstorrent_noc_tlb_config config;
+};
+
+/**
+ * TENSTORRENT_IOCTL_CONFIGURE_TLB_BATCH - Configure many TLB windows in one call
+ *
+ * Equivalent to one TENSTORRENT_IOCTL_CONFIGURE_TLB per entry, in order, but
+ * the register writes for all entries are issued back to back.
+ *
+ * Every entry's id is checked before anything is configured. If any is out
+ * of range or not allocated on this fd, the call fails with EINVAL or EPERM,
+ * no window is touched, and status identifies the bad entries. Otherwise the
+ * call succeeds and each entry reports its own result in status, e.g. EINVAL
+ * for a config the window can't express.
+ *
+ * @argsz: Must be sizeof(struct tenstorrent_configure_tlb_batch).
+ * @flags: Reserved for future use, must be 0.
+ * @count: Number of entries, 1 to TENSTORRENT_CONFIGURE_TLB_BATCH_MAX.
+ * @entries: User pointer to count struct tenstorrent_configure_tlb_batch_entry.
+ */
+struct tenstorrent_configure_tlb_batch {
+	__u32 argsz;
+	__u32 flags;
+	__u32 count;
+	__u32 reserved;
+	__u64 entries;
+};
+
+/**
+ * TENSTORRENT_IOCTL_GET_TLB_CONFIG - Read back a TLB window's configuration
+ *
+ * Returns the config last set by CONFIGURE_TLB or CONFIGURE_TLB_BATCH. The
+ * driver keeps it per window, skips the register writes when a window is
+ * configured again with an identical config, and reprograms every configured
+ * window after TENSTORRENT_RESET_DEVICE_RESTORE_STATE or POST_RESET.
+ *
+ * Fails with EPERM if the window isn't allocated on this fd, and with ENODATA
+ * if it hasn't been configured since it was allocated.
+ *
+ * @argsz: Must be sizeof(struct tenstorrent_get_tlb_config).
+ * @flags: Reserved for future use, must be 0.
+ * @id: [in] As returned by ALLOCATE_TLB.
+ * @config: [out] The window's current configuration.
+ */
+struct tenstorrent_get_tlb_config {
+	__u32 argsz;
+	__u32 flags;
+	__u32 id;
+	__u32 reserved;
+	struct tenstorrent_noc_tlb_config config;
+};
+
+/**
+ * TENSTORRENT_IOCTL_NOC_READ / TENSTORRENT_IOCTL_NOC_WRITE - Copy to or from a NOC endpoint
+ *
+ * Reads or writes size bytes at addr on tile (x, y) through a window owned by
+ * the driver, so no TLB needs to be allocated, configured or mapped. Meant for
+ * tools and light clients; bulk data paths should map their own TLB windows.
+ * Large transfers are split into window-sized pieces and may be interrupted
+ * by a fatal signal, leaving part of the range copied.
+ *
+ * Fails with EOPNOTSUPP if the device doesn't support it.
+ *
+ * @argsz: Must be sizeof(struct tenstorrent_noc_rw).
+ * @flags: Reserved for future use, must be 0.
+ * @x: X coordinate of the NOC tile.
+ * @y: Y coordinate of the NOC tile.
+ * @noc: NOC to use; must be 0 or 1.
+ * @addr: NOC address; must be 4-byte aligned.
+ * @buffer: User pointer to size bytes, read into or written from.
+ * @size: Bytes to copy; must be a nonzero multiple of 4.
+ */
+struct tenstorrent_noc_rw {
+	__u32 argsz;
+	__u32 flags;
+	__u8 x;
+	__u8 y;
+	__u8 noc;
+	__u8 reserved0;
+	__u32 reserved1;
+	__u64 addr;
+	__u64 buffer;
+	__u64 size;
+};
 
 #endif
@@ -135,7 +135,8 @@ void TestFreeDmaBufOverrun(int fd)
 {
     tenstorrent_free_dma_buf free_buf{};
 
-    CHECK_IOCTL_OVERRUN_ERROR(fd, TENSTORRENT_IOCTL_FREE_DMA_BUF, free_buf, EINVAL);
+    // Frees the buffer from TestAllocateDmaBufOverrun.
+    CHECK_IOCTL_OVERRUN(fd, TENSTORRENT_IOCTL_FREE_DMA_BUF, free_buf);
 }
 
 void TestGetDriverInfoOverrun(int fd)
@@ -20,7 +20,9 @@ void TestHwmon(const EnumeratedDevice &dev);
 void TestIoctlOverrun(const EnumeratedDevice &dev);
 void TestIoctlZeroing(const EnumeratedDevice &dev);
 void TestMapPeerBar(const EnumeratedDevice &dev1, const EnumeratedDevice &dev2);
+void TestSharePinning(const EnumeratedDevice &dev1, const EnumeratedDevice &dev2);
 void TestTlbs(const EnumeratedDevice &dev);
+void TestTlbReset(const EnumeratedDevice &dev);
 void TestDeviceRelease(const EnumeratedDevice &dev);
 void TestMappingsDebugfs(const EnumeratedDevice &dev);
 void TestProcfsPids(const EnumeratedDevice &dev);
@@ -32,7 +34,15 @@ int main(int argc, char *argv[])
     // When running inside a VM aer seems to be disabled, this argument skips that check
     // so the rest of the tests will run.
     bool check_aer = true;
-    if (argc >= 2 && argv[1] == std::string("--skip-aer")) { check_aer = false; }
+
+    // Tests that reset the device are only run with --reset.
+    bool test_reset = false;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (argv[i] == std::string("--skip-aer")) { check_aer = false; }
+        if (argv[i] == std::string("--reset")) { test_reset = true; }
+    }
 
     auto devs = EnumerateDevices();
     for (const auto &d : devs)
@@ -51,6 +61,8 @@ int main(int argc, char *argv[])
         TestIoctlOverrun(d);
         TestIoctlZeroing(d);
         TestTlbs(d);
+        if (test_reset)
+            TestTlbReset(d);
         TestMappingsDebugfs(d);
         TestProcfsPids(d);
         TestDeviceRelease(d);
@@ -63,6 +75,7 @@ int main(int argc, char *argv[])
         for (unsigned int j = 0; j < devs.size(); j++)
         {
             TestMapPeerBar(devs[i], devs[j]);
+            TestSharePinning(devs[i], devs[j]);
         }
     }
 
@@ -9,6 +9,13 @@
 // Verify that pin pages can simultaneously pin many ranges.
 // Verify that pin pages can pin multiple pages if they are contiguous.
 // Verify that pin pages can pin discontiguous memory if and only if IOMMU is enabled.
+// Verify that a THP pins as one contiguous range, and not once two of its pages are swapped.
+// Verify that a cached pinning is reused by a repeat pin and that repeat pins nest.
+// Verify that a resumable pin reports the bytes pinned.
+// Verify that unpinning the middle of a pinning leaves a head and tail that unpin separately.
+// Verify that batch pin/unpin report per-entry results and reject a malformed batch up front.
+// Verify that a TO_DEVICE pin accepts read-only memory and can be synced, and that both directions are rejected.
+// Verify that a read-only file mapping can be pinned TO_DEVICE from two fds, but not for writing.
 
 #include <iostream>
 #include <memory>
@@ -19,6 +26,9 @@
 #include <cmath>
 #include <cstddef>
 #include <cstdlib>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -256,6 +266,64 @@ void VerifyPinPagesContiguous(const EnumeratedDevice &dev)
     }
 }
 
+void VerifyPinPagesTransparentHuge(const EnumeratedDevice &dev)
+{
+    const std::size_t huge_size = 2 * 1024 * 1024;
+    auto page_size = getpagesize();
+
+    // Twice the size, so a huge-page-aligned range fits inside.
+    void *m = mmap(nullptr, 2 * huge_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (m == MAP_FAILED)
+        throw_system_error("THP test mapping failed.");
+
+    std::unique_ptr<void, Unmapper> mapping(m, Unmapper{2 * huge_size / page_size});
+    auto huge = reinterpret_cast<unsigned char *>(round_up(reinterpret_cast<uintptr_t>(m), huge_size));
+
+    madvise(huge, huge_size, MADV_HUGEPAGE);
+    std::memset(huge, 1, huge_size);
+
+    if (smaps_kb(huge, "AnonHugePages") * 1024 < huge_size)
+    {
+        std::cout << "No transparent huge page could be allocated for VerifyPinPagesTransparentHuge, test skipped.\n";
+        return;
+    }
+
+    auto pin = [&]()
+    {
+        DevFd dev_fd(dev.path);
+
+        struct tenstorrent_pin_pages pin_pages;
+        zero(&pin_pages);
+        pin_pages.in.output_size_bytes = sizeof(pin_pages.out);
+        pin_pages.in.flags = TENSTORRENT_PIN_PAGES_CONTIGUOUS;
+        pin_pages.in.virtual_address = reinterpret_cast<uintptr_t>(huge);
+        pin_pages.in.size = huge_size;
+
+        return ioctl(dev_fd.get(), TENSTORRENT_IOCTL_PIN_PAGES, &pin_pages) == 0;
+    };
+
+    if (!pin())
+        THROW_TEST_FAILURE("PIN_PAGES failed on a transparent huge page.");
+
+    // Swap pages 1 and 2. The folio is still one physically contiguous block,
+    // but the range no longer maps it in order.
+    unsigned char *page1 = huge + page_size;
+    unsigned char *page2 = huge + 2 * page_size;
+
+    void *spare = mmap(nullptr, page_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (spare == MAP_FAILED)
+        throw_system_error("THP test spare page mapping failed.");
+
+    if (mremap(page1, page_size, page_size, MREMAP_MAYMOVE | MREMAP_FIXED, spare) == MAP_FAILED
+        || mremap(page2, page_size, page_size, MREMAP_MAYMOVE | MREMAP_FIXED, page1) == MAP_FAILED
+        || mremap(spare, page_size, page_size, MREMAP_MAYMOVE | MREMAP_FIXED, page2) == MAP_FAILED)
+        throw_system_error("Swapping pages of a THP failed.");
+
+    // Without an IOMMU the device would see the pages in folio order.
+    if (!dev.iommu_translated && pin())
+        THROW_TEST_FAILURE("PIN_PAGES treated a THP mapped out of order as contiguous.");
+}
+
 void VerifyPinPagesNotContiguous(const EnumeratedDevice &dev)
 {
     // How do we get 2 pages that are not physically contiguous?
@@ -432,6 +500,331 @@ void VerifyUnpinPagesBadSize(const EnumeratedDevice &dev)
     }
 }
 
+void VerifyPinPagesCached(const EnumeratedDevice &dev)
+{
+    auto page_size = getpagesize();
+
+    struct {
+        tenstorrent_pin_pages_in in;
+        tenstorrent_pin_pages_out_extended out;
+    } pin_pages;
+    struct tenstorrent_unpin_pages unpin_pages;
+
+    void *p = std::aligned_alloc(page_size, page_size);
+    std::unique_ptr<void, Freer> page(p);
+
+    DevFd dev_fd(dev.path);
+
+    auto pin = [&]() {
+        zero(&pin_pages);
+        pin_pages.in.output_size_bytes = sizeof(pin_pages.out);
+        pin_pages.in.flags = TENSTORRENT_PIN_PAGES_CONTIGUOUS | TENSTORRENT_PIN_PAGES_CACHED;
+        pin_pages.in.virtual_address = reinterpret_cast<uintptr_t>(page.get());
+        pin_pages.in.size = page_size;
+
+        return ioctl(dev_fd.get(), TENSTORRENT_IOCTL_PIN_PAGES, &pin_pages);
+    };
+
+    auto unpin = [&]() {
+        zero(&unpin_pages);
+        unpin_pages.in.virtual_address = reinterpret_cast<uintptr_t>(page.get());
+        unpin_pages.in.size = page_size;
+
+        return ioctl(dev_fd.get(), TENSTORRENT_IOCTL_UNPIN_PAGES, &unpin_pages);
+    };
+
+    if (pin() != 0)
+    {
+        if (errno == EOPNOTSUPP)
+        {
+            std::cout << "Kernel does not support TENSTORRENT_PIN_PAGES_CACHED, VerifyPinPagesCached skipped.\n";
+            return;
+        }
+        THROW_TEST_FAILURE("PIN_PAGES failed cached single-page pin.");
+    }
+
+    auto address = pin_pages.out.physical_address;
+
+    if (pin() != 0)
+        THROW_TEST_FAILURE("PIN_PAGES failed repeat cached pin.");
+
+    if (pin_pages.out.physical_address != address)
+        THROW_TEST_FAILURE("Repeat cached pin returned a different address.");
+
+    if (unpin() != 0 || unpin() != 0)
+        THROW_TEST_FAILURE("UNPIN_PAGES failed on nested cached pins.");
+
+    if (unpin() != -1)
+        THROW_TEST_FAILURE("UNPIN_PAGES succeeded on a cached pinning with no outstanding pins.");
+
+    if (pin() != 0)
+        THROW_TEST_FAILURE("PIN_PAGES failed to reuse idle cached pinning.");
+
+    if (pin_pages.out.physical_address != address)
+        THROW_TEST_FAILURE("Reused cached pinning returned a different address.");
+}
+
+void VerifyPinPagesResumable(const EnumeratedDevice &dev)
+{
+    auto page_size = getpagesize();
+
+    struct {
+        tenstorrent_pin_pages_in in;
+        tenstorrent_pin_pages_out_extended out;
+    } pin_pages;
+
+    void *p = std::aligned_alloc(page_size, page_size);
+    std::unique_ptr<void, Freer> page(p);
+
+    DevFd dev_fd(dev.path);
+
+    zero(&pin_pages);
+    pin_pages.in.output_size_bytes = sizeof(pin_pages.out);
+    pin_pages.in.flags = TENSTORRENT_PIN_PAGES_CONTIGUOUS | TENSTORRENT_PIN_PAGES_RESUMABLE;
+    pin_pages.in.virtual_address = reinterpret_cast<uintptr_t>(page.get());
+    pin_pages.in.size = page_size;
+
+    if (ioctl(dev_fd.get(), TENSTORRENT_IOCTL_PIN_PAGES, &pin_pages) != 0)
+        THROW_TEST_FAILURE("PIN_PAGES failed with TENSTORRENT_PIN_PAGES_RESUMABLE.");
+
+    if (pin_pages.out.bytes_pinned != static_cast<std::uint64_t>(page_size))
+        THROW_TEST_FAILURE("PIN_PAGES reported " + std::to_string(pin_pages.out.bytes_pinned) + " bytes pinned, expected one page.");
+}
+
+void VerifyUnpinPagesSubrange(const EnumeratedDevice &dev)
+{
+    // Without IOMMU, a multi-page pinning must be physically contiguous, so use a hugepage.
+    auto page_size = getpagesize();
+    std::size_t size = dev.iommu_translated ? 3 * page_size : 2 * 1024 * 1024;
+
+    int huge_flag = dev.iommu_translated ? 0 : MAP_HUGETLB;
+    void *m = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | huge_flag, -1, 0);
+    if (m == MAP_FAILED)
+    {
+        std::cout << "No huge pages could be allocated for VerifyUnpinPagesSubrange, test skipped.\n";
+        return;
+    }
+
+    std::unique_ptr<unsigned char, Unmapper> mapping(static_cast<unsigned char*>(m), Unmapper{size / page_size});
+    auto va = reinterpret_cast<uintptr_t>(mapping.get());
+
+    DevFd dev_fd(dev.path);
+
+    struct tenstorrent_pin_pages pin_pages;
+    zero(&pin_pages);
+    pin_pages.in.output_size_bytes = sizeof(pin_pages.out);
+    pin_pages.in.flags = dev.iommu_translated ? 0 : TENSTORRENT_PIN_PAGES_CONTIGUOUS;
+    pin_pages.in.virtual_address = va;
+    pin_pages.in.size = size;
+
+    if (ioctl(dev_fd.get(), TENSTORRENT_IOCTL_PIN_PAGES, &pin_pages) != 0)
+        THROW_TEST_FAILURE("PIN_PAGES failed for VerifyUnpinPagesSubrange.");
+
+    auto unpin = [&](uintptr_t start, std::size_t length)
+    {
+        struct tenstorrent_unpin_pages unpin_pages;
+        zero(&unpin_pages);
+        unpin_pages.in.virtual_address = start;
+        unpin_pages.in.size = length;
+        return ioctl(dev_fd.get(), TENSTORRENT_IOCTL_UNPIN_PAGES, &unpin_pages);
+    };
+
+    // Unaligned sub-range.
+    if (unpin(va + page_size / 2, page_size) == 0)
+        THROW_TEST_FAILURE("UNPIN_PAGES accepted an unaligned sub-range.");
+
+    if (unpin(va + page_size, page_size) != 0)
+    {
+        // Only kernels with the dma_iova API can split an IOMMU mapping.
+        if (dev.iommu_translated && errno == EOPNOTSUPP && !kernel_version_at_least(6, 17))
+            return;
+
+        THROW_TEST_FAILURE("UNPIN_PAGES failed to unpin the middle of a pinning.");
+    }
+
+    // The original range is gone.
+    if (unpin(va, size) == 0)
+        THROW_TEST_FAILURE("UNPIN_PAGES unpinned the original range after a split.");
+
+    if (unpin(va, page_size) != 0)
+        THROW_TEST_FAILURE("UNPIN_PAGES failed to unpin the head of a split pinning.");
+
+    if (unpin(va + 2 * page_size, size - 2 * page_size) != 0)
+        THROW_TEST_FAILURE("UNPIN_PAGES failed to unpin the tail of a split pinning.");
+}
+
+void VerifyPinPagesBatch(const EnumeratedDevice &dev)
+{
+    const unsigned int count = 64;
+
+    auto page_size = getpagesize();
+
+    void *p = std::aligned_alloc(page_size, page_size * count);
+    std::unique_ptr<void, Freer> pages(p);
+
+    DevFd dev_fd(dev.path);
+
+    std::vector<tenstorrent_pin_pages_batch_entry> entries(count);
+    for (unsigned int i = 0; i < count; i++)
+    {
+        zero(&entries[i]);
+        entries[i].in.virtual_address = reinterpret_cast<uintptr_t>(pages.get()) + page_size * i;
+        entries[i].in.size = page_size;
+    }
+
+    tenstorrent_pin_pages_batch batch;
+    zero(&batch);
+    batch.argsz = sizeof(batch);
+    batch.count = count;
+    batch.entries = reinterpret_cast<uintptr_t>(entries.data());
+
+    // One bad entry fails the whole batch and pins nothing.
+    entries[count - 1].in.size = 0;
+
+    if (ioctl(dev_fd.get(), TENSTORRENT_IOCTL_PIN_PAGES_BATCH, &batch) == 0 || errno != EINVAL)
+        THROW_TEST_FAILURE("PIN_PAGES_BATCH accepted a malformed entry.");
+
+    if (entries[count - 1].status != -EINVAL || entries[0].status != 0)
+        THROW_TEST_FAILURE("PIN_PAGES_BATCH did not flag the malformed entry.");
+
+    entries[count - 1].in.size = page_size;
+
+    // The last entry duplicates the first.
+    entries[count - 1].in.virtual_address = entries[0].in.virtual_address;
+
+    if (ioctl(dev_fd.get(), TENSTORRENT_IOCTL_PIN_PAGES_BATCH, &batch) != 0)
+        THROW_TEST_FAILURE("PIN_PAGES_BATCH failed.");
+
+    for (unsigned int i = 0; i < count - 1; i++)
+    {
+        if (entries[i].status != 0)
+            THROW_TEST_FAILURE("PIN_PAGES_BATCH failed entry " + std::to_string(i) + ".");
+
+        if (entries[i].out.physical_address == 0)
+            THROW_TEST_FAILURE("PIN_PAGES_BATCH returned no address for entry " + std::to_string(i) + ".");
+    }
+
+    if (entries[count - 1].status != -EEXIST)
+        THROW_TEST_FAILURE("PIN_PAGES_BATCH accepted a duplicate entry.");
+
+    std::vector<tenstorrent_unpin_pages_batch_entry> unpin_entries(count);
+    for (unsigned int i = 0; i < count; i++)
+    {
+        zero(&unpin_entries[i]);
+        unpin_entries[i].in.virtual_address = entries[i].in.virtual_address;
+        unpin_entries[i].in.size = page_size;
+    }
+
+    tenstorrent_unpin_pages_batch unpin_batch;
+    zero(&unpin_batch);
+    unpin_batch.argsz = sizeof(unpin_batch);
+    unpin_batch.count = count;
+    unpin_batch.entries = reinterpret_cast<uintptr_t>(unpin_entries.data());
+
+    if (ioctl(dev_fd.get(), TENSTORRENT_IOCTL_UNPIN_PAGES_BATCH, &unpin_batch) != 0)
+        THROW_TEST_FAILURE("UNPIN_PAGES_BATCH failed.");
+
+    for (unsigned int i = 0; i < count - 1; i++)
+    {
+        if (unpin_entries[i].status != 0)
+            THROW_TEST_FAILURE("UNPIN_PAGES_BATCH failed entry " + std::to_string(i) + ".");
+    }
+
+    // The first range was pinned once, so the second unpin of it fails.
+    if (unpin_entries[count - 1].status != -EINVAL)
+        THROW_TEST_FAILURE("UNPIN_PAGES_BATCH unpinned a range twice.");
+}
+
+void VerifyPinPagesDirection(const EnumeratedDevice &dev)
+{
+    auto page_size = getpagesize();
+
+    void *m = mmap(nullptr, page_size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (m == MAP_FAILED)
+        throw_system_error("read-only anonymous mmap failed.");
+    std::unique_ptr<void, Unmapper> mapping(m, Unmapper{1});
+
+    DevFd dev_fd(dev.path);
+
+    struct tenstorrent_pin_pages pin_pages;
+    zero(&pin_pages);
+    pin_pages.in.output_size_bytes = sizeof(pin_pages.out);
+    pin_pages.in.flags = TENSTORRENT_PIN_PAGES_TO_DEVICE | TENSTORRENT_PIN_PAGES_FROM_DEVICE;
+    pin_pages.in.virtual_address = reinterpret_cast<uintptr_t>(m);
+    pin_pages.in.size = page_size;
+
+    if (ioctl(dev_fd.get(), TENSTORRENT_IOCTL_PIN_PAGES, &pin_pages) != -1 || errno != EINVAL)
+        THROW_TEST_FAILURE("PIN_PAGES accepted both TO_DEVICE and FROM_DEVICE.");
+
+    pin_pages.in.flags = TENSTORRENT_PIN_PAGES_TO_DEVICE;
+    if (ioctl(dev_fd.get(), TENSTORRENT_IOCTL_PIN_PAGES, &pin_pages) != 0)
+        THROW_TEST_FAILURE("PIN_PAGES TO_DEVICE failed on read-only memory.");
+
+    struct tenstorrent_sync_pinned_pages sync;
+    zero(&sync);
+    sync.argsz = sizeof(sync);
+    sync.virtual_address = reinterpret_cast<uintptr_t>(m);
+    sync.size = page_size;
+
+    sync.flags = TENSTORRENT_SYNC_PINNED_PAGES_FOR_DEVICE | TENSTORRENT_SYNC_PINNED_PAGES_FOR_CPU;
+    if (ioctl(dev_fd.get(), TENSTORRENT_IOCTL_SYNC_PINNED_PAGES, &sync) != -1 || errno != EINVAL)
+        THROW_TEST_FAILURE("SYNC_PINNED_PAGES accepted both directions.");
+
+    sync.flags = TENSTORRENT_SYNC_PINNED_PAGES_FOR_DEVICE;
+    if (ioctl(dev_fd.get(), TENSTORRENT_IOCTL_SYNC_PINNED_PAGES, &sync) != 0)
+        THROW_TEST_FAILURE("SYNC_PINNED_PAGES for device failed.");
+
+    sync.flags = TENSTORRENT_SYNC_PINNED_PAGES_FOR_CPU;
+    if (ioctl(dev_fd.get(), TENSTORRENT_IOCTL_SYNC_PINNED_PAGES, &sync) != 0)
+        THROW_TEST_FAILURE("SYNC_PINNED_PAGES for CPU failed.");
+
+    sync.size = 2 * page_size;
+    if (ioctl(dev_fd.get(), TENSTORRENT_IOCTL_SYNC_PINNED_PAGES, &sync) != -1 || errno != EINVAL)
+        THROW_TEST_FAILURE("SYNC_PINNED_PAGES accepted a range that isn't a pinning.");
+}
+
+void VerifyPinPagesReadOnlyFile(const EnumeratedDevice &dev)
+{
+    auto page_size = getpagesize();
+
+    int file_fd = make_anonymous_temp();
+    std::vector<char> contents(page_size, 0x5A);
+    if (write(file_fd, contents.data(), contents.size()) != static_cast<ssize_t>(contents.size()))
+    {
+        close(file_fd);
+        throw_system_error("writing temporary file.");
+    }
+
+    void *m = mmap(nullptr, page_size, PROT_READ, MAP_SHARED, file_fd, 0);
+    close(file_fd);
+    if (m == MAP_FAILED)
+        throw_system_error("read-only file mmap failed.");
+    std::unique_ptr<void, Unmapper> mapping(m, Unmapper{1});
+
+    DevFd dev_fd1(dev.path);
+    DevFd dev_fd2(dev.path);
+
+    struct tenstorrent_pin_pages pin_pages;
+    zero(&pin_pages);
+    pin_pages.in.output_size_bytes = sizeof(pin_pages.out);
+    pin_pages.in.virtual_address = reinterpret_cast<uintptr_t>(m);
+    pin_pages.in.size = page_size;
+
+    if (ioctl(dev_fd1.get(), TENSTORRENT_IOCTL_PIN_PAGES, &pin_pages) != -1)
+        THROW_TEST_FAILURE("PIN_PAGES pinned a read-only file mapping for writing.");
+
+    // Both pin the same page cache page.
+    pin_pages.in.flags = TENSTORRENT_PIN_PAGES_TO_DEVICE;
+    if (ioctl(dev_fd1.get(), TENSTORRENT_IOCTL_PIN_PAGES, &pin_pages) != 0)
+        THROW_TEST_FAILURE("PIN_PAGES TO_DEVICE failed on a read-only file mapping.");
+
+    if (ioctl(dev_fd2.get(), TENSTORRENT_IOCTL_PIN_PAGES, &pin_pages) != 0)
+        THROW_TEST_FAILURE("PIN_PAGES TO_DEVICE failed on a file mapping already pinned by another fd.");
+
+    if (*static_cast<const char *>(m) != 0x5A)
+        THROW_TEST_FAILURE("Pinned file mapping lost its contents.");
+}
+
 void TestPinPages(const EnumeratedDevice &dev)
 {
     VerifyPinPagesSimple(dev);
@@ -440,7 +833,14 @@ void TestPinPages(const EnumeratedDevice &dev)
     VerifyPinPagesNoUnmapped(dev);
     VerifyPinPagesMultipleRanges(dev);
     VerifyPinPagesContiguous(dev);
+    VerifyPinPagesTransparentHuge(dev);
     VerifyPinPagesNotContiguous(dev);
     VerifyUnpinPagesSimple(dev);
     VerifyUnpinPagesBadSize(dev);
+    VerifyPinPagesCached(dev);
+    VerifyPinPagesResumable(dev);
+    VerifyUnpinPagesSubrange(dev);
+    VerifyPinPagesBatch(dev);
+    VerifyPinPagesDirection(dev);
+    VerifyPinPagesReadOnlyFile(dev);
 }
@@ -0,0 +1,139 @@
+// SPDX-FileCopyrightText: © 2025 Tenstorrent Inc.
+// SPDX-License-Identifier: GPL-2.0-only
+
+// Verify that sharing a range that isn't pinned is rejected.
+// Verify that sharing with another fd for the same device is rejected per peer.
+// Verify that a peer pinning outlives the original and unpins on the peer fd.
+// Verify that sharing twice with the same peer fails with EEXIST.
+
+#include <memory>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+
+#include <sys/ioctl.h>
+
+#include "ioctl.h"
+
+#include "util.h"
+#include "test_failure.h"
+#include "enumeration.h"
+#include "devfd.h"
+
+namespace
+{
+
+void PinPage(int dev_fd, void *page)
+{
+    tenstorrent_pin_pages pin_pages;
+    zero(&pin_pages);
+    pin_pages.in.output_size_bytes = sizeof(pin_pages.out);
+    pin_pages.in.virtual_address = reinterpret_cast<std::uintptr_t>(page);
+    pin_pages.in.size = page_size();
+
+    if (ioctl(dev_fd, TENSTORRENT_IOCTL_PIN_PAGES, &pin_pages) != 0)
+        THROW_TEST_FAILURE("PIN_PAGES failed single-page pin.");
+}
+
+int UnpinPage(int dev_fd, void *page)
+{
+    tenstorrent_unpin_pages unpin_pages;
+    zero(&unpin_pages);
+    unpin_pages.in.virtual_address = reinterpret_cast<std::uintptr_t>(page);
+    unpin_pages.in.size = page_size();
+
+    return ioctl(dev_fd, TENSTORRENT_IOCTL_UNPIN_PAGES, &unpin_pages) == 0 ? 0 : errno;
+}
+
+// Returns the call's errno, or 0 with the peer's result in *peer.
+int SharePage(int dev_fd, void *page, tenstorrent_share_pinning_peer *peer)
+{
+    tenstorrent_share_pinning share;
+    zero(&share);
+    share.argsz = sizeof(share);
+    share.virtual_address = reinterpret_cast<std::uintptr_t>(page);
+    share.size = page_size();
+    share.count = 1;
+    share.peers = reinterpret_cast<std::uintptr_t>(peer);
+
+    return ioctl(dev_fd, TENSTORRENT_IOCTL_SHARE_PINNING, &share) == 0 ? 0 : errno;
+}
+
+void VerifyUnpinnedRejected(const EnumeratedDevice &d1, const EnumeratedDevice &d2, void *page)
+{
+    DevFd fd1(d1.path);
+    DevFd fd2(d2.path);
+
+    tenstorrent_share_pinning_peer peer;
+    zero(&peer);
+    peer.fd = fd2.get();
+
+    if (SharePage(fd1.get(), page, &peer) != EINVAL)
+        THROW_TEST_FAILURE("SHARE_PINNING accepted a range that isn't pinned.");
+}
+
+void VerifySameDeviceRejected(const EnumeratedDevice &d1, const EnumeratedDevice &d2, void *page)
+{
+    DevFd fd1(d1.path);
+    DevFd fd2(d2.path);
+
+    PinPage(fd1.get(), page);
+
+    tenstorrent_share_pinning_peer peer;
+    zero(&peer);
+    peer.fd = fd2.get();
+
+    if (SharePage(fd1.get(), page, &peer) != 0)
+        THROW_TEST_FAILURE("SHARE_PINNING failed as a whole for a bad peer.");
+
+    if (peer.status != -EINVAL)
+        THROW_TEST_FAILURE("SHARE_PINNING shared with two fds for the same device.");
+}
+
+void VerifyShared(const EnumeratedDevice &d1, const EnumeratedDevice &d2, void *page)
+{
+    DevFd fd1(d1.path);
+    DevFd fd2(d2.path);
+
+    PinPage(fd1.get(), page);
+
+    tenstorrent_share_pinning_peer peer;
+    zero(&peer);
+    peer.fd = fd2.get();
+
+    if (SharePage(fd1.get(), page, &peer) != 0 || peer.status != 0)
+        THROW_TEST_FAILURE("SHARE_PINNING failed.");
+
+    if (peer.dma_address == 0)
+        THROW_TEST_FAILURE("SHARE_PINNING returned no DMA address.");
+
+    zero(&peer);
+    peer.fd = fd2.get();
+
+    if (SharePage(fd1.get(), page, &peer) != 0 || peer.status != -EEXIST)
+        THROW_TEST_FAILURE("SHARE_PINNING shared the same range with a peer twice.");
+
+    // Either end can go first.
+    if (UnpinPage(fd1.get(), page) != 0)
+        THROW_TEST_FAILURE("UNPIN_PAGES of a shared pinning failed.");
+
+    if (UnpinPage(fd2.get(), page) != 0)
+        THROW_TEST_FAILURE("UNPIN_PAGES of a peer pinning failed.");
+
+    if (UnpinPage(fd2.get(), page) != EINVAL)
+        THROW_TEST_FAILURE("UNPIN_PAGES of a peer pinning succeeded twice.");
+}
+
+}
+
+void TestSharePinning(const EnumeratedDevice &d1, const EnumeratedDevice &d2)
+{
+    std::unique_ptr<void, Freer> page(std::aligned_alloc(page_size(), page_size()));
+
+    VerifyUnpinnedRejected(d1, d2, page.get());
+
+    if (d1.location == d2.location)
+        VerifySameDeviceRejected(d1, d2, page.get());
+    else
+        VerifyShared(d1, d2, page.get());
+}
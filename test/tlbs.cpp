@@ -7,6 +7,8 @@
 
 #include <algorithm>
 #include <array>
+#include <cerrno>
+#include <cstring>
 #include <memory>
 #include <random>
 
@@ -272,14 +274,14 @@ void VerifyBadConfRejectedWormhole(const EnumeratedDevice &dev)
     }
 }
 
-// Blackhole has 202x 2M and 8x 4G windows; all but the last 2M window should be
-// available for allocation on an unused device.
+// Blackhole has 202x 2M and 8x 4G windows; all but the last three 2M windows
+// should be available for allocation on an unused device.
 void VerifyTlbQuantitiesBlackhole(const EnumeratedDevice &dev)
 {
     DevFd dev_fd(dev.path);
     std::vector<uint32_t> ids;
 
-    for (size_t i = 0; i < 201; ++i) {
+    for (size_t i = 0; i < 199; ++i) {
         struct tenstorrent_allocate_tlb tlb{};
         tlb.in.size = TWO_MEG;
 
@@ -289,7 +291,7 @@ void VerifyTlbQuantitiesBlackhole(const EnumeratedDevice &dev)
         ids.push_back(tlb.out.id);
     }
 
-    // The last 2M window should be off-limits to userspace.
+    // The last three 2M windows should be off-limits to userspace.
     {
         struct tenstorrent_allocate_tlb tlb{};
         tlb.in.size = TWO_MEG;
@@ -418,7 +420,8 @@ void VerifyManyWindowsBlackhole(const EnumeratedDevice &dev)
     DevFd dev_fd(dev.path);
     int fd = dev_fd.get();
 
-    for (size_t i = 0; i < 200; ++i) {
+    // All 199 user windows: 198 readers and the writer.
+    for (size_t i = 0; i < 198; ++i) {
         windows.push_back(std::make_unique<TlbWindow2M>(fd, x, y, addr));
     }
 
@@ -562,8 +565,205 @@ void VerifyMappedWindowCannotBeFreed(const EnumeratedDevice &dev)
         THROW_TEST_FAILURE("Failed to free TLB");
 }
 
+void VerifyConfigureTlbBatch(const EnumeratedDevice &dev)
+{
+    DevFd dev_fd(dev.path);
+    int fd = dev_fd.get();
+
+    std::array<uint32_t, 2> ids;
+    for (auto &id : ids)
+    {
+        tenstorrent_allocate_tlb allocate_tlb{};
+        allocate_tlb.in.size = TWO_MEG;
+        if (ioctl(fd, TENSTORRENT_IOCTL_ALLOCATE_TLB, &allocate_tlb) != 0)
+            THROW_TEST_FAILURE("Failed to allocate TLB");
+        id = allocate_tlb.out.id;
+    }
+
+    std::array<tenstorrent_configure_tlb_batch_entry, 3> entries{};
+    for (size_t i = 0; i < ids.size(); i++)
+    {
+        entries[i].id = ids[i];
+        entries[i].config.addr = i * TWO_MEG;
+    }
+
+    tenstorrent_configure_tlb_batch batch{};
+    batch.argsz = sizeof(batch);
+    batch.count = ids.size();
+    batch.entries = reinterpret_cast<uintptr_t>(entries.data());
+
+    if (ioctl(fd, TENSTORRENT_IOCTL_CONFIGURE_TLB_BATCH, &batch) != 0)
+        THROW_TEST_FAILURE("CONFIGURE_TLB_BATCH failed");
+
+    for (size_t i = 0; i < ids.size(); i++)
+        if (entries[i].status != 0)
+            THROW_TEST_FAILURE("CONFIGURE_TLB_BATCH entry failed");
+
+    // A window this fd doesn't own fails the whole batch.
+    entries[2].id = TENSTORRENT_MAX_INBOUND_TLBS - 1;
+    if (std::find(ids.begin(), ids.end(), entries[2].id) != ids.end())
+        entries[2].id--;
+    batch.count = entries.size();
+
+    if (ioctl(fd, TENSTORRENT_IOCTL_CONFIGURE_TLB_BATCH, &batch) == 0 || errno != EPERM)
+        THROW_TEST_FAILURE("CONFIGURE_TLB_BATCH accepted an unowned window");
+
+    if (entries[0].status != 0 || entries[2].status != -EPERM)
+        THROW_TEST_FAILURE("CONFIGURE_TLB_BATCH misreported entry status");
+
+    for (auto id : ids)
+    {
+        tenstorrent_free_tlb free_tlb{};
+        free_tlb.in.id = id;
+        if (ioctl(fd, TENSTORRENT_IOCTL_FREE_TLB, &free_tlb) != 0)
+            THROW_TEST_FAILURE("Failed to free TLB");
+    }
+}
+
+void VerifyGetTlbConfig(const EnumeratedDevice &dev)
+{
+    DevFd dev_fd(dev.path);
+    int fd = dev_fd.get();
+
+    tenstorrent_allocate_tlb allocate_tlb{};
+    allocate_tlb.in.size = TWO_MEG;
+    if (ioctl(fd, TENSTORRENT_IOCTL_ALLOCATE_TLB, &allocate_tlb) != 0)
+        THROW_TEST_FAILURE("Failed to allocate TLB");
+
+    tenstorrent_get_tlb_config get_config{};
+    get_config.argsz = sizeof(get_config);
+    get_config.id = allocate_tlb.out.id;
+
+    if (ioctl(fd, TENSTORRENT_IOCTL_GET_TLB_CONFIG, &get_config) == 0 || errno != ENODATA)
+        THROW_TEST_FAILURE("GET_TLB_CONFIG returned a config for an unconfigured window");
+
+    tenstorrent_configure_tlb configure_tlb{};
+    configure_tlb.in.id = allocate_tlb.out.id;
+    configure_tlb.in.config.addr = 3 * TWO_MEG;
+    configure_tlb.in.config.x_end = 1;
+    configure_tlb.in.config.y_end = 2;
+    configure_tlb.in.config.ordering = 1;
+
+    // The second is a no-op for the hardware but must still succeed.
+    for (int i = 0; i < 2; i++)
+        if (ioctl(fd, TENSTORRENT_IOCTL_CONFIGURE_TLB, &configure_tlb) != 0)
+            THROW_TEST_FAILURE("Failed to configure TLB");
+
+    if (ioctl(fd, TENSTORRENT_IOCTL_GET_TLB_CONFIG, &get_config) != 0)
+        THROW_TEST_FAILURE("GET_TLB_CONFIG failed");
+
+    if (memcmp(&get_config.config, &configure_tlb.in.config, sizeof(get_config.config)) != 0)
+        THROW_TEST_FAILURE("GET_TLB_CONFIG returned the wrong config");
+
+    tenstorrent_free_tlb free_tlb{};
+    free_tlb.in.id = allocate_tlb.out.id;
+    if (ioctl(fd, TENSTORRENT_IOCTL_FREE_TLB, &free_tlb) != 0)
+        THROW_TEST_FAILURE("Failed to free TLB");
+
+    if (ioctl(fd, TENSTORRENT_IOCTL_GET_TLB_CONFIG, &get_config) == 0 || errno != EPERM)
+        THROW_TEST_FAILURE("GET_TLB_CONFIG succeeded on a freed window");
+}
+
+int NocReadWrite(int fd, unsigned long cmd, uint32_t x, uint32_t y, uint64_t addr, void *buffer, uint64_t size)
+{
+    tenstorrent_noc_rw rw{};
+    rw.argsz = sizeof(rw);
+    rw.x = x;
+    rw.y = y;
+    rw.addr = addr;
+    rw.buffer = reinterpret_cast<uintptr_t>(buffer);
+    rw.size = size;
+
+    return ioctl(fd, cmd, &rw) == 0 ? 0 : errno;
+}
+
+void VerifyNocReadWrite(const EnumeratedDevice &dev)
+{
+    // DRAM, as in the many-windows tests.
+    bool translated = dev.type == Blackhole && is_blackhole_noc_translation_enabled(dev);
+    uint32_t x = translated ? 17 : 0;
+    uint32_t y = translated ? 12 : 0;
+
+    // Long enough to cross a kernel window boundary wherever it starts.
+    std::vector<uint32_t> random_data((TWO_MEG + 0x1000) / sizeof(uint32_t));
+    std::vector<uint32_t> readback(random_data.size());
+    uint64_t size = random_data.size() * sizeof(uint32_t);
+    uint64_t addr = random_aligned_address(1ULL << 30, 0x4);
+
+    DevFd dev_fd(dev.path);
+    int fd = dev_fd.get();
+
+    fill_with_random_data(random_data);
+
+    if (NocReadWrite(fd, TENSTORRENT_IOCTL_NOC_WRITE, x, y, addr, random_data.data(), size) != 0)
+        THROW_TEST_FAILURE("NOC_WRITE failed");
+
+    if (NocReadWrite(fd, TENSTORRENT_IOCTL_NOC_READ, x, y, addr, readback.data(), size) != 0)
+        THROW_TEST_FAILURE("NOC_READ failed");
+
+    if (readback != random_data)
+        THROW_TEST_FAILURE("NOC_READ returned different data than NOC_WRITE wrote");
+
+    TlbWindow2M window(fd, x, y, addr);
+    if (window.read32(0) != random_data.at(0))
+        THROW_TEST_FAILURE("NOC_WRITE data not visible through a TLB window");
+
+    if (NocReadWrite(fd, TENSTORRENT_IOCTL_NOC_READ, x, y, addr + 1, readback.data(), 4) != EINVAL)
+        THROW_TEST_FAILURE("NOC_READ accepted a misaligned address");
+
+    if (NocReadWrite(fd, TENSTORRENT_IOCTL_NOC_READ, x, y, addr, readback.data(), 0) != EINVAL)
+        THROW_TEST_FAILURE("NOC_READ accepted a zero size");
+}
+
+// A reset leaves the window registers unprogrammed, so configuring a window
+// the same way again afterwards must not be skipped as a no-op.
+void VerifyConfigureTlbAfterReset(const EnumeratedDevice &dev)
+{
+    // ARC's node id, at the same coordinates whether or not Blackhole translates.
+    xy_t arc = dev.type == Blackhole ? xy_t{ 8, 0 } : xy_t{ 0, 10 };
+    uint64_t node_id_addr = dev.type == Blackhole ? 0x0000000080050044ULL : 0xFFFB2002CULL;
+
+    DevFd dev_fd(dev.path);
+    int fd = dev_fd.get();
+
+    tenstorrent_noc_tlb_config config{
+        .addr = node_id_addr & ~(TWO_MEG - 1),
+        .x_end = arc.x,
+        .y_end = arc.y,
+    };
+
+    TlbHandle window(fd, TWO_MEG, config);
+    auto node_id = [&] {
+        return *reinterpret_cast<volatile uint32_t *>(window.data() + (node_id_addr & (TWO_MEG - 1)));
+    };
+
+    auto before = node_id();
+    if ((before & 0x3f) != arc.x || ((before >> 6) & 0x3f) != arc.y)
+        THROW_TEST_FAILURE("Node id mismatch");
+
+    tenstorrent_reset_device reset_device{};
+    reset_device.in.output_size_bytes = sizeof(reset_device.out);
+    reset_device.in.flags = TENSTORRENT_RESET_DEVICE_RESET_PCIE_LINK;
+    if (ioctl(fd, TENSTORRENT_IOCTL_RESET_DEVICE, &reset_device) != 0 || reset_device.out.result != 0)
+        THROW_TEST_FAILURE("PCIe link reset failed");
+
+    tenstorrent_configure_tlb configure_tlb{};
+    configure_tlb.in.id = window.id();
+    configure_tlb.in.config = config;
+    if (ioctl(fd, TENSTORRENT_IOCTL_CONFIGURE_TLB, &configure_tlb) != 0)
+        THROW_TEST_FAILURE("Failed to configure TLB");
+
+    if (node_id() != before)
+        THROW_TEST_FAILURE("CONFIGURE_TLB after a reset left the window unprogrammed");
+}
+
 } // namespace
 
+void TestTlbReset(const EnumeratedDevice &dev)
+{
+    VerifyConfigureTlbAfterReset(dev);
+}
+
 void TestTlbs(const EnumeratedDevice &dev)
 {
     switch (dev.type)
@@ -589,4 +789,7 @@ void TestTlbs(const EnumeratedDevice &dev)
 
     VerifyPartialUnmappingDisallowed(dev);
     VerifyMappedWindowCannotBeFreed(dev);
+    VerifyConfigureTlbBatch(dev);
+    VerifyGetTlbConfig(dev);
+    VerifyNocReadWrite(dev);
 }
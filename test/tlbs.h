@@ -54,6 +54,7 @@ public:
 
     uint8_t* data() { return tlb_base; }
     size_t size() const { return tlb_size; }
+    int id() const { return tlb_id; }
 
     ~TlbHandle() noexcept
     {
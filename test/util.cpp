@@ -2,6 +2,8 @@
 // SPDX-License-Identifier: GPL-2.0-only
 
 #include <fstream>
+#include <cinttypes>
+#include <cstdio>
 #include <iterator>
 #include <limits>
 #include <system_error>
@@ -15,6 +17,7 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/random.h>
+#include <sys/utsname.h>
 #include <fcntl.h>
 #include <dirent.h>
 #include <unistd.h>
@@ -208,3 +211,43 @@ int make_shared_mem()
     shm_unlink(name);
     return fd;
 }
+
+unsigned long smaps_kb(const void *addr, const std::string &field)
+{
+    std::ifstream smaps("/proc/self/smaps");
+    if (!smaps)
+        throw_system_error("Can't open /proc/self/smaps");
+
+    auto target = reinterpret_cast<std::uintptr_t>(addr);
+    bool in_mapping = false;
+    std::string line;
+
+    while (std::getline(smaps, line))
+    {
+        std::uintptr_t start, end;
+
+        // Each mapping starts with a "start-end perms ..." line, followed by "Field: value kB" lines.
+        if (std::sscanf(line.c_str(), "%" SCNxPTR "-%" SCNxPTR, &start, &end) == 2)
+        {
+            in_mapping = start <= target && target < end;
+            continue;
+        }
+
+        if (in_mapping && line.compare(0, field.size() + 1, field + ":") == 0)
+            return std::stoul(line.substr(field.size() + 1));
+    }
+
+    return 0;
+}
+
+bool kernel_version_at_least(unsigned major, unsigned minor)
+{
+    struct utsname u;
+    if (uname(&u) != 0)
+        throw_system_error("uname failed");
+
+    unsigned running_major = 0, running_minor = 0;
+    std::sscanf(u.release, "%u.%u", &running_major, &running_minor);
+
+    return running_major > major || (running_major == major && running_minor >= minor);
+}
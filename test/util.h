@@ -64,6 +64,13 @@ int make_anonymous_temp();
 
 int make_shared_mem();
 
+// Returns field (e.g. "AnonHugePages") from /proc/self/smaps for the mapping
+// containing addr, in kB, or 0 if there's no such mapping or field.
+unsigned long smaps_kb(const void *addr, const std::string &field);
+
+// Is the running kernel at least major.minor?
+bool kernel_version_at_least(unsigned major, unsigned minor);
+
 template <class T, class U>
 T round_up(T x, U alignment)
 {
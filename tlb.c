@@ -2,6 +2,8 @@
 // SPDX-License-Identifier: GPL-2.0-only
 
 #include <linux/sched/signal.h>
+#include <linux/string.h>
+#include <linux/io.h>
 
 #include "tlb.h"
 #include "device.h"
@@ -68,17 +70,133 @@ int tenstorrent_device_free_tlb(struct tenstorrent_device *tt_dev,
 	if (id >= total_tlbs)
 		return -EINVAL;
 
+	// Forget the config before the window can be claimed again, so the next
+	// owner's first CONFIGURE_TLB is never skipped or read back.
+	mutex_lock(&tt_dev->tlb_config_mutex);
+	clear_bit(id, tt_dev->tlbs_configured);
+	clear_bit(id, tt_dev->tlbs_programmed);
+	mutex_unlock(&tt_dev->tlb_config_mutex);
+
 	if (!test_and_clear_bit(id, tt_dev->tlbs))
 		return -EPERM;
 
 	return 0;
 }
 
+int __tenstorrent_device_configure_tlb(struct tenstorrent_device *tt_dev, int tlb,
+				       struct tenstorrent_noc_tlb_config *config)
+{
+	int ret;
+
+	lockdep_assert_held(&tt_dev->tlb_config_mutex);
+
+	if (!tt_dev->dev_class->configure_tlb)
+		return -EINVAL;
+
+	if (test_bit(tlb, tt_dev->tlbs_programmed)
+	    && memcmp(&tt_dev->tlb_configs[tlb], config, sizeof(*config)) == 0)
+		return 0;
+
+	ret = tt_dev->dev_class->configure_tlb(tt_dev, tlb, config);
+	if (ret) {
+		// The registers may be half-written.
+		clear_bit(tlb, tt_dev->tlbs_configured);
+		clear_bit(tlb, tt_dev->tlbs_programmed);
+		return ret;
+	}
+
+	tt_dev->tlb_configs[tlb] = *config;
+	set_bit(tlb, tt_dev->tlbs_configured);
+	set_bit(tlb, tt_dev->tlbs_programmed);
+	return 0;
+}
+
 int tenstorrent_device_configure_tlb(struct tenstorrent_device *tt_dev, int tlb,
 				     struct tenstorrent_noc_tlb_config *config)
 {
-	if (tt_dev->dev_class->configure_tlb)
-		return tt_dev->dev_class->configure_tlb(tt_dev, tlb, config);
+	int ret;
 
-	return -EINVAL;
+	mutex_lock(&tt_dev->tlb_config_mutex);
+	ret = __tenstorrent_device_configure_tlb(tt_dev, tlb, config);
+	mutex_unlock(&tt_dev->tlb_config_mutex);
+
+	return ret;
+}
+
+int tenstorrent_device_get_tlb_config(struct tenstorrent_device *tt_dev, int tlb,
+				      struct tenstorrent_noc_tlb_config *config)
+{
+	int ret = 0;
+
+	mutex_lock(&tt_dev->tlb_config_mutex);
+
+	if (test_bit(tlb, tt_dev->tlbs_configured))
+		*config = tt_dev->tlb_configs[tlb];
+	else
+		ret = -ENODATA;
+
+	mutex_unlock(&tt_dev->tlb_config_mutex);
+	return ret;
+}
+
+void tenstorrent_device_restore_tlbs(struct tenstorrent_device *tt_dev)
+{
+	unsigned int tlb;
+
+	if (!tt_dev->dev_class->configure_tlb)
+		return;
+
+	mutex_lock(&tt_dev->tlb_config_mutex);
+
+	for_each_set_bit(tlb, tt_dev->tlbs_configured, TENSTORRENT_MAX_INBOUND_TLBS) {
+		if (tt_dev->dev_class->configure_tlb(tt_dev, tlb, &tt_dev->tlb_configs[tlb]))
+			clear_bit(tlb, tt_dev->tlbs_configured);
+		else
+			set_bit(tlb, tt_dev->tlbs_programmed);
+	}
+
+	mutex_unlock(&tt_dev->tlb_config_mutex);
+}
+
+void tenstorrent_device_invalidate_tlbs(struct tenstorrent_device *tt_dev)
+{
+	mutex_lock(&tt_dev->tlb_config_mutex);
+	bitmap_zero(tt_dev->tlbs_programmed, TENSTORRENT_MAX_INBOUND_TLBS);
+	mutex_unlock(&tt_dev->tlb_config_mutex);
+}
+
+void tenstorrent_noc_read(struct tenstorrent_device *tt_dev, u32 x, u32 y, u64 addr, u8 *dst, size_t len,
+			  int noc)
+{
+	const struct tenstorrent_device_class *dev_class = tt_dev->dev_class;
+
+	while (len > 0) {
+		size_t chunk = len;
+		u8 __iomem *window = dev_class->configure_kernel_window(tt_dev, x, y, addr, noc, &chunk);
+
+		memcpy_fromio(dst, window, chunk);
+		dev_class->release_kernel_window(tt_dev);
+
+		addr += chunk;
+		dst += chunk;
+		len -= chunk;
+	}
+}
+
+void tenstorrent_noc_write(struct tenstorrent_device *tt_dev, u32 x, u32 y, u64 addr, const u8 *src,
+			   size_t len, int noc)
+{
+	const struct tenstorrent_device_class *dev_class = tt_dev->dev_class;
+
+	while (len > 0) {
+		size_t chunk = len;
+		u8 __iomem *window = dev_class->configure_kernel_window(tt_dev, x, y, addr, noc, &chunk);
+
+		memcpy_toio(window, src, chunk);
+		dev_class->release_kernel_window(tt_dev);
+
+		addr += chunk;
+		src += chunk;
+		len -= chunk;
+	}
 }
@@ -22,4 +22,28 @@ int tenstorrent_device_free_tlb(struct tenstorrent_device *tt_dev,
 int tenstorrent_device_configure_tlb(struct tenstorrent_device *tt_dev, int tlb,
 				     struct tenstorrent_noc_tlb_config *config);
 
+// Same, with tt_dev->tlb_config_mutex held. Skips the register writes if
+// the window already has this config.
+int __tenstorrent_device_configure_tlb(struct tenstorrent_device *tt_dev, int tlb,
+				       struct tenstorrent_noc_tlb_config *config);
+
+// Return -ENODATA if the window hasn't been configured since it was allocated.
+int tenstorrent_device_get_tlb_config(struct tenstorrent_device *tt_dev, int tlb,
+				      struct tenstorrent_noc_tlb_config *config);
+
+// Reprogram every configured window after a reset cleared the registers.
+void tenstorrent_device_restore_tlbs(struct tenstorrent_device *tt_dev);
+
+// Copy through the chip's kernel window (dev_class->configure_kernel_window)
+// a piece at a time, releasing it between pieces so its other users aren't
+// held up for long. addr and len are 4-byte aligned.
+void tenstorrent_noc_read(struct tenstorrent_device *tt_dev, u32 x, u32 y, u64 addr, u8 *dst, size_t len,
+			  int noc);
+void tenstorrent_noc_write(struct tenstorrent_device *tt_dev, u32 x, u32 y, u64 addr, const u8 *src,
+			   size_t len, int noc);
+
+// The chip is being reset: keep the configs for restore_tlbs, but don't skip
+// the next CONFIGURE_TLB of any window because its registers seem to match.
+void tenstorrent_device_invalidate_tlbs(struct tenstorrent_device *tt_dev);
+
 #endif // TTDRIVER_TLB_H_INCLUDED
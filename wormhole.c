@@ -122,6 +122,7 @@
 		       IATU_##reg##_##direction, (value))
 
 static u32 noc_read32(struct wormhole_device *wh, u32 x, u32 y, u64 addr, int noc);
+static void wh_invalidate_kernel_tlb(struct wormhole_device *wh);
 
 static bool is_hardware_hung(struct pci_dev *pdev, u8 __iomem *reset_unit_regs)
 {
@@ -544,6 +545,7 @@ static bool wormhole_reset(struct tenstorrent_device *tt_dev, u32 reset_flag)
 		set_reset_marker(pdev);
 		wormhole_send_arc_fw_message_with_args(reset_unit_regs(wh_dev), WH_FW_MSG_TRIGGER_RESET, reset_arg, 0,
 							0, NULL);
+		wh_invalidate_kernel_tlb(wh_dev);
 		return true; // Assumes the reset was successful.
 	}
 
@@ -912,10 +914,23 @@ static u8 __iomem *wh_configure_kernel_tlb(struct wormhole_device *wh, u32 x, u3
 	config.ordering	= 1; // strict
 	config.noc = noc;
 
-	wh_configure_tlb(wh, KERNEL_TLB_INDEX, &config);
+	if (!wh->kernel_tlb_valid || memcmp(&wh->kernel_tlb_config, &config, sizeof(config)) != 0) {
+		wh_configure_tlb(wh, KERNEL_TLB_INDEX, &config);
+		wh->kernel_tlb_config = config;
+		wh->kernel_tlb_valid = true;
+	}
+
 	return wh->bar4_mapping + KERNEL_TLB_START + offset;
 }
 
+// A reset clears the TLB registers behind our back.
+static void wh_invalidate_kernel_tlb(struct wormhole_device *wh)
+{
+	mutex_lock(&wh->kernel_tlb_mutex);
+	wh->kernel_tlb_valid = false;
+	mutex_unlock(&wh->kernel_tlb_mutex);
+}
+
 static u32 noc_read32(struct wormhole_device *wh, u32 x, u32 y, u64 addr, int noc) {
 	u32 val;
 	u8 __iomem *tlb_window;
@@ -967,6 +982,8 @@ static void wormhole_restore_reset_state(struct tenstorrent_device *tt_dev) {
 	struct wormhole_device *wh = tt_dev_to_wh_dev(tt_dev);
 	u32 device_control;
 
+	wh_invalidate_kernel_tlb(wh);
+
 	open_dbi(wh);
 	device_control = noc_read32(wh, PCIE_NOC_X, PCIE_NOC_Y, PCIE_DBI_ADDR + DBI_DEVICE_CONTROL_DEVICE_STATUS, 0);
 	device_control &= ~PCI_EXP_DEVCTL_PAYLOAD;
@@ -1009,6 +1026,25 @@ static void wormhole_noc_write32(struct tenstorrent_device *tt_dev, u32 x, u32 y
 	noc_write32(wh_dev, x, y, addr, data, noc);
 }
 
+// Bulk copies share the one kernel window with telemetry and ARC messages.
+static u8 __iomem *wormhole_configure_kernel_window(struct tenstorrent_device *tt_dev, u32 x, u32 y, u64 addr,
+						    int noc, size_t *len)
+{
+	struct wormhole_device *wh = tt_dev_to_wh_dev(tt_dev);
+
+	*len = min_t(u64, *len, TLB_16M_WINDOW_SIZE - (addr & TLB_16M_WINDOW_MASK));
+
+	mutex_lock(&wh->kernel_tlb_mutex);
+	return wh_configure_kernel_tlb(wh, x, y, addr, noc);
+}
+
+static void wormhole_release_kernel_window(struct tenstorrent_device *tt_dev)
+{
+	struct wormhole_device *wh = tt_dev_to_wh_dev(tt_dev);
+
+	mutex_unlock(&wh->kernel_tlb_mutex);
+}
+
 struct tenstorrent_device_class wormhole_class = {
 	.name = "Wormhole",
 	.instance_size = sizeof(struct wormhole_device),
@@ -1031,4 +1067,6 @@ struct tenstorrent_device_class wormhole_class = {
 	.restore_reset_state = wormhole_restore_reset_state,
 	.configure_outbound_atu = wormhole_configure_outbound_atu,
 	.noc_write32 = wormhole_noc_write32,
+	.configure_kernel_window = wormhole_configure_kernel_window,
+	.release_kernel_window = wormhole_release_kernel_window,
 };
@@ -10,6 +10,10 @@
 struct wormhole_device {
 	struct tenstorrent_device tt;
 	struct mutex kernel_tlb_mutex;	// Guards access to kernel_tlb
+	// What the kernel TLB is programmed with, so repeated accesses to the
+	// same 16M page skip the register writes. Cleared by a reset.
+	struct tenstorrent_noc_tlb_config kernel_tlb_config;
+	bool kernel_tlb_valid;
 
 	u8 __iomem *bar2_mapping;
 	u8 __iomem *bar4_mapping;